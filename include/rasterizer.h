@@ -29,15 +29,17 @@ typedef struct mat3 {
   float data[9];
 } mat3;
 
-typedef struct texture {
-  size_t w, h;
-  color *data;
-} texture;
-
 typedef enum color_format {
   ColorGray = 1,
   ColorRGB  = 3,
   ColorRGBA = 4,
+
+  /*
+   * Blocks of 4x4 pixels, row by row, that only textures accept: 8 bytes each
+   * for BC1 (DXT1), and 16 for BC3 (DXT5). The color type is ignored.
+   */
+  ColorBC1,
+  ColorBC3,
 } color_format;
 
 typedef enum color_type {
@@ -45,12 +47,109 @@ typedef enum color_type {
   ColorTypeByte,
 } color_type;
 
+typedef enum texture_filter {
+  FilterNearest,
+  FilterBilinear,
+
+  /* Bilinear, and blended between the two nearest mip levels. */
+  FilterTrilinear,
+} texture_filter;
+
+/* How coordinates outside of [0, 1] are sampled. */
+typedef enum texture_wrap {
+  WrapBorder, /* white */
+  WrapRepeat,
+  WrapClamp,
+} texture_wrap;
+
+/*
+ * Texels are stored row by row, with rows stride texels apart, unless tiled.
+ * Tiled data is made of blocks of 4x4 texels, each stored row by row, with
+ * the blocks themselves in rows. stride is then the width padded to a multiple
+ * of 4, and the height is padded as well.
+ *
+ * Compressed levels are tiled, but store their blocks in blocks rather than
+ * in data, in a compressed format.
+ */
+typedef struct texture_level {
+  size_t w, h, stride;
+  color *data;
+  bool tiled;
+
+  color_format format;
+  uint8_t *blocks;
+} texture_level;
+
+typedef struct texture {
+  size_t w, h;
+
+  /* Level 0, tiled unless it is owned by the caller. */
+  size_t stride;
+  color *data;
+  bool owns_data;
+  bool tiled;
+
+  /* ColorRGBA, or the format of blocks when compressed. */
+  color_format format;
+  uint8_t *blocks;
+
+  /*
+   * Levels 1 and up of the mip chain, each half the size of the one before,
+   * down to 1x1. They are always tiled, and compressed like level 0.
+   * Textures without mipmaps only sample level 0.
+   */
+  size_t mip_count;
+  texture_level *mips;
+  void *mip_data;
+
+  texture_filter filter;
+  texture_wrap wrap;
+} texture;
+
+/*
+ * The optional hierarchical depth buffer stores the depth range of square
+ * blocks of this size.
+ */
+#define DepthBlockSize 8
+
+/*
+ * Screen is split into square tiles of this size for multithreaded drawing,
+ * and for fast clears.
+ */
+#define TileSize 64
+
 typedef struct framebuffer {
   size_t w, h;
+
+  /* Rows of color_buffer are stride pixels apart. */
+  size_t stride;
   color *color_buffer;
+  bool owns_color_buffer;
+
   float *depth_buffer;
+
+  size_t depth_blocks_x, depth_blocks_y;
+  float *depth_min, *depth_max;
+
+  /*
+   * With fast clears, clearing only marks every tile, and the pixels of a
+   * tile are filled the first time it is drawn to, with the values the tile
+   * was cleared to.
+   */
+  size_t tiles_x, tiles_y;
+  uint8_t *cleared;
+  color *clear_colors;
+  float *clear_depths;
+
+  /* Tiles whose colors changed since changes were last acknowledged. */
+  bool *dirty;
 } framebuffer;
 
+/* A rectangle of pixels. */
+typedef struct pixel_rect {
+  size_t x, y, w, h;
+} pixel_rect;
+
 typedef struct vertex {
   vector3 pos;
   vector3 normal;
@@ -59,21 +158,52 @@ typedef struct vertex {
 } vertex;
 
 typedef struct processed_vertex {
-  bool done;
-
   vector3 eye;
   vector3 normal;
 
   vector2 tex_coord;
   color base_color;
 
+  vector4 clip_pos;
+  unsigned clip_code;
+
   vector3 frag_pos;
-  float w;
+  float inv_w;
 } processed_vertex;
 
+/*
+ * Processed vertices, stored as one array per attribute, so that each stage
+ * only loads the attributes it uses.
+ */
+typedef struct vertex_streams {
+  size_t capacity;
+
+  /* Vertices stamped with an older epoch than the current one are stale. */
+  uint32_t epoch;
+  uint32_t *epochs;
+
+  vector4 *clip_pos;
+  unsigned *clip_code;
+
+  vector3 *frag_pos;
+  float *inv_w;
+
+  vector3 *eye;
+  vector3 *normal;
+  vector2 *tex_coord;
+  color *base_color;
+} vertex_streams;
+
 typedef struct vertex_array {
   size_t n;
   vertex *data;
+
+  /*
+   * Unique among all arrays, and changed by every write, so that processed
+   * vertices can be reused until then. Code writing to data directly must call
+   * vertex_array_touch.
+   */
+  unsigned long version;
 } vertex_array;
 
 typedef struct index_array {
@@ -102,15 +232,29 @@ typedef enum depth_func {
   DepthTestGE,
 } depth_func;
 
+/*
+ * Frames submitted to a renderer are numbered from 1. A frame's number is its
+ * fence: it is signaled once the frame, and every frame before it, is drawn.
+ */
+typedef uint64_t fence;
+
 typedef struct renderer {
   framebuffer *target;
 
   texture *tex;
 
+  mat4 model, view;
+
   mat4 model_view;
   mat4 projection;
   mat3 normal_matrix;
 
+  /*
+   * Changed by set_mvp whenever the matrices change, unless they go back to
+   * those processed vertices were computed with.
+   */
+  unsigned long transform_version;
+
   material mat;
 
   size_t light_count;
@@ -124,8 +268,39 @@ typedef struct renderer {
 
   bool culling;
 
-  size_t vertex_count;
-  processed_vertex *vertices;
+  bool fragment_simd;
+
+  /* Fragment routines selected for the current draw. */
+  const struct fragment_pipeline *pipeline;
+
+  /*
+   * Processed vertices are kept across draws as long as the vertex array and
+   * the transforms they were processed with stay the same.
+   */
+  vertex_streams vertices;
+  unsigned long vertices_array_version;
+  unsigned long vertices_transform_version;
+  mat4 vertices_model_view, vertices_projection;
+
+  size_t pending_capacity;
+  uint32_t *pending_vertices;
+
+  /*
+   * Draws only use threads when there is a pool, which the renderer of the
+   * queue takes over while submission is asynchronous.
+   */
+  size_t thread_count;
+  struct thread_pool *pool;
+
+  size_t clip_vertex_count;
+  vertex_streams clip_vertices;
+
+  struct tile_bins *bins;
+
+  struct deferred_frame *deferred;
+
+  fence submitted_fence;
+  struct render_queue *queue;
 } renderer;
 
 typedef enum draw_mode {
@@ -134,14 +309,113 @@ typedef enum draw_mode {
   DrawTriangles,
 } draw_mode;
 
+/* A draw recorded in a command buffer, with the state it was recorded in. */
+typedef struct draw_command {
+  draw_mode mode;
+  index_array *indices; /* NULL for draw_array */
+  vertex_array *array;
+  size_t i, n;
+
+  texture *tex;
+  mat4 model, view, projection;
+  material mat;
+
+  bool lighting;
+
+  depth_func depth_func;
+  bool depth_test_flag;
+
+  bool culling;
+
+  /*
+   * Average position of the vertices of the draw, used to sort it by depth.
+   * Computed on the first sorted submit, and again whenever the vertex array
+   * gets a version other than center_version, which is 0 until then.
+   */
+  vector3 center;
+  unsigned long center_version;
+} draw_command;
+
+typedef struct command_buffer {
+  size_t count, capacity;
+  draw_command *commands;
+
+  size_t order_capacity;
+  struct command_order *order;
+} command_buffer;
+
+/*
+ * A frame: the command buffer to draw into target, after clearing it as
+ * requested.
+ */
+typedef struct frame_request {
+  framebuffer *target;
+
+  bool clear_color_flag;
+  color clear_color;
+
+  bool clear_depth_flag;
+  float clear_depth;
+
+  command_buffer *commands;
+  bool sort;
+} frame_request;
+
 /* Textures */
 
+/*
+ * Copies pixels into a tiled texture, where texels close to each other are
+ * close in memory whatever the direction they are sampled in. Pixels in a
+ * compressed format stay compressed, and are decoded as they are sampled.
+ */
 int load_texture(texture *tex, size_t w, size_t h,
                  color_format format, color_type type, const void *buffer);
 void release_texture(texture *tex);
 
-void texture_write(texture *tex, size_t x, size_t y, size_t w, size_t h,
-                   color_format format, color_type type, const void *buffer);
+/*
+ * Makes a texture that samples pixels owned by the caller, with rows stride
+ * bytes apart, without copying them. stride must be a multiple of the size of
+ * a color. The pixels stay in rows, so that the caller can keep using them.
+ */
+int wrap_texture(texture *tex, size_t w, size_t h,
+                 color *pixels, size_t stride);
+
+/*
+ * Makes a texture that samples the color buffer of a framebuffer, without
+ * copying it, so that it sees everything drawn there. It stays valid until the
+ * framebuffer is released. Fast clears are turned off on the framebuffer,
+ * since they leave pixels to be filled later. A texture must not be used while
+ * drawing to the framebuffer it samples.
+ */
+int texture_from_framebuffer(texture *tex, framebuffer *fb);
+
+/*
+ * Builds the mip chain from level 0. texture_write keeps it up to date, by
+ * only computing again the texels of each level that the pixels written
+ * cover. It must be built again after drawing to a framebuffer a texture
+ * samples.
+ * The level sampled is chosen for each 4x2 group of pixels.
+ */
+int generate_mipmaps(texture *tex);
+bool has_mipmaps(const texture *tex);
+
+/* Textures are sampled with FilterNearest and WrapBorder by default. */
+void set_texture_filter(texture *tex, texture_filter filter);
+texture_filter get_texture_filter(const texture *tex);
+
+void set_texture_wrap(texture *tex, texture_wrap wrap);
+texture_wrap get_texture_wrap(const texture *tex);
+
+/*
+ * Pixels are read and written in rows, whatever the layout of the texture.
+ * Writing to a compressed texture compresses every block it touches again.
+ * Compressed texels can also be copied as they are, in the format of the
+ * texture, over regions that start at the corner of a block. Otherwise
+ * texture_write returns -1 without writing anything, and texture_read reads
+ * nothing.
+ */
+int texture_write(texture *tex, size_t x, size_t y, size_t w, size_t h,
+                  color_format format, color_type type, const void *buffer);
 void texture_read(const texture *tex, size_t x, size_t y, size_t w, size_t h,
                   color_format format, color_type type, void *buffer);
 
@@ -151,11 +425,40 @@ size_t texture_height(const texture *tex);
 /* Framebuffer manipulation */
 
 int make_framebuffer(framebuffer *fb, size_t w, size_t h);
+
+/*
+ * Makes a framebuffer that draws straight into memory owned by the caller,
+ * such as a shared memory segment, with rows stride bytes apart. stride must
+ * be a multiple of the size of a color. Fast clears are off, so that the
+ * memory always holds the image.
+ */
+int wrap_framebuffer(framebuffer *fb, size_t w, size_t h,
+                     color *pixels, size_t stride);
 void framebuffer_release(framebuffer *fb);
 
+/*
+ * On the target of a renderer in deferred mode, call resolve_deferred first:
+ * draws that were not resolved are otherwise shaded over the clear color.
+ */
 void clear_color_buffer(framebuffer *fb, color c);
 void clear_depth_buffer(framebuffer *fb, float z);
 
+/*
+ * Keeps the minimum and maximum depth of each block of the framebuffer, so
+ * that the rasterizer can skip blocks a triangle cannot pass the depth test
+ * in.
+ */
+int set_hierarchical_depth(framebuffer *fb, bool on);
+bool get_hierarchical_depth(const framebuffer *fb);
+
+/*
+ * Fast clears are on by default. Turning them off fills the tiles that are
+ * still pending, and clears then write every pixel.
+ */
+int set_fast_clear(framebuffer *fb, bool on);
+bool get_fast_clear(const framebuffer *fb);
+
+/* Compressed formats are only for textures: nothing is read in those. */
 void framebuffer_read(const framebuffer *fb,
                       size_t x, size_t y, size_t w, size_t h,
                       color_format format, color_type type, void *buffer);
@@ -166,6 +469,23 @@ void depthbuffer_read(const framebuffer *fb,
 size_t framebuffer_width(const framebuffer *fb);
 size_t framebuffer_height(const framebuffer *fb);
 
+/*
+ * Framebuffers track the tiles whose colors may have changed, so that only
+ * those need to be read back. framebuffer_dirty_rects stores up to max
+ * rectangles covering them, made of runs of tiles on the same row, and
+ * returns how many there are. framebuffer_read_rects reads rectangles like
+ * framebuffer_read, one after the other in buffer.
+ */
+size_t framebuffer_dirty_rects(const framebuffer *fb,
+                               pixel_rect *rects, size_t max);
+void framebuffer_read_rects(const framebuffer *fb,
+                            size_t n, const pixel_rect *rects,
+                            color_format format, color_type type,
+                            void *buffer);
+
+/* Marks every tile as unchanged, once the dirty ones have been read. */
+void framebuffer_acknowledge(framebuffer *fb);
+
 /* Vertex arrays */
 
 int make_vertex_array(vertex_array *array, size_t n, const vertex *data);
@@ -178,6 +498,9 @@ void vertex_array_read(const vertex_array *array, size_t i, size_t n,
 
 size_t vertex_array_size(const vertex_array *array);
 
+/* Marks the array as changed. */
+void vertex_array_touch(vertex_array *array);
+
 /* Index arrays */
 
 int make_index_array(index_array *array, size_t n, const uint32_t *data);
@@ -223,7 +546,6 @@ vector3 vector3_scale(float f, vector3 a);
      0, 0, 1}        \
   }
 
-
 mat3 mat3_transposed_inverse(mat3 m);
 vector3 mat3_apply(mat3 m, vector3 v);
 
@@ -249,11 +571,41 @@ mat4 mat4_perspective(float fov, float aspect, float z_near, float z_far);
 vector3 mat4_apply(mat4 m, vector3 v);
 vector4 mat4_project(mat4 m, vector3 v);
 
+/*
+ * Batched versions of the functions above, for n vectors. Inputs are read
+ * every stride bytes, so that they can be a field of an array of structures,
+ * and outputs are packed. out may be the same array as in when stride is the
+ * size of a vector3.
+ */
+void vector3_normalize_n(const vector3 *in, size_t stride, vector3 *out,
+                         size_t n);
+void mat3_apply_n(mat3 m, const vector3 *in, size_t stride, vector3 *out,
+                  size_t n);
+void mat4_apply_n(mat4 m, const vector3 *in, size_t stride, vector3 *out,
+                  size_t n);
+void mat4_project_n(mat4 m, const vector3 *in, size_t stride, vector4 *out,
+                    size_t n);
+
 /* Renderer state */
 
 void make_renderer(renderer *state, framebuffer *target);
 void release_renderer(renderer *state);
 
+/*
+ * Changes the framebuffer draws go to. In deferred mode, draws that were not
+ * resolved yet are first resolved into the previous target.
+ */
+int set_target(renderer *state, framebuffer *target);
+framebuffer *current_target(const renderer *state);
+
+/*
+ * Clear the target like clear_color_buffer and clear_depth_buffer. Targets
+ * without fast clears are filled on the renderer's threads. In deferred mode,
+ * clearing the color drops the draws that were not resolved yet.
+ */
+void clear_target_color(renderer *state, color c);
+void clear_target_depth(renderer *state, float z);
+
 void use_texture(renderer *state, texture *tex);
 texture *current_texture(const renderer *state);
 
@@ -278,6 +630,21 @@ bool get_depth_test(const renderer *state);
 void set_culling(renderer *state, bool on);
 bool get_culling(const renderer *state);
 
+/*
+ * Draws are rasterized on n threads (counting the caller) when n > 1, by
+ * binning triangles into tiles first. 0 and 1 both select the single-threaded
+ * path.
+ */
+int set_thread_count(renderer *state, size_t n);
+size_t get_thread_count(const renderer *state);
+
+/*
+ * Fragments are shaded eight at a time with AVX2 when the CPU supports it,
+ * which is the default. Fails when enabling it on other CPUs.
+ */
+int set_fragment_simd(renderer *state, bool on);
+bool get_fragment_simd(const renderer *state);
+
 /* Drawing */
 
 int draw_array(renderer *state, draw_mode mode,
@@ -286,4 +653,73 @@ int draw_elements(renderer *state, draw_mode mode,
                   index_array *indices, vertex_array *array,
                   size_t i, size_t n);
 
+/*
+ * In deferred mode, draws only store the depth and the id of the visible
+ * triangle at each pixel. resolve_deferred then shades every pixel covered
+ * since the last resolve exactly once, using the texture, material and lights
+ * of the draw that pixel came from.
+ */
+int set_deferred_shading(renderer *state, bool on);
+bool get_deferred_shading(const renderer *state);
+
+int resolve_deferred(renderer *state);
+
+/* Command buffers */
+
+/*
+ * A command buffer records draws along with the renderer state they are made
+ * in, so that a scene can be replayed every frame without being traversed
+ * again. Arrays and textures are referenced, not copied.
+ */
+void make_command_buffer(command_buffer *commands);
+void command_buffer_release(command_buffer *commands);
+
+/* Removes all the recorded draws. */
+void command_buffer_clear(command_buffer *commands);
+
+int record_draw_array(command_buffer *commands, const renderer *state,
+                      draw_mode mode, vertex_array *array, size_t i, size_t n);
+int record_draw_elements(command_buffer *commands, const renderer *state,
+                         draw_mode mode, index_array *indices,
+                         vertex_array *array, size_t i, size_t n);
+
+/*
+ * Replays the recorded draws, with the lights and other settings of the
+ * renderer, and leaves its state as it was. When sorting, draws whose result
+ * does not depend on their order (those tested with DepthTestLT, LE, GT or GE)
+ * are regrouped by state, and drawn front to back within each group; other
+ * draws keep their place, and so do draws that switch between LT/LE and
+ * GT/GE. Images only differ where two draws reach the same depth at a pixel.
+ */
+int submit_command_buffer(renderer *state, command_buffer *commands,
+                          bool sort);
+
+/* Frame submission */
+
+/*
+ * Frames are drawn one after the other on a background thread, with a
+ * renderer of its own, when asynchronous submission is on. The caller can then
+ * record the next frame or read back a previous one, into a different target,
+ * while a frame is being drawn. Turning it off waits for pending frames.
+ * Frames are drawn on the threads of the caller's renderer, so anything it
+ * draws itself in the meantime is drawn on the calling thread only.
+ */
+int set_async_submission(renderer *state, bool on);
+bool get_async_submission(const renderer *state);
+
+/*
+ * Draws a frame with the lights, thread count, and fragment and deferred
+ * shading settings the renderer has when the frame is submitted, resolving it
+ * in deferred mode. Until its fence is signaled, the target, the command
+ * buffer and everything it references must be left untouched. Returns 0 if
+ * the frame could not be queued. Frames drawn synchronously leave their target
+ * as the target of the renderer.
+ */
+fence submit_frame(renderer *state, const frame_request *frame);
+
+bool fence_signaled(const renderer *state, fence f);
+
+/* Returns -1 if any frame up to f could not be drawn. */
+int fence_wait(renderer *state, fence f);
+
 #endif
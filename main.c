@@ -16,6 +16,9 @@
 
 #define Pi 3.14159265358979323846
 
+/* Frames in flight: one is drawn while the previous one is shown. */
+#define FrameCount 2
+
 #define CameraMouseSpeed 0.1 /* rad/sec */
 #define CameraMoveSpeed  10.0 /* units per second, for each dimension */
 
@@ -144,7 +147,8 @@ int main(int argc, char **argv) {
 
   glEnable(GL_FRAMEBUFFER_SRGB);
 
-  color color_data[640*480];
+  /* Frames are drawn straight into the memory they are uploaded from. */
+  static color color_data[FrameCount][640*480];
 
   mat4 sphere_model = mat4_mul(mat4_translate((vector3){0, 0, 0}),
                                mat4_scale((vector3){3, 3, 3}));
@@ -188,15 +192,23 @@ int main(int argc, char **argv) {
   camera camera;
   camera_init(&camera, 640.0/480.0);
 
-  framebuffer fb;
+  framebuffer fbs[FrameCount];
+  command_buffer command_buffers[FrameCount];
+  fence fences[FrameCount];
   vertex_array array;
   index_array indices;
   renderer state;
 
-  make_framebuffer(&fb, 640, 480);
+  for (size_t i = 0; i < FrameCount; i++) {
+    wrap_framebuffer(&fbs[i], 640, 480, color_data[i], sizeof(color)*640);
+    make_command_buffer(&command_buffers[i]);
+    fences[i] = 0;
+  }
+
   make_vertex_array(&array, VertexCount, sphere_vertices);
   make_index_array(&indices, IndexCount, sphere_indices);
-  make_renderer(&state, &fb);
+  make_renderer(&state, &fbs[0]);
+  set_async_submission(&state, true);
   set_depth_test(&state, true);
   set_culling(&state, true);
   light l = (light){
@@ -217,27 +229,45 @@ int main(int argc, char **argv) {
   glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_HIDDEN);
   glfwSetCursorPos(window, 320, 240);
 
+  size_t frame_i = 0;
+
   float old_time = glfwGetTime();
   while (!glfwWindowShouldClose(window)) {
     float new_time = glfwGetTime();
     float delta_t = (new_time - old_time);
     old_time = new_time;
 
+    /* The previous frame drawn into this target has already been shown. */
+    command_buffer *commands = &command_buffers[frame_i];
+    fence_wait(&state, fences[frame_i]);
+
+    command_buffer_clear(commands);
     set_mvp(&state,
             sphere_model,
             camera_view(&camera),
             camera_projection(&camera));
-    clear_color_buffer(&fb, (color){0, 0, 3, 1});
-    clear_depth_buffer(&fb, 1);
-    draw_elements(&state, DrawTriangles, &indices, &array, 0,
-                  IndexCount);
-    framebuffer_read(&fb, 0, 0, 640, 480, ColorRGBA, ColorTypeByte,
-                     color_data);
-    glTexSubImage2D(GL_TEXTURE_2D, 0,
-                    0, 0, 640, 480,
-                    GL_RGBA, GL_UNSIGNED_BYTE, color_data);
+    record_draw_elements(commands, &state, DrawTriangles, &indices, &array,
+                         0, IndexCount);
+
+    fences[frame_i] = submit_frame(&state, &(frame_request){
+      &fbs[frame_i],
+      true, (color){0, 0, 3, 1},
+      true, 1,
+      commands, false,
+    });
+
+    /* Show the previous frame while this one is being drawn. */
+    size_t shown_i = (frame_i + FrameCount - 1) % FrameCount;
+    if (fences[shown_i] != 0) {
+      fence_wait(&state, fences[shown_i]);
+      glTexSubImage2D(GL_TEXTURE_2D, 0,
+                      0, 0, 640, 480,
+                      GL_RGBA, GL_UNSIGNED_BYTE, color_data[shown_i]);
+    }
     glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 
+    frame_i = (frame_i + 1) % FrameCount;
+
     double mouse_x, mouse_y;
     glfwGetCursorPos(window, &mouse_x, &mouse_y);
     glfwSetCursorPos(window, 320, 240);
@@ -263,9 +293,14 @@ int main(int argc, char **argv) {
     glfwPollEvents();
   }
 
+  release_renderer(&state);
   index_array_release(&indices);
   vertex_array_release(&array);
-  framebuffer_release(&fb);
+
+  for (size_t i = 0; i < FrameCount; i++) {
+    command_buffer_release(&command_buffers[i]);
+    framebuffer_release(&fbs[i]);
+  }
   free(sphere_indices);
   free(sphere_vertices);
 
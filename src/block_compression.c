@@ -0,0 +1,226 @@
+#include "block_compression.h"
+#include <stdlib.h>
+
+static color bc1_color(uint16_t c0, uint16_t c1, int i, bool four_colors);
+static uint8_t bc3_alpha(uint8_t a0, uint8_t a1, int i);
+
+static color expand_565(uint16_t c);
+static uint16_t pack_565(color c);
+
+static void encode_colors(const color texels[BlockTexelCount], uint8_t *block,
+                          bool transparent);
+static void encode_alpha(const color texels[BlockTexelCount], uint8_t *block);
+static int color_distance(color a, color b);
+
+static uint16_t load_16(const uint8_t *p);
+static uint32_t load_32(const uint8_t *p);
+static void store_16(uint8_t *p, uint16_t v);
+static void store_32(uint8_t *p, uint32_t v);
+
+bool is_compressed(color_format format) {
+  return format == ColorBC1 || format == ColorBC3;
+}
+
+size_t compressed_block_size(color_format format) {
+  return format == ColorBC1 ? 8 : 16;
+}
+
+color decode_texel(color_format format, const uint8_t *block, size_t i) {
+  if (format == ColorBC1) {
+    uint16_t c0 = load_16(block), c1 = load_16(block + 2);
+    return bc1_color(c0, c1, load_32(block + 4) >> 2*i & 3, c0 > c1);
+  }
+
+  /* BC3 blocks are alpha, then colors that always have a palette of four. */
+  const uint8_t *colors = block + 8;
+  color c = bc1_color(load_16(colors), load_16(colors + 2),
+                      load_32(colors + 4) >> 2*i & 3, true);
+
+  size_t bit = 16 + 3*i;
+  c.a = bc3_alpha(block[0], block[1], load_32(block + bit/8) >> bit%8 & 7);
+
+  return c;
+}
+
+void encode_block(color_format format, const color texels[BlockTexelCount],
+                  uint8_t *block) {
+  if (format == ColorBC1)
+    encode_colors(texels, block, true);
+  else {
+    encode_alpha(texels, block);
+    encode_colors(texels, block + 8, false);
+  }
+}
+
+/* Color i of the palette of a block. Only four colors are opaque. */
+static color bc1_color(uint16_t c0, uint16_t c1, int i, bool four_colors) {
+  color a = expand_565(c0), b = expand_565(c1);
+
+  switch (i) {
+  case 0: return a;
+  case 1: return b;
+  case 2:
+    if (four_colors) {
+      return (color){
+        (2*a.r + b.r) / 3, (2*a.g + b.g) / 3, (2*a.b + b.b) / 3, 255,
+      };
+    }
+    else
+      return (color){(a.r + b.r) / 2, (a.g + b.g) / 2, (a.b + b.b) / 2, 255};
+  default:
+    if (four_colors) {
+      return (color){
+        (a.r + 2*b.r) / 3, (a.g + 2*b.g) / 3, (a.b + 2*b.b) / 3, 255,
+      };
+    }
+    else
+      return (color){0, 0, 0, 0};
+  }
+}
+
+/* Interpolates 6 alphas when a0 > a1, and 4 and then 0 and 255 otherwise. */
+static uint8_t bc3_alpha(uint8_t a0, uint8_t a1, int i) {
+  if (i == 0) return a0;
+  if (i == 1) return a1;
+
+  if (a0 > a1) return ((8 - i)*a0 + (i - 1)*a1) / 7;
+
+  if (i == 6) return 0;
+  if (i == 7) return 255;
+
+  return ((6 - i)*a0 + (i - 1)*a1) / 5;
+}
+
+static color expand_565(uint16_t c) {
+  int r = c >> 11, g = c >> 5 & 63, b = c & 31;
+  return (color){r << 3 | r >> 2, g << 2 | g >> 4, b << 3 | b >> 2, 255};
+}
+
+static uint16_t pack_565(color c) {
+  return (c.r*31 + 127) / 255 << 11 |
+    (c.g*63 + 127) / 255 << 5 |
+    (c.b*31 + 127) / 255;
+}
+
+/*
+ * transparent: whether texels less than half opaque are stored as transparent,
+ * which takes the palette of three colors.
+ */
+static void encode_colors(const color texels[BlockTexelCount], uint8_t *block,
+                          bool transparent) {
+  color lo = {255, 255, 255, 255}, hi = {0, 0, 0, 255};
+  bool has_transparent = false, has_opaque = false;
+
+  for (size_t i = 0; i < BlockTexelCount; i++) {
+    color c = texels[i];
+
+    if (transparent && c.a < 128) {
+      has_transparent = true;
+      continue;
+    }
+
+    has_opaque = true;
+
+    if (c.r < lo.r) lo.r = c.r;
+    if (c.g < lo.g) lo.g = c.g;
+    if (c.b < lo.b) lo.b = c.b;
+    if (c.r > hi.r) hi.r = c.r;
+    if (c.g > hi.g) hi.g = c.g;
+    if (c.b > hi.b) hi.b = c.b;
+  }
+
+  if (!has_opaque) lo = hi;
+
+  /* Every channel of hi is at least that of lo, so that c_hi >= c_lo. */
+  uint16_t c_lo = pack_565(lo), c_hi = pack_565(hi);
+  uint16_t c0 = has_transparent ? c_lo : c_hi;
+  uint16_t c1 = has_transparent ? c_hi : c_lo;
+
+  bool four_colors = !transparent || c0 > c1;
+
+  color palette[4];
+  for (int k = 0; k < 4; k++)
+    palette[k] = bc1_color(c0, c1, k, four_colors);
+
+  uint32_t bits = 0;
+
+  for (size_t i = 0; i < BlockTexelCount; i++) {
+    int best = 3;
+
+    if (!has_transparent || texels[i].a >= 128) {
+      int opaque_count = four_colors ? 4 : 3;
+      int best_distance = color_distance(palette[0], texels[i]);
+      best = 0;
+
+      for (int k = 1; k < opaque_count; k++) {
+        int distance = color_distance(palette[k], texels[i]);
+
+        if (distance < best_distance) {
+          best = k;
+          best_distance = distance;
+        }
+      }
+    }
+
+    bits |= (uint32_t)best << 2*i;
+  }
+
+  store_16(block, c0);
+  store_16(block + 2, c1);
+  store_32(block + 4, bits);
+}
+
+static void encode_alpha(const color texels[BlockTexelCount], uint8_t *block) {
+  uint8_t lo = 255, hi = 0;
+
+  for (size_t i = 0; i < BlockTexelCount; i++) {
+    if (texels[i].a < lo) lo = texels[i].a;
+    if (texels[i].a > hi) hi = texels[i].a;
+  }
+
+  uint64_t bits = 0;
+
+  for (size_t i = 0; i < BlockTexelCount; i++) {
+    int best = 0, best_distance = 256;
+
+    for (int k = 0; k < 8; k++) {
+      int distance = abs(bc3_alpha(hi, lo, k) - texels[i].a);
+
+      if (distance < best_distance) {
+        best = k;
+        best_distance = distance;
+      }
+    }
+
+    bits |= (uint64_t)best << 3*i;
+  }
+
+  block[0] = hi;
+  block[1] = lo;
+
+  for (int k = 0; k < 6; k++)
+    block[2 + k] = bits >> 8*k;
+}
+
+static int color_distance(color a, color b) {
+  int dr = a.r - b.r, dg = a.g - b.g, db = a.b - b.b;
+  return dr*dr + dg*dg + db*db;
+}
+
+static uint16_t load_16(const uint8_t *p) {
+  return p[0] | p[1] << 8;
+}
+
+static uint32_t load_32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void store_16(uint8_t *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void store_32(uint8_t *p, uint32_t v) {
+  store_16(p, v);
+  store_16(p + 2, v >> 16);
+}
@@ -0,0 +1,24 @@
+#ifndef BLOCK_COMPRESSION_H_
+#define BLOCK_COMPRESSION_H_
+
+#include "rasterizer.h"
+
+/* Texels in a compressed block of 4x4, numbered row by row. */
+#define BlockTexelCount 16
+
+bool is_compressed(color_format format);
+
+/* Size in bytes of a block of a compressed format. */
+size_t compressed_block_size(color_format format);
+
+/* Decodes texel i of a block. */
+color decode_texel(color_format format, const uint8_t *block, size_t i);
+
+/*
+ * Compresses a block, with endpoints at the corners of the box that bounds its
+ * texels. BC1 blocks with texels less than half opaque keep them transparent.
+ */
+void encode_block(color_format format, const color texels[BlockTexelCount],
+                  uint8_t *block);
+
+#endif
@@ -1,169 +1,335 @@
 #include "rasterizer.h"
+#include "color_buffer.h"
+#include <string.h>
 
-static
-void color_buffer_write_float(color *cbuffer, size_t buf_w, size_t buf_h,
-                              size_t x, size_t y, size_t w, size_t h,
-                              color_format format, const float *buffer);
+#ifdef HAVE_AVX2
+#include <immintrin.h>
 
-static
-void color_buffer_write_byte(color *cbuffer, size_t buf_w, size_t buf_h,
-                             size_t x, size_t y, size_t w, size_t h,
-                             color_format format, const uint8_t *buffer);
+#define TargetAvx2 __attribute__((target("avx2")))
+#endif
 
-static
-void color_buffer_read_float(const color *cbuffer, size_t buf_w, size_t buf_h,
-                             size_t x, size_t y, size_t w, size_t h,
-                             color_format format, float *buffer);
+/*
+ * Pixels are converted a row at a time, by kernels selected once per call.
+ * Float pixels go through bytes, a chunk of this many pixels at a time, so
+ * that every format has the same kernels for both types.
+ */
+#define ChunkSize 256
 
-static
-void color_buffer_read_byte(const color *cbuffer, size_t buf_w, size_t buf_h,
-                            size_t x, size_t y, size_t w, size_t h,
-                            color_format format, uint8_t *buffer);
+/* Convert n pixels between a color buffer and packed bytes. */
+typedef void write_row_func(color *dst, const uint8_t *src, size_t n);
+typedef void read_row_func(uint8_t *dst, const color *src, size_t n);
 
+/* Convert n components between floats and bytes. */
+typedef void to_bytes_func(uint8_t *dst, const float *src, size_t n);
+typedef void to_floats_func(float *dst, const uint8_t *src, size_t n);
+
+typedef struct row_kernels {
+  write_row_func *write[ColorRGBA + 1];
+  read_row_func *read[ColorRGBA + 1];
+
+  to_bytes_func *to_bytes;
+  to_floats_func *to_floats;
+} row_kernels;
+
+static const row_kernels *select_kernels(void);
+
+static void write_gray(color *dst, const uint8_t *src, size_t n);
+static void write_rgb(color *dst, const uint8_t *src, size_t n);
+static void write_rgba(color *dst, const uint8_t *src, size_t n);
+
+static void read_gray(uint8_t *dst, const color *src, size_t n);
+static void read_rgb(uint8_t *dst, const color *src, size_t n);
+static void read_rgba(uint8_t *dst, const color *src, size_t n);
+
+static void to_bytes(uint8_t *dst, const float *src, size_t n);
+static void to_floats(float *dst, const uint8_t *src, size_t n);
+
+static uint8_t luminance(color c);
+
+static const row_kernels scalar_kernels = {
+  {[ColorGray] = write_gray, [ColorRGB] = write_rgb, [ColorRGBA] = write_rgba},
+  {[ColorGray] = read_gray, [ColorRGB] = read_rgb, [ColorRGBA] = read_rgba},
+  to_bytes, to_floats,
+};
+
+#ifdef HAVE_AVX2
+static void write_gray_avx2(color *dst, const uint8_t *src, size_t n);
+static void write_rgb_avx2(color *dst, const uint8_t *src, size_t n);
+
+static void read_gray_avx2(uint8_t *dst, const color *src, size_t n);
+static void read_rgb_avx2(uint8_t *dst, const color *src, size_t n);
+
+static void to_bytes_avx2(uint8_t *dst, const float *src, size_t n);
+static void to_floats_avx2(float *dst, const uint8_t *src, size_t n);
+
+/* RGBA rows are already copied with memcpy. */
+static const row_kernels avx2_kernels = {
+  {
+    [ColorGray] = write_gray_avx2, [ColorRGB] = write_rgb_avx2,
+    [ColorRGBA] = write_rgba,
+  },
+  {
+    [ColorGray] = read_gray_avx2, [ColorRGB] = read_rgb_avx2,
+    [ColorRGBA] = read_rgba,
+  },
+  to_bytes_avx2, to_floats_avx2,
+};
+#endif
 
 void color_buffer_write(color *cbuffer, size_t buf_w, size_t buf_h,
                         size_t x, size_t y, size_t w, size_t h,
                         color_format format, color_type type,
                         const void *buffer) {
-  switch (type) {
-  case ColorTypeFloat: color_buffer_write_float(cbuffer, buf_w, buf_h,
-                                                x, y, w, h, format, buffer);
-    break;
-  case ColorTypeByte: color_buffer_write_byte(cbuffer, buf_w, buf_h,
-                                              x, y, w, h, format, buffer);
-    break;
+  const row_kernels *kernels = select_kernels();
+  write_row_func *write = kernels->write[format];
+
+  /* Rows that span the whole buffer are converted as a single one. */
+  if (w == buf_w) {
+    w *= h;
+    h = 1;
+  }
+
+  for (size_t j = 0; j < h; j++) {
+    color *dst = &cbuffer[x+(y+j)*buf_w];
+
+    if (type == ColorTypeByte) {
+      write(dst, (const uint8_t*)buffer + j*w*format, w);
+      continue;
+    }
+
+    const float *src = (const float*)buffer + j*w*format;
+    uint8_t chunk[ChunkSize * ColorRGBA];
+
+    for (size_t i = 0; i < w; i += ChunkSize) {
+      size_t n = w - i < ChunkSize ? w - i : ChunkSize;
+
+      kernels->to_bytes(chunk, src + i*format, n*format);
+      write(dst + i, chunk, n);
+    }
   }
 }
 
 void color_buffer_read(const color *cbuffer, size_t buf_w, size_t buf_h,
                        size_t x, size_t y, size_t w, size_t h,
                        color_format format, color_type type, void *buffer) {
-  switch (type) {
-  case ColorTypeFloat: color_buffer_read_float(cbuffer, buf_w, buf_h,
-                                               x, y, w, h, format, buffer);
-    break;
-  case ColorTypeByte: color_buffer_read_byte(cbuffer, buf_w, buf_h,
-                                             x, y, w, h, format, buffer);
-    break;
+  const row_kernels *kernels = select_kernels();
+  read_row_func *read = kernels->read[format];
+
+  if (w == buf_w) {
+    w *= h;
+    h = 1;
   }
-}
 
-static
-void color_buffer_write_float(color *cbuffer, size_t buf_w, size_t buf_h,
-                              size_t x, size_t y, size_t w, size_t h,
-                              color_format format, const float *buffer) {
   for (size_t j = 0; j < h; j++) {
-    for (size_t i = 0; i < w; i++) {
-      color *pixel = &cbuffer[x+i+(y+j)*buf_w];
-      const float *data  = &buffer[(i+w*j)*format];
-
-      switch (format) {
-      case ColorGray:
-        pixel->r = pixel->g = pixel->b = data[0] * 255;
-        pixel->a = 255;
-        break;
-      case ColorRGB:
-        pixel->r = data[0] * 255;
-        pixel->g = data[1] * 255;
-        pixel->b = data[2] * 255;
-        pixel->a = 255;
-        break;
-      case ColorRGBA:
-        pixel->r = data[0] * 255;
-        pixel->g = data[1] * 255;
-        pixel->b = data[2] * 255;
-        pixel->a = data[3] * 255;
-        break;
-      }
+    const color *src = &cbuffer[x+(y+j)*buf_w];
+
+    if (type == ColorTypeByte) {
+      read((uint8_t*)buffer + j*w*format, src, w);
+      continue;
+    }
+
+    float *dst = (float*)buffer + j*w*format;
+    uint8_t chunk[ChunkSize * ColorRGBA];
+
+    for (size_t i = 0; i < w; i += ChunkSize) {
+      size_t n = w - i < ChunkSize ? w - i : ChunkSize;
+
+      read(chunk, src + i, n);
+      kernels->to_floats(dst + i*format, chunk, n*format);
     }
   }
 }
 
-static
-void color_buffer_write_byte(color *cbuffer, size_t buf_w, size_t buf_h,
-                             size_t x, size_t y, size_t w, size_t h,
-                             color_format format, const uint8_t *buffer) {
-  for (size_t j = 0; j < h; j++) {
-    for (size_t i = 0; i < w; i++) {
-      color *pixel = &cbuffer[x+i+(y+j)*buf_w];
-      const uint8_t *data  = &buffer[(i+w*j)*format];
-
-      switch (format) {
-      case ColorGray:
-        pixel->r = pixel->g = pixel->b = data[0];
-        pixel->a = 255;
-        break;
-      case ColorRGB:
-        pixel->r = data[0];
-        pixel->g = data[1];
-        pixel->b = data[2];
-        pixel->a = 255;
-        break;
-      case ColorRGBA:
-        pixel->r = data[0];
-        pixel->g = data[1];
-        pixel->b = data[2];
-        pixel->a = data[3];
-        break;
-      }
-    }
+static const row_kernels *select_kernels(void) {
+#ifdef HAVE_AVX2
+  if (__builtin_cpu_supports("avx2")) return &avx2_kernels;
+#endif
+
+  return &scalar_kernels;
+}
+
+static void write_gray(color *dst, const uint8_t *src, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    dst[i] = (color){src[i], src[i], src[i], 255};
+}
+
+static void write_rgb(color *dst, const uint8_t *src, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    dst[i] = (color){src[3*i], src[3*i+1], src[3*i+2], 255};
+}
+
+static void write_rgba(color *dst, const uint8_t *src, size_t n) {
+  memcpy(dst, src, n * sizeof(*dst));
+}
+
+static void read_gray(uint8_t *dst, const color *src, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    dst[i] = luminance(src[i]);
+}
+
+static void read_rgb(uint8_t *dst, const color *src, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    dst[3*i]   = src[i].r;
+    dst[3*i+1] = src[i].g;
+    dst[3*i+2] = src[i].b;
   }
 }
 
-static
-void color_buffer_read_float(const color *cbuffer, size_t buf_w, size_t buf_h,
-                             size_t x, size_t y, size_t w, size_t h,
-                             color_format format, float *buffer) {
-  for (size_t j = 0; j < h; j++) {
-    for (size_t i = 0; i < w; i++) {
-      const color *pixel = &cbuffer[x+i+(y+j)*buf_w];
-      float *data  = &buffer[(i+w*j)*format];
-
-      switch (format) {
-      case ColorGray:
-        /* Not actually supported. */
-        break;
-      case ColorRGB:
-        data[0] = (float)pixel->r / 255.0;
-        data[1] = (float)pixel->g / 255.0;
-        data[2] = (float)pixel->b / 255.0;
-        break;
-      case ColorRGBA:
-        data[0] = (float)pixel->r / 255.0;
-        data[1] = (float)pixel->g / 255.0;
-        data[2] = (float)pixel->b / 255.0;
-        data[3] = (float)pixel->a / 255.0;
-        break;
-      }
-    }
+static void read_rgba(uint8_t *dst, const color *src, size_t n) {
+  memcpy(dst, src, n * sizeof(*src));
+}
+
+static void to_bytes(uint8_t *dst, const float *src, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    dst[i] = src[i] * 255;
+}
+
+static void to_floats(float *dst, const uint8_t *src, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    dst[i] = src[i] / 255.0f;
+}
+
+/* Weights add up to 256, so that gray pixels are read back unchanged. */
+static uint8_t luminance(color c) {
+  return (77*c.r + 150*c.g + 29*c.b) >> 8;
+}
+
+#ifdef HAVE_AVX2
+
+/*
+ * The vectorized kernels handle eight pixels at a time and leave the rest of
+ * the row to the scalar ones. Loads and stores may go past the eight pixels
+ * being converted, but never past the end of the row.
+ */
+
+TargetAvx2
+static void write_gray_avx2(color *dst, const uint8_t *src, size_t n) {
+  const __m256i spread = _mm256_set1_epi32(0x010101);
+  const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const void*)(src + i)));
+    v = _mm256_or_si256(_mm256_mullo_epi32(v, spread), alpha);
+
+    _mm256_storeu_si256((void*)(dst + i), v);
   }
+
+  write_gray(dst + i, src + i, n - i);
 }
 
-static
-void color_buffer_read_byte(const color *cbuffer, size_t buf_w, size_t buf_h,
-                            size_t x, size_t y, size_t w, size_t h,
-                            color_format format, uint8_t *buffer) {
-  for (size_t j = 0; j < h; j++) {
-    for (size_t i = 0; i < w; i++) {
-      const color *pixel = &cbuffer[x+i+(y+j)*buf_w];
-      uint8_t *data  = &buffer[(i+w*j)*format];
-
-      switch (format) {
-      case ColorGray:
-        /* Not actually supported. */
-        break;
-      case ColorRGB:
-        data[0] = pixel->r;
-        data[1] = pixel->g;
-        data[2] = pixel->b;
-        break;
-      case ColorRGBA:
-        data[0] = pixel->r;
-        data[1] = pixel->g;
-        data[2] = pixel->b;
-        data[3] = pixel->a;
-        break;
-      }
+TargetAvx2
+static void write_rgb_avx2(color *dst, const uint8_t *src, size_t n) {
+  const __m256i shuffle = _mm256_setr_epi8(
+    0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+    0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+
+  /* Each half reads 16 bytes for 4 pixels. */
+  size_t i = 0;
+  for (; i + 10 <= n; i += 8) {
+    __m256i v = _mm256_loadu2_m128i((const void*)(src + 3*i + 12),
+                                    (const void*)(src + 3*i));
+    v = _mm256_or_si256(_mm256_shuffle_epi8(v, shuffle), alpha);
+
+    _mm256_storeu_si256((void*)(dst + i), v);
+  }
+
+  write_rgb(dst + i, src + i*3, n - i);
+}
+
+TargetAvx2
+static void read_gray_avx2(uint8_t *dst, const color *src, size_t n) {
+  const __m256i byte = _mm256_set1_epi32(0xff);
+  const __m256i pack = _mm256_setr_epi8(
+    0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const void*)(src + i));
+
+    __m256i r = _mm256_and_si256(v, byte);
+    __m256i g = _mm256_and_si256(_mm256_srli_epi32(v, 8), byte);
+    __m256i b = _mm256_and_si256(_mm256_srli_epi32(v, 16), byte);
+
+    __m256i y = _mm256_add_epi32(
+      _mm256_mullo_epi32(r, _mm256_set1_epi32(77)),
+      _mm256_add_epi32(_mm256_mullo_epi32(g, _mm256_set1_epi32(150)),
+                       _mm256_mullo_epi32(b, _mm256_set1_epi32(29))));
+    y = _mm256_shuffle_epi8(_mm256_srli_epi32(y, 8), pack);
+
+    int lo = _mm_cvtsi128_si32(_mm256_castsi256_si128(y));
+    int hi = _mm_cvtsi128_si32(_mm256_extracti128_si256(y, 1));
+    memcpy(dst + i, &lo, 4);
+    memcpy(dst + i + 4, &hi, 4);
+  }
+
+  read_gray(dst + i, src + i, n - i);
+}
+
+TargetAvx2
+static void read_rgb_avx2(uint8_t *dst, const color *src, size_t n) {
+  const __m256i shuffle = _mm256_setr_epi8(
+    0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+    0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+  /*
+   * Each half stores 16 bytes for 4 pixels. The second store overwrites the
+   * last 4 bytes of the first.
+   */
+  size_t i = 0;
+  for (; i + 10 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const void*)(src + i));
+    v = _mm256_shuffle_epi8(v, shuffle);
+
+    _mm_storeu_si128((void*)(dst + 3*i), _mm256_castsi256_si128(v));
+    _mm_storeu_si128((void*)(dst + 3*i + 12), _mm256_extracti128_si256(v, 1));
+  }
+
+  read_rgb(dst + i*3, src + i, n - i);
+}
+
+/* Truncates like the scalar conversion, for values in [0, 1]. */
+TargetAvx2
+static void to_bytes_avx2(uint8_t *dst, const float *src, size_t n) {
+  const __m256 scale = _mm256_set1_ps(255);
+  const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v[4];
+    for (int k = 0; k < 4; k++) {
+      v[k] = _mm256_cvttps_epi32(
+        _mm256_mul_ps(_mm256_loadu_ps(src + i + 8*k), scale));
     }
+
+    /* Packing works within each half, so values end up interleaved. */
+    __m256i bytes = _mm256_packus_epi16(_mm256_packs_epi32(v[0], v[1]),
+                                        _mm256_packs_epi32(v[2], v[3]));
+    bytes = _mm256_permutevar8x32_epi32(bytes, order);
+
+    _mm256_storeu_si256((void*)(dst + i), bytes);
   }
+
+  to_bytes(dst + i, src + i, n - i);
 }
+
+/*
+ * Divides in single precision like the scalar path, rather than multiplying
+ * by 1/255, so that both give exactly the same floats.
+ */
+TargetAvx2
+static void to_floats_avx2(float *dst, const uint8_t *src, size_t n) {
+  const __m256 scale = _mm256_set1_ps(255);
+
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const void*)(src + i)));
+    _mm256_storeu_ps(dst + i, _mm256_div_ps(_mm256_cvtepi32_ps(v), scale));
+  }
+
+  to_floats(dst + i, src + i, n - i);
+}
+
+#endif
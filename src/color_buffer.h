@@ -3,6 +3,7 @@
 
 #include "rasterizer.h"
 
+/* Rows are converted from and to uncompressed formats only. */
 void color_buffer_write(color *cbuffer, size_t buf_w, size_t buf_h,
                         size_t x, size_t y, size_t w, size_t h,
                         color_format format, color_type type,
@@ -0,0 +1,266 @@
+#include "rasterizer.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* A draw to replay, and its depth when sorting front to back. */
+typedef struct command_order {
+  const draw_command *command;
+  float depth;
+} command_order;
+
+static int record(command_buffer *commands, const renderer *state,
+                  draw_command command);
+static vector3 draw_center(const index_array *indices,
+                           const vertex_array *array, size_t i, size_t n);
+
+static bool sortable(const draw_command *command);
+static int depth_direction(const draw_command *command);
+static float command_depth(draw_command *command);
+static int compare_commands(const void *a, const void *b);
+static int compare_pointers(const void *a, const void *b);
+
+static int replay(renderer *state, const draw_command *command);
+static void apply_state(renderer *state, const draw_command *command);
+
+void make_command_buffer(command_buffer *commands) {
+  commands->count = commands->capacity = 0;
+  commands->commands = NULL;
+
+  commands->order_capacity = 0;
+  commands->order = NULL;
+}
+
+void command_buffer_release(command_buffer *commands) {
+  free(commands->commands);
+  free(commands->order);
+}
+
+void command_buffer_clear(command_buffer *commands) {
+  commands->count = 0;
+}
+
+int record_draw_array(command_buffer *commands, const renderer *state,
+                      draw_mode mode, vertex_array *array, size_t i,
+                      size_t n) {
+  return record(commands, state, (draw_command){
+    .mode = mode, .indices = NULL, .array = array, .i = i, .n = n,
+  });
+}
+
+int record_draw_elements(command_buffer *commands, const renderer *state,
+                         draw_mode mode, index_array *indices,
+                         vertex_array *array, size_t i, size_t n) {
+  return record(commands, state, (draw_command){
+    .mode = mode, .indices = indices, .array = array, .i = i, .n = n,
+  });
+}
+
+int submit_command_buffer(renderer *state, command_buffer *commands,
+                          bool sort) {
+  if (sort && commands->order_capacity < commands->count) {
+    command_order *order = realloc(commands->order,
+                                   sizeof(*order) * commands->count);
+    if (!order) return -1;
+
+    commands->order = order;
+    commands->order_capacity = commands->count;
+  }
+
+  draw_command saved = {
+    .tex = state->tex,
+    .model = state->model, .view = state->view,
+    .projection = state->projection,
+    .mat = state->mat,
+    .lighting = state->lighting,
+    .depth_func = state->depth_func,
+    .depth_test_flag = state->depth_test_flag,
+    .culling = state->culling,
+  };
+
+  draw_command *command = commands->commands;
+  draw_command *end = command + commands->count;
+
+  int result = 0;
+
+  while (command != end && result == 0) {
+    if (!sort || !sortable(command)) {
+      result = replay(state, command++);
+      continue;
+    }
+
+    /*
+     * Draws between two that must keep their place are sorted together, as
+     * long as they all keep either the nearest or the farthest fragment.
+     */
+    command_order *order = commands->order;
+    int direction = depth_direction(command);
+    size_t n = 0;
+
+    for (; command != end && sortable(command) &&
+           depth_direction(command) == direction; command++)
+      order[n++] = (command_order){command, command_depth(command)};
+
+    qsort(order, n, sizeof(*order), compare_commands);
+
+    for (size_t i = 0; i < n && result == 0; i++)
+      result = replay(state, order[i].command);
+  }
+
+  apply_state(state, &saved);
+  return result;
+}
+
+static int record(command_buffer *commands, const renderer *state,
+                  draw_command command) {
+  if (commands->count == commands->capacity) {
+    size_t capacity = commands->capacity ? commands->capacity * 2 : 64;
+
+    draw_command *buffer = realloc(commands->commands,
+                                   sizeof(*buffer) * capacity);
+    if (!buffer) return -1;
+
+    commands->commands = buffer;
+    commands->capacity = capacity;
+  }
+
+  command.tex = state->tex;
+
+  command.model = state->model;
+  command.view = state->view;
+  command.projection = state->projection;
+
+  command.mat = state->mat;
+
+  command.lighting = state->lighting;
+
+  command.depth_func = state->depth_func;
+  command.depth_test_flag = state->depth_test_flag;
+
+  command.culling = state->culling;
+
+  command.center_version = 0;
+
+  commands->commands[commands->count++] = command;
+  return 0;
+}
+
+static vector3 draw_center(const index_array *indices,
+                           const vertex_array *array, size_t i, size_t n) {
+  vector3 sum = {0, 0, 0};
+  if (n == 0) return sum;
+
+  for (size_t k = i; k < i + n; k++) {
+    size_t vertex_i = indices ? indices->data[k] : k;
+    sum = vector3_add(sum, array->data[vertex_i].pos);
+  }
+
+  return vector3_scale(1.0f / n, sum);
+}
+
+/*
+ * With these depth tests, each pixel ends up with the nearest fragment drawn
+ * to it whatever the order of the draws, as long as none are at the same
+ * depth.
+ */
+static bool sortable(const draw_command *command) {
+  if (!command->depth_test_flag) return false;
+
+  switch (command->depth_func) {
+  case DepthTestLT: case DepthTestLE:
+  case DepthTestGT: case DepthTestGE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/* -1 for draws that keep the nearest fragment, 1 for the farthest. */
+static int depth_direction(const draw_command *command) {
+  if (command->depth_func == DepthTestGT || command->depth_func == DepthTestGE)
+    return 1;
+  else
+    return -1;
+}
+
+/* Smaller for draws that are more likely to hide others. */
+static float command_depth(draw_command *command) {
+  if (command->center_version != command->array->version) {
+    command->center = draw_center(command->indices, command->array,
+                                  command->i, command->n);
+    command->center_version = command->array->version;
+  }
+
+  vector3 eye = mat4_apply(mat4_mul(command->model, command->view),
+                           command->center);
+  vector4 clip = mat4_project(command->projection, eye);
+
+  /* Draws centered behind the viewer are sorted as if on the far plane. */
+  float z = clip.w > 0 ? clip.z / clip.w : 1;
+
+  return depth_direction(command) > 0 ? -z : z;
+}
+
+/*
+ * Groups draws by fragment pipeline, texture and material, and orders each
+ * group front to back. Draws at the same depth are kept together by vertex
+ * array and transforms, so that processed vertices are reused.
+ */
+static int compare_commands(const void *a, const void *b) {
+  const command_order *oa = a, *ob = b;
+  const draw_command *ca = oa->command, *cb = ob->command;
+
+  if (ca->depth_func != cb->depth_func)
+    return ca->depth_func < cb->depth_func ? -1 : 1;
+  if (ca->lighting != cb->lighting) return ca->lighting ? 1 : -1;
+  if (ca->culling != cb->culling) return ca->culling ? 1 : -1;
+
+  int order;
+  if ((order = compare_pointers(ca->tex, cb->tex)) != 0) return order;
+  if ((order = memcmp(&ca->mat, &cb->mat, sizeof(material))) != 0)
+    return order;
+
+  if (oa->depth != ob->depth) return oa->depth < ob->depth ? -1 : 1;
+
+  if ((order = compare_pointers(ca->array, cb->array)) != 0) return order;
+  if ((order = memcmp(&ca->model, &cb->model, sizeof(mat4))) != 0)
+    return order;
+  if ((order = memcmp(&ca->view, &cb->view, sizeof(mat4))) != 0)
+    return order;
+  if ((order = memcmp(&ca->projection, &cb->projection, sizeof(mat4))) != 0)
+    return order;
+
+  /* Keeps the sort stable. */
+  return compare_pointers(ca, cb);
+}
+
+static int compare_pointers(const void *a, const void *b) {
+  uintptr_t ia = (uintptr_t)a, ib = (uintptr_t)b;
+  if (ia == ib) return 0;
+  return ia < ib ? -1 : 1;
+}
+
+static int replay(renderer *state, const draw_command *command) {
+  apply_state(state, command);
+
+  if (command->indices) {
+    return draw_elements(state, command->mode, command->indices,
+                         command->array, command->i, command->n);
+  }
+  else
+    return draw_array(state, command->mode, command->array, command->i,
+                      command->n);
+}
+
+/* Only changes what differs, so that consecutive similar draws are cheap. */
+static void apply_state(renderer *state, const draw_command *command) {
+  use_texture(state, command->tex);
+  set_mvp(state, command->model, command->view, command->projection);
+
+  if (memcmp(&state->mat, &command->mat, sizeof(material)) != 0)
+    use_material(state, command->mat);
+
+  set_lighting(state, command->lighting);
+  set_depth_func(state, command->depth_func);
+  set_depth_test(state, command->depth_test_flag);
+  set_culling(state, command->culling);
+}
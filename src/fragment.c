@@ -0,0 +1,350 @@
+#include "fragment.h"
+#include "texture.h"
+#include <math.h>
+
+static AlwaysInline bool draw_block(framebuffer *fb,
+                                    const shading_state *shading,
+                                    const triangle_setup *tri,
+                                    const raster_block *block,
+                                    uint32_t *visibility, uint32_t id,
+                                    int depth, int mode);
+static AlwaysInline bool depth_test(int depth, float *buffer, float src);
+static AlwaysInline void shade(const shading_state *shading, framebuffer *fb,
+                               const triangle_setup *tri, int x, int y,
+                               int mode);
+
+static color sample_texture(const texture *tex, float u, float v, float lod);
+static color sample_nearest(texture_level level, float u, float v);
+static vector4 sample_bilinear(texture_level level, texture_wrap wrap,
+                               float u, float v);
+static int wrap_index(int i, int n, texture_wrap wrap);
+
+static float plane_at(plane p, float x, float y);
+static uint8_t clamp(float v);
+
+#define DefineDrawBlock(depth, name, mode) \
+  static bool draw_block_##depth##_##name( \
+    framebuffer *fb, const shading_state *shading, const triangle_setup *tri, \
+    const raster_block *block, uint32_t *visibility, uint32_t id) { \
+    return draw_block(fb, shading, tri, block, visibility, id, depth, mode); \
+  }
+
+#define DefineDrawBlocks(depth) \
+  ForEachShading(DefineDrawBlock, depth) \
+  DefineDrawBlock(depth, visibility, ShadeVisibility)
+
+#define DefineShade(depth, name, mode) \
+  static void shade_##name(const shading_state *shading, framebuffer *fb, \
+                           const triangle_setup *tri, int x, int y) { \
+    shade(shading, fb, tri, x, y, mode); \
+  }
+
+ForEachDepthMode(DefineDrawBlocks)
+ForEachShading(DefineShade, 0)
+
+/*
+ * Visibility pipelines all record triangles the same way, but each keeps the
+ * shading to use once they are resolved.
+ */
+#define PipelineEntries(depth, name, mode) \
+  [mode] = {draw_block_##depth##_##name, shade_##name}, \
+  [mode | ShadeVisibility] = {draw_block_##depth##_visibility, shade_##name},
+
+#define PipelineRow(depth) [depth] = {ForEachShading(PipelineEntries, depth)},
+
+static const fragment_pipeline pipelines[DepthModeCount][ShadingModeCount] = {
+  ForEachDepthMode(PipelineRow)
+};
+
+const fragment_pipeline *select_fragment_pipeline(const renderer *state) {
+  int depth = state->depth_test_flag ? (int)state->depth_func :
+    DepthTestDisabled;
+  int shading = (state->tex ? ShadeTextured : 0) |
+                (state->lighting ? ShadeLit : 0);
+
+  if (state->deferred)
+    return &pipelines[depth][shading | ShadeVisibility];
+
+  if (state->fragment_simd) {
+    const fragment_pipeline *simd = select_fragment_pipeline_simd(depth,
+                                                                  shading);
+    if (simd) return simd;
+  }
+
+  return &pipelines[depth][shading];
+}
+
+static AlwaysInline bool draw_block(framebuffer *fb,
+                                    const shading_state *shading,
+                                    const triangle_setup *tri,
+                                    const raster_block *block,
+                                    uint32_t *visibility, uint32_t id,
+                                    int depth, int mode) {
+  if (depth == DepthTestNever) return false;
+
+  edge e0 = tri->e[0], e1 = tri->e[1], e2 = tri->e[2];
+  float inv_area = tri->inv_area;
+  float za = tri->z[0], zb = tri->z[1], zc = tri->z[2];
+
+  int64_t row0 = block->w[0], row1 = block->w[1], row2 = block->w[2];
+  bool written = false;
+
+  for (int y = block->rect.y0; y < block->rect.y1; y++) {
+    int64_t w0 = row0, w1 = row1, w2 = row2;
+
+    for (int x = block->rect.x0; x < block->rect.x1; x++) {
+      if ((w0 | w1 | w2) >= 0) {
+        size_t i = x + y*fb->w;
+
+        /*
+         * Depth is tested on its own first; the other attributes are only
+         * interpolated for fragments that are actually drawn.
+         */
+        bool passed = true;
+        if (depth != DepthTestDisabled) {
+          float s = (w0 + e0.bias) * inv_area;
+          float t = (w1 + e1.bias) * inv_area;
+          float u = 1 - s - t;
+
+          float z = s*za + t*zb + u*zc;
+          passed = depth_test(depth, fb->depth_buffer + i, z);
+        }
+
+        if (passed) {
+          if (mode & ShadeVisibility)
+            visibility[i] = id;
+          else
+            shade(shading, fb, tri, x, y, mode);
+
+          written = true;
+        }
+      }
+
+      w0 += e0.a;
+      w1 += e1.a;
+      w2 += e2.a;
+    }
+
+    row0 += e0.b;
+    row1 += e1.b;
+    row2 += e2.b;
+  }
+
+  return written;
+}
+
+/* Compares src to *buffer, and stores it there if it passes. */
+static AlwaysInline bool depth_test(int depth, float *buffer, float src) {
+  float dst = *buffer;
+
+  bool passed = false;
+  switch (depth) {
+  case DepthTestAlways: passed = true; break;
+
+  case DepthTestEQ: passed = src == dst; break;
+  case DepthTestLT: passed = src <  dst; break;
+  case DepthTestLE: passed = src <= dst; break;
+  case DepthTestGT: passed = src >  dst; break;
+  case DepthTestGE: passed = src >= dst; break;
+  }
+
+  if (passed) *buffer = src;
+  return passed;
+}
+
+static AlwaysInline void shade(const shading_state *shading, framebuffer *fb,
+                               const triangle_setup *tri, int x, int y,
+                               int mode) {
+  float fx = x - tri->bounds.x0, fy = y - tri->bounds.y0;
+  float w = 1 / plane_at(tri->inv_w, fx, fy);
+
+  color tex_color = (color){255,255,255,255};
+  if (mode & ShadeTextured) {
+    const texture *tex = shading->tex;
+    vector2 tex_coord = {
+      plane_at(tri->tex_coord[0], fx, fy) * w,
+      plane_at(tri->tex_coord[1], fx, fy) * w,
+    };
+
+    float lod = tex->mip_count != 0 ? texture_lod(tex, tri, x, y) : 0;
+    tex_color = sample_texture(tex, tex_coord.x, tex_coord.y, lod);
+  }
+
+  color light = (color){255,255,255,255};
+  if (mode & ShadeLit) {
+    vector3 n = vector3_normalize((vector3){
+      plane_at(tri->normal[0], fx, fy) * w,
+      plane_at(tri->normal[1], fx, fy) * w,
+      plane_at(tri->normal[2], fx, fy) * w,
+    });
+    vector3 e = vector3_normalize((vector3){
+      plane_at(tri->eye[0], fx, fy) * w,
+      plane_at(tri->eye[1], fx, fy) * w,
+      plane_at(tri->eye[2], fx, fy) * w,
+    });
+
+    light = (color){0,0,0,255};
+
+    for (size_t i = 0; i < shading->light_count; i++) {
+      vector3 l = vector3_normalize(
+        vector3_add(e, shading->lights[i].pos));
+      vector3 r = vector3_reflect(vector3_scale(-1, l), n);
+
+      float diffuse = fmaxf(0, -vector3_dot(l, n));
+      float specular = powf(fmaxf(vector3_dot(r, e), 0.0),
+                            shading->specular_power);
+
+      light.r = clamp(
+        light.r +
+        shading->lights[i].ambient.r +
+        diffuse * shading->lights[i].diffuse.r +
+        specular * shading->lights[i].specular.r);
+      light.g = clamp(
+        light.g +
+        shading->lights[i].ambient.g +
+        diffuse * shading->lights[i].diffuse.g +
+        specular * shading->lights[i].specular.g);
+      light.b = clamp(
+        light.b +
+        shading->lights[i].ambient.b +
+        diffuse * shading->lights[i].diffuse.b +
+        specular * shading->lights[i].specular.b);
+    }
+  }
+
+  vector4 base_color = {
+    plane_at(tri->base_color[0], fx, fy) * w,
+    plane_at(tri->base_color[1], fx, fy) * w,
+    plane_at(tri->base_color[2], fx, fy) * w,
+    plane_at(tri->base_color[3], fx, fy) * w,
+  };
+
+  color src = {
+    base_color.x * (float)tex_color.r/255.0 * (float)light.r/255.0,
+    base_color.y * (float)tex_color.g/255.0 * (float)light.g/255.0,
+    base_color.z * (float)tex_color.b/255.0 * (float)light.b/255.0,
+    base_color.w * (float)tex_color.a/255.0,
+  };
+  fb->color_buffer[x+y*fb->stride] = src;
+}
+
+float texture_lod(const texture *tex, const triangle_setup *tri,
+                  int x, int y) {
+  float fx = (x & ~3) + 1.5f - tri->bounds.x0;
+  float fy = (y & ~1) + 0.5f - tri->bounds.y0;
+
+  float w = 1 / plane_at(tri->inv_w, fx, fy);
+  float u = plane_at(tri->tex_coord[0], fx, fy) * w;
+  float v = plane_at(tri->tex_coord[1], fx, fy) * w;
+
+  /* The derivative of p/inv_w is (p' - (p/inv_w) * inv_w') / inv_w. */
+  float dudx = (tri->tex_coord[0].dx - u*tri->inv_w.dx) * w * tex->w;
+  float dvdx = (tri->tex_coord[1].dx - v*tri->inv_w.dx) * w * tex->h;
+  float dudy = (tri->tex_coord[0].dy - u*tri->inv_w.dy) * w * tex->w;
+  float dvdy = (tri->tex_coord[1].dy - v*tri->inv_w.dy) * w * tex->h;
+
+  float rho = fmaxf(dudx*dudx + dvdx*dvdx, dudy*dudy + dvdy*dvdy);
+  float lod = 0.5f * log2f(rho);
+
+  return fminf(fmaxf(lod, 0), tex->mip_count);
+}
+
+/*
+ * Texel (i, j) of a level of size w x h is centered on ((i + 0.5)/w,
+ * (j + 0.5)/h).
+ */
+static color sample_texture(const texture *tex, float u, float v, float lod) {
+  if (tex->wrap == WrapBorder && !(0 <= u && u <= 1 && 0 <= v && v <= 1))
+    return (color){255,255,255,255};
+
+  if (tex->wrap == WrapRepeat) {
+    u -= floorf(u);
+    v -= floorf(v);
+  }
+
+  /* Also gets rid of NaNs. */
+  u = fminf(fmaxf(u, 0), 1);
+  v = fminf(fmaxf(v, 0), 1);
+
+  if (tex->filter == FilterTrilinear && tex->mip_count != 0) {
+    size_t i = lod;
+    float t = lod - i;
+
+    vector4 c = sample_bilinear(texture_level_at(tex, i), tex->wrap, u, v);
+
+    if (i < tex->mip_count && t > 0) {
+      vector4 d = sample_bilinear(texture_level_at(tex, i+1), tex->wrap,
+                                  u, v);
+      c = (vector4){
+        c.x + (d.x - c.x)*t, c.y + (d.y - c.y)*t,
+        c.z + (d.z - c.z)*t, c.w + (d.w - c.w)*t,
+      };
+    }
+
+    return (color){c.x + 0.5f, c.y + 0.5f, c.z + 0.5f, c.w + 0.5f};
+  }
+
+  texture_level level = texture_level_at(tex, (size_t)(lod + 0.5f));
+
+  if (tex->filter == FilterNearest) return sample_nearest(level, u, v);
+
+  vector4 c = sample_bilinear(level, tex->wrap, u, v);
+  return (color){c.x + 0.5f, c.y + 0.5f, c.z + 0.5f, c.w + 0.5f};
+}
+
+/* u and v are in [0, 1]. */
+static color sample_nearest(texture_level level, float u, float v) {
+  int x = u * level.w, y = v * level.h;
+  if (x > (int)level.w - 1) x = level.w - 1;
+  if (y > (int)level.h - 1) y = level.h - 1;
+
+  return texel_at(&level, x, y);
+}
+
+static vector4 sample_bilinear(texture_level level, texture_wrap wrap,
+                               float u, float v) {
+  float x = u * level.w - 0.5f, y = v * level.h - 0.5f;
+  float x0 = floorf(x), y0 = floorf(y);
+  float fx = x - x0, fy = y - y0;
+  float gx = 1 - fx, gy = 1 - fy;
+
+  int i0 = wrap_index(x0, level.w, wrap);
+  int i1 = wrap_index(x0 + 1, level.w, wrap);
+  int j0 = wrap_index(y0, level.h, wrap);
+  int j1 = wrap_index(y0 + 1, level.h, wrap);
+
+  color a = texel_at(&level, i0, j0);
+  color b = texel_at(&level, i1, j0);
+  color c = texel_at(&level, i0, j1);
+  color d = texel_at(&level, i1, j1);
+
+  return (vector4){
+    (a.r*gx + b.r*fx)*gy + (c.r*gx + d.r*fx)*fy,
+    (a.g*gx + b.g*fx)*gy + (c.g*gx + d.g*fx)*fy,
+    (a.b*gx + b.b*fx)*gy + (c.b*gx + d.b*fx)*fy,
+    (a.a*gx + b.a*fx)*gy + (c.a*gx + d.a*fx)*fy,
+  };
+}
+
+/* i is at most one texel outside of [0, n). */
+static int wrap_index(int i, int n, texture_wrap wrap) {
+  if (wrap == WrapRepeat) {
+    if (i < 0) return i + n;
+    if (i >= n) return i - n;
+    return i;
+  }
+
+  if (i < 0) return 0;
+  if (i >= n) return n - 1;
+  return i;
+}
+
+static float plane_at(plane p, float x, float y) {
+  return p.a + p.dx*x + p.dy*y;
+}
+
+static uint8_t clamp(float v) {
+  if (v > 255) return 255;
+  if (v < 0) return 0;
+  else return v;
+}
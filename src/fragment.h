@@ -0,0 +1,155 @@
+#ifndef FRAGMENT_H_
+#define FRAGMENT_H_
+
+#include "rasterizer.h"
+
+/* Fixed-point window coordinates, with SubpixelBits fractional bits. */
+typedef struct screen_pos {
+  int x, y;
+} screen_pos;
+
+#define SubpixelBits 8
+#define SubpixelOne  (1 << SubpixelBits)
+
+/* Pixels in [x0, x1) x [y0, y1). */
+typedef struct screen_rect {
+  int x0, y0, x1, y1;
+} screen_rect;
+
+/*
+ * Edge function a*x + b*y + c, evaluated at the center of pixel (x, y) and
+ * positive on the inside of the triangle. bias is 1 for edges that are not
+ * top-left: it is subtracted from c, so that a pixel exactly on an edge shared
+ * by two triangles is drawn only once.
+ */
+typedef struct edge {
+  int64_t a, b, c;
+  int bias;
+} edge;
+
+/* a + dx*x + dy*y */
+typedef struct plane {
+  float a, dx, dy;
+} plane;
+
+/* A triangle ready to be rasterized, with its vertices counter-clockwise. */
+typedef struct triangle_setup {
+  /* Depth of each vertex. */
+  float z[3];
+
+  screen_rect bounds;
+
+  /* e[i] is the barycentric weight of vertex i, scaled by the area. */
+  edge e[3];
+  float inv_area;
+
+  /*
+   * 1/w, and each attribute divided by w, are linear in screen space. Planes
+   * take pixel coordinates relative to (bounds.x0, bounds.y0).
+   */
+  plane inv_w;
+  plane eye[3], normal[3];
+  plane tex_coord[2];
+  plane base_color[4];
+} triangle_setup;
+
+/* Everything needed to shade a fragment once it has passed the depth test. */
+typedef struct shading_state {
+  const texture *tex;
+
+  bool lighting;
+  float specular_power;
+
+  size_t light_count;
+  const light *lights;
+} shading_state;
+
+/*
+ * Triangles are scanned in square blocks, skipping those fully outside, and
+ * those fully hidden according to the hierarchical depth buffer.
+ */
+#define BlockSize DepthBlockSize
+
+/*
+ * The pixels of rect, within the BlockSize x BlockSize block at (x, y), that
+ * are covered by a triangle. w holds its edge functions at (rect.x0, rect.y0).
+ */
+typedef struct raster_block {
+  int x, y;
+  screen_rect rect;
+  int64_t w[3];
+} raster_block;
+
+/*
+ * Depth tests the pixels of a block and shades those that pass, or, for
+ * pipelines that only fill the visibility buffer, writes id there instead.
+ * Returns whether any pixel passed.
+ */
+typedef bool draw_block_func(framebuffer *fb, const shading_state *shading,
+                             const triangle_setup *tri,
+                             const raster_block *block, uint32_t *visibility,
+                             uint32_t id);
+
+/* Shades a pixel that has already passed the depth test. */
+typedef void shade_fragment_func(const shading_state *shading, framebuffer *fb,
+                                 const triangle_setup *tri, int x, int y);
+
+/*
+ * Fragment routines specialized for one combination of depth test and
+ * shading, so that their inner loops do not depend on the renderer state.
+ * A pipeline is selected once per draw.
+ */
+typedef struct fragment_pipeline {
+  draw_block_func *draw_block;
+
+  /* Used by resolve_deferred for draws recorded with this pipeline. */
+  shade_fragment_func *shade;
+} fragment_pipeline;
+
+/* Depth modes are the depth_func values, and this one for no depth test. */
+enum {
+  DepthTestDisabled = DepthTestGE + 1,
+  DepthModeCount,
+};
+
+enum {
+  ShadeTextured   = 1 << 0,
+  ShadeLit        = 1 << 1,
+  ShadeVisibility = 1 << 2,
+
+  ShadingModeCount = 1 << 3,
+};
+
+/* Calls f(depth) for every depth mode. */
+#define ForEachDepthMode(f) \
+  f(DepthTestNever) f(DepthTestAlways) f(DepthTestEQ) f(DepthTestLT) \
+  f(DepthTestLE) f(DepthTestGT) f(DepthTestGE) f(DepthTestDisabled)
+
+/* Calls f(depth, name, shading) for every shading mode, but visibility. */
+#define ForEachShading(f, depth) \
+  f(depth, plain, 0) \
+  f(depth, textured, ShadeTextured) \
+  f(depth, lit, ShadeLit) \
+  f(depth, lit_textured, ShadeLit | ShadeTextured)
+
+/* Lets variants be generated from a single function with constant modes. */
+#define AlwaysInline inline __attribute__((always_inline))
+
+const fragment_pipeline *select_fragment_pipeline(const renderer *state);
+
+/*
+ * Level of detail a texture is sampled at by the 4x2 group of pixels that
+ * contains (x, y), from the derivatives of the texture coordinates at its
+ * center. Both pipelines use it, so that they select the same levels.
+ */
+float texture_lod(const texture *tex, const triangle_setup *tri,
+                  int x, int y);
+
+/*
+ * Vectorized fragment pipelines, used in forward mode when the CPU supports
+ * them. Returns NULL when it does not.
+ */
+bool fragment_simd_supported(void);
+const fragment_pipeline *select_fragment_pipeline_simd(int depth, int shading);
+
+#endif
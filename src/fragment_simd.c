@@ -0,0 +1,893 @@
+#include "fragment.h"
+#include "texture.h"
+
+#ifdef HAVE_AVX2
+
+#include <immintrin.h>
+#include <math.h>
+
+/*
+ * Only the functions below are compiled for AVX2, so that the library still
+ * runs on other CPUs. Fragments are processed eight at a time, in groups of
+ * 4x2 pixels: lanes 0-3 hold a row of four pixels, and lanes 4-7 the pixels
+ * right below them.
+ *
+ * Every step but the specular exponent performs the same float operations in
+ * the same order as the scalar path, so that both produce the same colors in
+ * all but a few rounding cases.
+ */
+#define TargetAvx2 __attribute__((target("avx2")))
+
+#if BlockSize != 8
+#error "The vectorized pipelines expect 8x8 blocks"
+#endif
+
+typedef struct vector3x8 {
+  __m256 x, y, z;
+} vector3x8;
+
+static AlwaysInline bool draw_block(framebuffer *fb,
+                                    const shading_state *shading,
+                                    const triangle_setup *tri,
+                                    const raster_block *block,
+                                    int depth, int mode);
+static uint64_t block_coverage(const triangle_setup *tri,
+                               const raster_block *block, float *s, float *t);
+static AlwaysInline unsigned shade_quad(framebuffer *fb,
+                                        const shading_state *shading,
+                                        const triangle_setup *tri,
+                                        int x, int y, unsigned coverage,
+                                        const float *s, const float *t,
+                                        int depth, int mode);
+
+static AlwaysInline __m256 depth_test(int depth, __m256 src, __m256 dst);
+
+static __m256i sample_texture(const texture *tex, const triangle_setup *tri,
+                              int x, int y, __m256 u, __m256 v, __m256 mask);
+static __m256i sample_nearest(texture_level level, __m256 u, __m256 v,
+                              __m256 mask);
+static void sample_bilinear(texture_level level, texture_wrap wrap,
+                            __m256 u, __m256 v, __m256 mask, __m256 c[4]);
+static __m256i wrap_index(__m256i i, size_t n, texture_wrap wrap);
+static __m256i texel_columns(const texture_level *level, __m256i x);
+static __m256i texel_rows(const texture_level *level, __m256i y);
+static __m256i decode_texels(const texture_level *level, __m256i x, __m256i y,
+                             __m256 mask);
+static __m256i decode_alpha(const int *blocks, __m256i offset, __m256i texel,
+                            __m256i mask);
+static __m256i expand_channel(__m256i c, int shift, int bits);
+static __m256i select_palette(__m256i i, __m256i p0, __m256i p1, __m256i p2,
+                              __m256i p3);
+static __m256i divide(__m256i x, int magic, int shift);
+static __m256i pack_color(const __m256 c[4]);
+static void compute_lighting(const shading_state *shading, vector3x8 normal,
+                             vector3x8 eye, __m256 light[3]);
+
+static __m256 lane_mask(unsigned bits);
+static __m256 load_rows(const float *row, size_t stride, __m256 mask);
+static void store_rows(float *row, size_t stride, __m256 mask, __m256 v);
+
+static __m256 plane_at(plane p, __m256 x, __m256 y);
+static __m256 interpolate(plane p, __m256 x, __m256 y, __m256 w);
+static vector3x8 interpolate_vector3(const plane p[3], __m256 x, __m256 y,
+                                     __m256 w);
+
+static __m256 dot(vector3x8 a, vector3x8 b);
+static vector3x8 normalize(vector3x8 v);
+
+static __m256 modulate(__m256 base, __m256 tex, __m256 light);
+static __m256 modulate_alpha(__m256 base, __m256 tex);
+static __m256 clamp_color(__m256 v);
+
+static __m256 pow8(__m256 x, float p);
+static __m256 exp8(__m256 x);
+static __m256 log8(__m256 x);
+
+#define DefineDrawBlock(depth, name, mode) \
+  TargetAvx2 static bool draw_block_##depth##_##name( \
+    framebuffer *fb, const shading_state *shading, const triangle_setup *tri, \
+    const raster_block *block, uint32_t *visibility, uint32_t id) { \
+    (void)visibility; (void)id; \
+    return draw_block(fb, shading, tri, block, depth, mode); \
+  }
+
+#define DefineDrawBlocks(depth) ForEachShading(DefineDrawBlock, depth)
+
+ForEachDepthMode(DefineDrawBlocks)
+
+/* Only used in forward mode, where nothing is left to resolve. */
+#define PipelineEntry(depth, name, mode) \
+  [mode] = {draw_block_##depth##_##name, NULL},
+
+#define PipelineRow(depth) [depth] = {ForEachShading(PipelineEntry, depth)},
+
+static const fragment_pipeline pipelines[DepthModeCount][ShadeVisibility] = {
+  ForEachDepthMode(PipelineRow)
+};
+
+bool fragment_simd_supported(void) {
+  return __builtin_cpu_supports("avx2");
+}
+
+const fragment_pipeline *select_fragment_pipeline_simd(int depth, int shading) {
+  if (!fragment_simd_supported()) return NULL;
+  return &pipelines[depth][shading];
+}
+
+TargetAvx2
+static AlwaysInline bool draw_block(framebuffer *fb,
+                                    const shading_state *shading,
+                                    const triangle_setup *tri,
+                                    const raster_block *block,
+                                    int depth, int mode) {
+  if (depth == DepthTestNever) return false;
+
+  float s[BlockSize*BlockSize] = {0}, t[BlockSize*BlockSize] = {0};
+  uint64_t coverage = block_coverage(tri, block, s, t);
+
+  bool written = false;
+
+  for (int qy = 0; qy < BlockSize; qy += 2) {
+    for (int qx = 0; qx < BlockSize; qx += 4) {
+      size_t i = qx + qy*BlockSize;
+
+      unsigned bits = ((coverage >> i) & 0xf) |
+                      ((coverage >> (i + BlockSize)) & 0xf) << 4;
+      if (!bits) continue;
+
+      if (shade_quad(fb, shading, tri, block->x + qx, block->y + qy, bits,
+                     s + i, t + i, depth, mode))
+        written = true;
+    }
+  }
+
+  return written;
+}
+
+/*
+ * Computes the barycentric weights of vertices 0 and 1 at the covered pixels
+ * of the block, and returns those pixels (bit i for pixel i, in row-major
+ * order).
+ */
+static uint64_t block_coverage(const triangle_setup *tri,
+                               const raster_block *block, float *s, float *t) {
+  edge e0 = tri->e[0], e1 = tri->e[1], e2 = tri->e[2];
+  float inv_area = tri->inv_area;
+
+  uint64_t coverage = 0;
+
+  int64_t row0 = block->w[0], row1 = block->w[1], row2 = block->w[2];
+
+  for (int y = block->rect.y0; y < block->rect.y1; y++) {
+    int64_t w0 = row0, w1 = row1, w2 = row2;
+
+    for (int x = block->rect.x0; x < block->rect.x1; x++) {
+      if ((w0 | w1 | w2) >= 0) {
+        size_t i = (x - block->x) + (y - block->y)*BlockSize;
+
+        s[i] = (w0 + e0.bias) * inv_area;
+        t[i] = (w1 + e1.bias) * inv_area;
+        coverage |= (uint64_t)1 << i;
+      }
+
+      w0 += e0.a;
+      w1 += e1.a;
+      w2 += e2.a;
+    }
+
+    row0 += e0.b;
+    row1 += e1.b;
+    row2 += e2.b;
+  }
+
+  return coverage;
+}
+
+/* Returns the pixels of the quad that passed the depth test. */
+TargetAvx2
+static AlwaysInline unsigned shade_quad(framebuffer *fb,
+                                        const shading_state *shading,
+                                        const triangle_setup *tri,
+                                        int x, int y, unsigned coverage,
+                                        const float *s, const float *t,
+                                        int depth, int mode) {
+  size_t i = x + y*fb->w;
+
+  __m256 one = _mm256_set1_ps(1);
+  __m256 mask = lane_mask(coverage);
+
+  if (depth != DepthTestDisabled) {
+    __m256 ws = _mm256_insertf128_ps(
+      _mm256_castps128_ps256(_mm_loadu_ps(s)), _mm_loadu_ps(s + BlockSize), 1);
+    __m256 wt = _mm256_insertf128_ps(
+      _mm256_castps128_ps256(_mm_loadu_ps(t)), _mm_loadu_ps(t + BlockSize), 1);
+    __m256 wu = _mm256_sub_ps(_mm256_sub_ps(one, ws), wt);
+
+    __m256 z = _mm256_add_ps(
+      _mm256_add_ps(_mm256_mul_ps(ws, _mm256_set1_ps(tri->z[0])),
+                    _mm256_mul_ps(wt, _mm256_set1_ps(tri->z[1]))),
+      _mm256_mul_ps(wu, _mm256_set1_ps(tri->z[2])));
+
+    __m256 dst = load_rows(fb->depth_buffer + i, fb->w, mask);
+    mask = _mm256_and_ps(mask, depth_test(depth, z, dst));
+
+    store_rows(fb->depth_buffer + i, fb->w, mask, z);
+  }
+
+  unsigned passed = _mm256_movemask_ps(mask);
+  if (!passed) return 0;
+
+  __m256 fx = _mm256_add_ps(_mm256_set1_ps(x - tri->bounds.x0),
+                            _mm256_setr_ps(0, 1, 2, 3, 0, 1, 2, 3));
+  __m256 fy = _mm256_add_ps(_mm256_set1_ps(y - tri->bounds.y0),
+                            _mm256_setr_ps(0, 0, 0, 0, 1, 1, 1, 1));
+  __m256 w = _mm256_div_ps(one, plane_at(tri->inv_w, fx, fy));
+
+  __m256 base[4] = {
+    interpolate(tri->base_color[0], fx, fy, w),
+    interpolate(tri->base_color[1], fx, fy, w),
+    interpolate(tri->base_color[2], fx, fy, w),
+    interpolate(tri->base_color[3], fx, fy, w),
+  };
+
+  __m256i texel = _mm256_set1_epi32(-1);
+  if (mode & ShadeTextured) {
+    __m256 tx = interpolate(tri->tex_coord[0], fx, fy, w);
+    __m256 ty = interpolate(tri->tex_coord[1], fx, fy, w);
+    texel = sample_texture(shading->tex, tri, x, y, tx, ty, mask);
+  }
+
+  __m256i byte = _mm256_set1_epi32(0xff);
+  __m256 tex[4] = {
+    _mm256_cvtepi32_ps(_mm256_and_si256(texel, byte)),
+    _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(texel, 8), byte)),
+    _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(texel, 16), byte)),
+    _mm256_cvtepi32_ps(_mm256_srli_epi32(texel, 24)),
+  };
+
+  __m256 light[3];
+  if (mode & ShadeLit) {
+    vector3x8 normal = interpolate_vector3(tri->normal, fx, fy, w);
+    vector3x8 eye = interpolate_vector3(tri->eye, fx, fy, w);
+    compute_lighting(shading, normal, eye, light);
+  }
+  else
+    light[0] = light[1] = light[2] = _mm256_set1_ps(255);
+
+  __m256i out = _mm256_cvttps_epi32(modulate(base[0], tex[0], light[0]));
+  out = _mm256_or_si256(out, _mm256_slli_epi32(
+    _mm256_cvttps_epi32(modulate(base[1], tex[1], light[1])), 8));
+  out = _mm256_or_si256(out, _mm256_slli_epi32(
+    _mm256_cvttps_epi32(modulate(base[2], tex[2], light[2])), 16));
+  out = _mm256_or_si256(out, _mm256_slli_epi32(
+    _mm256_cvttps_epi32(modulate_alpha(base[3], tex[3])), 24));
+
+  store_rows((float*)(fb->color_buffer + x + y*fb->stride), fb->stride,
+             mask, _mm256_castsi256_ps(out));
+
+  return passed;
+}
+
+TargetAvx2
+static AlwaysInline __m256 depth_test(int depth, __m256 src, __m256 dst) {
+  switch (depth) {
+  case DepthTestAlways: return _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+
+  case DepthTestEQ: return _mm256_cmp_ps(src, dst, _CMP_EQ_OQ);
+  case DepthTestLT: return _mm256_cmp_ps(src, dst, _CMP_LT_OQ);
+  case DepthTestLE: return _mm256_cmp_ps(src, dst, _CMP_LE_OQ);
+  case DepthTestGT: return _mm256_cmp_ps(src, dst, _CMP_GT_OQ);
+  case DepthTestGE: return _mm256_cmp_ps(src, dst, _CMP_GE_OQ);
+  }
+
+  return _mm256_setzero_ps();
+}
+
+/*
+ * Samples the quad at (x, y) like the scalar sample_texture. Texels outside of
+ * the mask, or of the texture with WrapBorder, are left white.
+ */
+TargetAvx2
+static __m256i sample_texture(const texture *tex, const triangle_setup *tri,
+                              int x, int y, __m256 u, __m256 v, __m256 mask) {
+  __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1);
+
+  if (tex->wrap == WrapBorder) {
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(zero, u, _CMP_LE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(u, one, _CMP_LE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(zero, v, _CMP_LE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(v, one, _CMP_LE_OQ));
+  }
+
+  if (tex->wrap == WrapRepeat) {
+    u = _mm256_sub_ps(u, _mm256_floor_ps(u));
+    v = _mm256_sub_ps(v, _mm256_floor_ps(v));
+  }
+
+  /* max returns its second operand for NaNs. */
+  u = _mm256_min_ps(_mm256_max_ps(u, zero), one);
+  v = _mm256_min_ps(_mm256_max_ps(v, zero), one);
+
+  float lod = tex->mip_count != 0 ? texture_lod(tex, tri, x, y) : 0;
+  __m256 c[4];
+
+  if (tex->filter == FilterTrilinear && tex->mip_count != 0) {
+    size_t i = lod;
+    float t = lod - i;
+
+    sample_bilinear(texture_level_at(tex, i), tex->wrap, u, v, mask, c);
+
+    if (i < tex->mip_count && t > 0) {
+      __m256 d[4];
+      sample_bilinear(texture_level_at(tex, i+1), tex->wrap, u, v, mask, d);
+
+      for (int k = 0; k < 4; k++) {
+        c[k] = _mm256_add_ps(
+          c[k], _mm256_mul_ps(_mm256_sub_ps(d[k], c[k]), _mm256_set1_ps(t)));
+      }
+    }
+  }
+  else {
+    texture_level level = texture_level_at(tex, (size_t)(lod + 0.5f));
+
+    if (tex->filter == FilterNearest)
+      return sample_nearest(level, u, v, mask);
+
+    sample_bilinear(level, tex->wrap, u, v, mask, c);
+  }
+
+  return _mm256_blendv_epi8(_mm256_set1_epi32(-1), pack_color(c),
+                            _mm256_castps_si256(mask));
+}
+
+TargetAvx2
+static __m256i sample_nearest(texture_level level, __m256 u, __m256 v,
+                              __m256 mask) {
+  __m256i x = _mm256_cvttps_epi32(_mm256_mul_ps(u, _mm256_set1_ps(level.w)));
+  __m256i y = _mm256_cvttps_epi32(_mm256_mul_ps(v, _mm256_set1_ps(level.h)));
+  x = _mm256_min_epi32(x, _mm256_set1_epi32(level.w - 1));
+  y = _mm256_min_epi32(y, _mm256_set1_epi32(level.h - 1));
+
+  if (is_compressed(level.format)) return decode_texels(&level, x, y, mask);
+
+  __m256i index = _mm256_add_epi32(texel_columns(&level, x),
+                                   texel_rows(&level, y));
+
+  return _mm256_mask_i32gather_epi32(_mm256_set1_epi32(-1),
+                                     (const int*)level.data, index,
+                                     _mm256_castps_si256(mask), 4);
+}
+
+/* Stores the four unrounded channels in c. */
+TargetAvx2
+static void sample_bilinear(texture_level level, texture_wrap wrap,
+                            __m256 u, __m256 v, __m256 mask, __m256 c[4]) {
+  __m256 half = _mm256_set1_ps(0.5f), one = _mm256_set1_ps(1);
+
+  __m256 x = _mm256_sub_ps(_mm256_mul_ps(u, _mm256_set1_ps(level.w)), half);
+  __m256 y = _mm256_sub_ps(_mm256_mul_ps(v, _mm256_set1_ps(level.h)), half);
+  __m256 x0 = _mm256_floor_ps(x), y0 = _mm256_floor_ps(y);
+  __m256 fx = _mm256_sub_ps(x, x0), fy = _mm256_sub_ps(y, y0);
+  __m256 gx = _mm256_sub_ps(one, fx), gy = _mm256_sub_ps(one, fy);
+
+  __m256i i0 = _mm256_cvttps_epi32(x0), j0 = _mm256_cvttps_epi32(y0);
+  __m256i i1 = _mm256_add_epi32(i0, _mm256_set1_epi32(1));
+  __m256i j1 = _mm256_add_epi32(j0, _mm256_set1_epi32(1));
+
+  i0 = wrap_index(i0, level.w, wrap);
+  i1 = wrap_index(i1, level.w, wrap);
+  j0 = wrap_index(j0, level.h, wrap);
+  j1 = wrap_index(j1, level.h, wrap);
+
+  __m256i texels[4];
+
+  if (is_compressed(level.format)) {
+    texels[0] = decode_texels(&level, i0, j0, mask);
+    texels[1] = decode_texels(&level, i1, j0, mask);
+    texels[2] = decode_texels(&level, i0, j1, mask);
+    texels[3] = decode_texels(&level, i1, j1, mask);
+  }
+  else {
+    i0 = texel_columns(&level, i0);
+    i1 = texel_columns(&level, i1);
+    j0 = texel_rows(&level, j0);
+    j1 = texel_rows(&level, j1);
+
+    texels[0] = _mm256_add_epi32(i0, j0);
+    texels[1] = _mm256_add_epi32(i1, j0);
+    texels[2] = _mm256_add_epi32(i0, j1);
+    texels[3] = _mm256_add_epi32(i1, j1);
+
+    for (int k = 0; k < 4; k++) {
+      texels[k] = _mm256_mask_i32gather_epi32(
+        _mm256_setzero_si256(), (const int*)level.data, texels[k],
+        _mm256_castps_si256(mask), 4);
+    }
+  }
+
+  __m256i byte = _mm256_set1_epi32(0xff);
+
+  for (int k = 0; k < 4; k++) {
+    __m256 a = _mm256_cvtepi32_ps(
+      _mm256_and_si256(_mm256_srli_epi32(texels[0], 8*k), byte));
+    __m256 b = _mm256_cvtepi32_ps(
+      _mm256_and_si256(_mm256_srli_epi32(texels[1], 8*k), byte));
+    __m256 d = _mm256_cvtepi32_ps(
+      _mm256_and_si256(_mm256_srli_epi32(texels[2], 8*k), byte));
+    __m256 e = _mm256_cvtepi32_ps(
+      _mm256_and_si256(_mm256_srli_epi32(texels[3], 8*k), byte));
+
+    __m256 top = _mm256_add_ps(_mm256_mul_ps(a, gx), _mm256_mul_ps(b, fx));
+    __m256 bottom = _mm256_add_ps(_mm256_mul_ps(d, gx), _mm256_mul_ps(e, fx));
+
+    c[k] = _mm256_add_ps(_mm256_mul_ps(top, gy), _mm256_mul_ps(bottom, fy));
+  }
+}
+
+/* i is at most one texel outside of [0, n). */
+TargetAvx2
+static __m256i wrap_index(__m256i i, size_t n, texture_wrap wrap) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i size = _mm256_set1_epi32(n), last = _mm256_set1_epi32(n - 1);
+
+  if (wrap == WrapRepeat) {
+    i = _mm256_add_epi32(i, _mm256_and_si256(_mm256_cmpgt_epi32(zero, i),
+                                             size));
+    return _mm256_sub_epi32(i, _mm256_and_si256(_mm256_cmpgt_epi32(i, last),
+                                                size));
+  }
+
+  return _mm256_min_epi32(_mm256_max_epi32(i, zero), last);
+}
+
+/*
+ * Index of texel (x, y) in the data of a level, split into a part that only
+ * depends on x and one that only depends on y, so that the four texels of a
+ * bilinear sample share them.
+ */
+TargetAvx2
+static __m256i texel_columns(const texture_level *level, __m256i x) {
+  if (!level->tiled) return x;
+
+  __m256i in_block = _mm256_set1_epi32(TexelBlockSize - 1);
+  __m256i block = _mm256_andnot_si256(in_block, x);
+
+  return _mm256_add_epi32(_mm256_slli_epi32(block, 2),
+                          _mm256_and_si256(x, in_block));
+}
+
+TargetAvx2
+static __m256i texel_rows(const texture_level *level, __m256i y) {
+  __m256i stride = _mm256_set1_epi32(level->stride);
+  if (!level->tiled) return _mm256_mullo_epi32(y, stride);
+
+  __m256i in_block = _mm256_set1_epi32(TexelBlockSize - 1);
+  __m256i block = _mm256_andnot_si256(in_block, y);
+
+  return _mm256_add_epi32(_mm256_mullo_epi32(block, stride),
+                          _mm256_slli_epi32(_mm256_and_si256(y, in_block), 2));
+}
+
+/*
+ * Decodes texels of a compressed level like decode_texel, with divisions by
+ * constants done as multiplications, exact over the range of their operands.
+ * Texels outside of the mask are white.
+ */
+TargetAvx2
+static __m256i decode_texels(const texture_level *level, __m256i x, __m256i y,
+                             __m256 mask) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i gather_mask = _mm256_castps_si256(mask);
+  const int *blocks = (const int*)level->blocks;
+
+  __m256i in_block = _mm256_set1_epi32(TexelBlockSize - 1);
+  __m256i block = _mm256_add_epi32(
+    _mm256_srli_epi32(x, 2),
+    _mm256_mullo_epi32(_mm256_srli_epi32(y, 2),
+                       _mm256_set1_epi32(level->stride / TexelBlockSize)));
+  __m256i texel = _mm256_add_epi32(
+    _mm256_slli_epi32(_mm256_and_si256(y, in_block), 2),
+    _mm256_and_si256(x, in_block));
+
+  __m256i offset, alpha = zero, four_colors;
+
+  if (level->format == ColorBC1)
+    offset = _mm256_slli_epi32(block, 3);
+  else {
+    offset = _mm256_slli_epi32(block, 4);
+    alpha = decode_alpha(blocks, offset, texel, gather_mask);
+    offset = _mm256_add_epi32(offset, _mm256_set1_epi32(8));
+  }
+
+  __m256i endpoints = _mm256_mask_i32gather_epi32(zero, blocks, offset,
+                                                  gather_mask, 1);
+  __m256i bits = _mm256_mask_i32gather_epi32(
+    zero, blocks, _mm256_add_epi32(offset, _mm256_set1_epi32(4)),
+    gather_mask, 1);
+
+  __m256i i = _mm256_and_si256(
+    _mm256_srlv_epi32(bits, _mm256_slli_epi32(texel, 1)),
+    _mm256_set1_epi32(3));
+
+  __m256i c0 = _mm256_and_si256(endpoints, _mm256_set1_epi32(0xffff));
+  __m256i c1 = _mm256_srli_epi32(endpoints, 16);
+
+  if (level->format == ColorBC1) {
+    four_colors = _mm256_cmpgt_epi32(c0, c1);
+
+    __m256i transparent = _mm256_andnot_si256(
+      four_colors, _mm256_cmpeq_epi32(i, _mm256_set1_epi32(3)));
+    alpha = _mm256_andnot_si256(transparent, _mm256_set1_epi32(255));
+  }
+  else
+    four_colors = _mm256_set1_epi32(-1);
+
+  static const int shifts[3] = {11, 5, 0}, sizes[3] = {5, 6, 5};
+  __m256i out = _mm256_slli_epi32(alpha, 24);
+
+  for (int k = 0; k < 3; k++) {
+    __m256i a = expand_channel(c0, shifts[k], sizes[k]);
+    __m256i b = expand_channel(c1, shifts[k], sizes[k]);
+
+    __m256i a2b = _mm256_add_epi32(_mm256_add_epi32(a, a), b);
+    __m256i ab2 = _mm256_add_epi32(_mm256_add_epi32(a, b), b);
+
+    __m256i p2 = _mm256_blendv_epi8(
+      _mm256_srli_epi32(_mm256_add_epi32(a, b), 1), divide(a2b, 43691, 17),
+      four_colors);
+    __m256i p3 = _mm256_and_si256(divide(ab2, 43691, 17), four_colors);
+
+    __m256i channel = select_palette(i, a, b, p2, p3);
+    out = _mm256_or_si256(out, _mm256_slli_epi32(channel, 8*k));
+  }
+
+  return _mm256_blendv_epi8(_mm256_set1_epi32(-1), out, gather_mask);
+}
+
+/* Alpha of texels in BC3 blocks, which start at offset bytes. */
+TargetAvx2
+static __m256i decode_alpha(const int *blocks, __m256i offset, __m256i texel,
+                            __m256i mask) {
+  __m256i zero = _mm256_setzero_si256(), byte = _mm256_set1_epi32(0xff);
+
+  __m256i endpoints = _mm256_mask_i32gather_epi32(zero, blocks, offset,
+                                                  mask, 1);
+  __m256i a0 = _mm256_and_si256(endpoints, byte);
+  __m256i a1 = _mm256_and_si256(_mm256_srli_epi32(endpoints, 8), byte);
+
+  /* 3 bits per texel, after the endpoints. */
+  __m256i bit = _mm256_add_epi32(
+    _mm256_set1_epi32(16),
+    _mm256_add_epi32(texel, _mm256_slli_epi32(texel, 1)));
+  __m256i bits = _mm256_mask_i32gather_epi32(
+    zero, blocks, _mm256_add_epi32(offset, _mm256_srli_epi32(bit, 3)),
+    mask, 1);
+  __m256i i = _mm256_and_si256(
+    _mm256_srlv_epi32(bits, _mm256_and_si256(bit, _mm256_set1_epi32(7))),
+    _mm256_set1_epi32(7));
+
+  __m256i eight_alphas = _mm256_cmpgt_epi32(a0, a1);
+  __m256i i1 = _mm256_sub_epi32(i, _mm256_set1_epi32(1));
+
+  __m256i alpha8 = divide(
+    _mm256_add_epi32(
+      _mm256_mullo_epi32(_mm256_sub_epi32(_mm256_set1_epi32(8), i), a0),
+      _mm256_mullo_epi32(i1, a1)),
+    9363, 16);
+  __m256i alpha6 = divide(
+    _mm256_add_epi32(
+      _mm256_mullo_epi32(_mm256_sub_epi32(_mm256_set1_epi32(6), i), a0),
+      _mm256_mullo_epi32(i1, a1)),
+    13108, 16);
+
+  __m256i alpha = _mm256_blendv_epi8(alpha6, alpha8, eight_alphas);
+
+  __m256i zero_alpha = _mm256_andnot_si256(
+    eight_alphas, _mm256_cmpeq_epi32(i, _mm256_set1_epi32(6)));
+  __m256i full_alpha = _mm256_andnot_si256(
+    eight_alphas, _mm256_cmpeq_epi32(i, _mm256_set1_epi32(7)));
+
+  alpha = _mm256_blendv_epi8(alpha, zero, zero_alpha);
+  alpha = _mm256_blendv_epi8(alpha, byte, full_alpha);
+  alpha = _mm256_blendv_epi8(alpha, a0,
+                             _mm256_cmpeq_epi32(i, zero));
+
+  return _mm256_blendv_epi8(alpha, a1,
+                            _mm256_cmpeq_epi32(i, _mm256_set1_epi32(1)));
+}
+
+/* Expands a channel of an RGB565 color to 8 bits. */
+TargetAvx2
+static __m256i expand_channel(__m256i c, int shift, int bits) {
+  __m256i v = _mm256_and_si256(_mm256_srli_epi32(c, shift),
+                               _mm256_set1_epi32((1 << bits) - 1));
+
+  return _mm256_or_si256(_mm256_slli_epi32(v, 8 - bits),
+                         _mm256_srli_epi32(v, 2*bits - 8));
+}
+
+TargetAvx2
+static __m256i select_palette(__m256i i, __m256i p0, __m256i p1, __m256i p2,
+                              __m256i p3) {
+  __m256i p = _mm256_blendv_epi8(p0, p1,
+                                 _mm256_cmpeq_epi32(i, _mm256_set1_epi32(1)));
+  p = _mm256_blendv_epi8(p, p2, _mm256_cmpeq_epi32(i, _mm256_set1_epi32(2)));
+
+  return _mm256_blendv_epi8(p, p3,
+                            _mm256_cmpeq_epi32(i, _mm256_set1_epi32(3)));
+}
+
+/* x * magic >> shift, for x small enough not to overflow. */
+TargetAvx2
+static __m256i divide(__m256i x, int magic, int shift) {
+  return _mm256_srli_epi32(_mm256_mullo_epi32(x, _mm256_set1_epi32(magic)),
+                           shift);
+}
+
+/* Rounds the channels of c to the nearest integers, and packs them. */
+TargetAvx2
+static __m256i pack_color(const __m256 c[4]) {
+  __m256 half = _mm256_set1_ps(0.5f);
+  __m256i out = _mm256_setzero_si256();
+
+  for (int k = 0; k < 4; k++) {
+    __m256i channel = _mm256_cvttps_epi32(_mm256_add_ps(c[k], half));
+    out = _mm256_or_si256(out, _mm256_slli_epi32(channel, 8*k));
+  }
+
+  return out;
+}
+
+TargetAvx2
+static void compute_lighting(const shading_state *shading, vector3x8 normal,
+                             vector3x8 eye, __m256 light[3]) {
+  __m256 zero = _mm256_setzero_ps(), two = _mm256_set1_ps(2);
+
+  vector3x8 n = normalize(normal);
+  vector3x8 e = normalize(eye);
+
+  light[0] = light[1] = light[2] = zero;
+
+  for (size_t i = 0; i < shading->light_count; i++) {
+    const struct light *src = &shading->lights[i];
+
+    vector3x8 l = normalize((vector3x8){
+      _mm256_add_ps(e.x, _mm256_set1_ps(src->pos.x)),
+      _mm256_add_ps(e.y, _mm256_set1_ps(src->pos.y)),
+      _mm256_add_ps(e.z, _mm256_set1_ps(src->pos.z)),
+    });
+
+    /* r = reflect(-l, n) */
+    vector3x8 ray = {
+      _mm256_sub_ps(zero, l.x), _mm256_sub_ps(zero, l.y),
+      _mm256_sub_ps(zero, l.z),
+    };
+    __m256 k = _mm256_mul_ps(two, _mm256_max_ps(dot(ray, n), zero));
+    vector3x8 r = {
+      _mm256_sub_ps(ray.x, _mm256_mul_ps(k, n.x)),
+      _mm256_sub_ps(ray.y, _mm256_mul_ps(k, n.y)),
+      _mm256_sub_ps(ray.z, _mm256_mul_ps(k, n.z)),
+    };
+
+    __m256 diffuse = _mm256_max_ps(_mm256_sub_ps(zero, dot(l, n)), zero);
+    __m256 specular = pow8(_mm256_max_ps(dot(r, e), zero),
+                           shading->specular_power);
+
+    const color *ambient = &src->ambient;
+    const color *diffuse_color = &src->diffuse;
+    const color *specular_color = &src->specular;
+
+    light[0] = clamp_color(_mm256_add_ps(_mm256_add_ps(
+      _mm256_add_ps(light[0], _mm256_set1_ps(ambient->r)),
+      _mm256_mul_ps(diffuse, _mm256_set1_ps(diffuse_color->r))),
+      _mm256_mul_ps(specular, _mm256_set1_ps(specular_color->r))));
+    light[1] = clamp_color(_mm256_add_ps(_mm256_add_ps(
+      _mm256_add_ps(light[1], _mm256_set1_ps(ambient->g)),
+      _mm256_mul_ps(diffuse, _mm256_set1_ps(diffuse_color->g))),
+      _mm256_mul_ps(specular, _mm256_set1_ps(specular_color->g))));
+    light[2] = clamp_color(_mm256_add_ps(_mm256_add_ps(
+      _mm256_add_ps(light[2], _mm256_set1_ps(ambient->b)),
+      _mm256_mul_ps(diffuse, _mm256_set1_ps(diffuse_color->b))),
+      _mm256_mul_ps(specular, _mm256_set1_ps(specular_color->b))));
+  }
+}
+
+TargetAvx2
+static __m256 lane_mask(unsigned bits) {
+  __m256i lanes = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  return _mm256_castsi256_ps(_mm256_cmpeq_epi32(
+    _mm256_and_si256(_mm256_set1_epi32(bits), lanes), lanes));
+}
+
+/* Masked lanes may lie outside of the buffer, and are never accessed. */
+TargetAvx2
+static __m256 load_rows(const float *row, size_t stride, __m256 mask) {
+  __m128i lo = _mm_castps_si128(_mm256_castps256_ps128(mask));
+  __m128i hi = _mm_castps_si128(_mm256_extractf128_ps(mask, 1));
+
+  return _mm256_insertf128_ps(
+    _mm256_castps128_ps256(_mm_maskload_ps(row, lo)),
+    _mm_maskload_ps(row + stride, hi), 1);
+}
+
+TargetAvx2
+static void store_rows(float *row, size_t stride, __m256 mask, __m256 v) {
+  __m128i lo = _mm_castps_si128(_mm256_castps256_ps128(mask));
+  __m128i hi = _mm_castps_si128(_mm256_extractf128_ps(mask, 1));
+
+  _mm_maskstore_ps(row, lo, _mm256_castps256_ps128(v));
+  _mm_maskstore_ps(row + stride, hi, _mm256_extractf128_ps(v, 1));
+}
+
+TargetAvx2
+static __m256 plane_at(plane p, __m256 x, __m256 y) {
+  return _mm256_add_ps(
+    _mm256_add_ps(_mm256_set1_ps(p.a), _mm256_mul_ps(_mm256_set1_ps(p.dx), x)),
+    _mm256_mul_ps(_mm256_set1_ps(p.dy), y));
+}
+
+TargetAvx2
+static __m256 interpolate(plane p, __m256 x, __m256 y, __m256 w) {
+  return _mm256_mul_ps(plane_at(p, x, y), w);
+}
+
+TargetAvx2
+static vector3x8 interpolate_vector3(const plane p[3], __m256 x, __m256 y,
+                                     __m256 w) {
+  return (vector3x8){
+    interpolate(p[0], x, y, w),
+    interpolate(p[1], x, y, w),
+    interpolate(p[2], x, y, w),
+  };
+}
+
+TargetAvx2
+static __m256 dot(vector3x8 a, vector3x8 b) {
+  return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a.x, b.x),
+                                     _mm256_mul_ps(a.y, b.y)),
+                       _mm256_mul_ps(a.z, b.z));
+}
+
+TargetAvx2
+static vector3x8 normalize(vector3x8 v) {
+  __m256 norm = _mm256_sqrt_ps(dot(v, v));
+  return (vector3x8){
+    _mm256_div_ps(v.x, norm), _mm256_div_ps(v.y, norm),
+    _mm256_div_ps(v.z, norm),
+  };
+}
+
+/*
+ * base * tex/255 * light/255, rounded like the scalar path which computes it
+ * in double precision.
+ */
+TargetAvx2
+static __m256 modulate(__m256 base, __m256 tex, __m256 light) {
+  __m256 bt = _mm256_mul_ps(base, tex);
+  __m256d scale = _mm256_set1_pd(255.0);
+
+  __m256d lo = _mm256_div_pd(_mm256_mul_pd(
+    _mm256_div_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(bt)), scale),
+    _mm256_cvtps_pd(_mm256_castps256_ps128(light))), scale);
+  __m256d hi = _mm256_div_pd(_mm256_mul_pd(
+    _mm256_div_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(bt, 1)), scale),
+    _mm256_cvtps_pd(_mm256_extractf128_ps(light, 1))), scale);
+
+  return _mm256_insertf128_ps(
+    _mm256_castps128_ps256(_mm256_cvtpd_ps(_mm256_round_pd(lo,
+                                                          _MM_FROUND_TO_ZERO))),
+    _mm256_cvtpd_ps(_mm256_round_pd(hi, _MM_FROUND_TO_ZERO)), 1);
+}
+
+/* base * tex/255, also in double precision. */
+TargetAvx2
+static __m256 modulate_alpha(__m256 base, __m256 tex) {
+  __m256 bt = _mm256_mul_ps(base, tex);
+  __m256d scale = _mm256_set1_pd(255.0);
+
+  __m256d lo = _mm256_div_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(bt)),
+                             scale);
+  __m256d hi = _mm256_div_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(bt, 1)),
+                             scale);
+
+  return _mm256_insertf128_ps(
+    _mm256_castps128_ps256(_mm256_cvtpd_ps(_mm256_round_pd(lo,
+                                                          _MM_FROUND_TO_ZERO))),
+    _mm256_cvtpd_ps(_mm256_round_pd(hi, _MM_FROUND_TO_ZERO)), 1);
+}
+
+/* Same as converting to uint8_t with clamp(). */
+TargetAvx2
+static __m256 clamp_color(__m256 v) {
+  v = _mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()),
+                    _mm256_set1_ps(255));
+  return _mm256_round_ps(v, _MM_FROUND_TO_ZERO);
+}
+
+/* x^p for x >= 0. */
+TargetAvx2
+static __m256 pow8(__m256 x, float p) {
+  __m256 positive = _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_GT_OQ);
+  __m256 y = exp8(_mm256_mul_ps(_mm256_set1_ps(p), log8(x)));
+
+  return _mm256_blendv_ps(_mm256_set1_ps(powf(0, p)), y, positive);
+}
+
+/* Cephes expf, accurate to about one ulp. */
+TargetAvx2
+static __m256 exp8(__m256 x) {
+  x = _mm256_min_ps(x, _mm256_set1_ps(88.3762626647949f));
+  x = _mm256_max_ps(x, _mm256_set1_ps(-88.3762626647949f));
+
+  __m256 fx = _mm256_floor_ps(_mm256_add_ps(
+    _mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)),
+    _mm256_set1_ps(0.5f)));
+
+  x = _mm256_sub_ps(x, _mm256_mul_ps(fx, _mm256_set1_ps(0.693359375f)));
+  x = _mm256_sub_ps(x, _mm256_mul_ps(fx, _mm256_set1_ps(-2.12194440e-4f)));
+
+  __m256 z = _mm256_mul_ps(x, x);
+
+  __m256 y = _mm256_set1_ps(1.9875691500e-4f);
+  y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(1.3981999507e-3f));
+  y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(8.3334519073e-3f));
+  y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(4.1665795894e-2f));
+  y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(1.6666665459e-1f));
+  y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(5.0000001201e-1f));
+  y = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(y, z), x),
+                    _mm256_set1_ps(1));
+
+  __m256i n = _mm256_add_epi32(_mm256_cvttps_epi32(fx), _mm256_set1_epi32(127));
+  return _mm256_mul_ps(y, _mm256_castsi256_ps(_mm256_slli_epi32(n, 23)));
+}
+
+/* Cephes logf, for x > 0. */
+TargetAvx2
+static __m256 log8(__m256 x) {
+  __m256 one = _mm256_set1_ps(1);
+  __m256i bits = _mm256_castps_si256(x);
+
+  __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23),
+                                                 _mm256_set1_epi32(126)));
+
+  /* Mantissa in [0.5, 1). */
+  __m256 m = _mm256_castsi256_ps(_mm256_or_si256(
+    _mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)),
+    _mm256_set1_epi32(0x3f000000)));
+
+  __m256 small = _mm256_cmp_ps(m, _mm256_set1_ps(0.707106781186547524f),
+                               _CMP_LT_OQ);
+  e = _mm256_sub_ps(e, _mm256_and_ps(one, small));
+  m = _mm256_add_ps(_mm256_sub_ps(m, one), _mm256_and_ps(m, small));
+
+  __m256 z = _mm256_mul_ps(m, m);
+
+  __m256 y = _mm256_set1_ps(7.0376836292e-2f);
+  y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(-1.1514610310e-1f));
+  y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(1.1676998740e-1f));
+  y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(-1.2420140846e-1f));
+  y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(1.4249322787e-1f));
+  y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(-1.6668057665e-1f));
+  y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(2.0000714765e-1f));
+  y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(-2.4999993993e-1f));
+  y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(3.3333331174e-1f));
+  y = _mm256_mul_ps(_mm256_mul_ps(y, m), z);
+
+  y = _mm256_add_ps(y, _mm256_mul_ps(e, _mm256_set1_ps(-2.12194440e-4f)));
+  y = _mm256_sub_ps(y, _mm256_mul_ps(z, _mm256_set1_ps(0.5f)));
+
+  m = _mm256_add_ps(m, y);
+  return _mm256_add_ps(m, _mm256_mul_ps(e, _mm256_set1_ps(0.693359375f)));
+}
+
+#else
+
+bool fragment_simd_supported(void) {
+  return false;
+}
+
+const fragment_pipeline *select_fragment_pipeline_simd(int depth, int shading) {
+  return NULL;
+}
+
+#endif
@@ -1,43 +1,415 @@
 #include "rasterizer.h"
 #include "color_buffer.h"
+#include "block_compression.h"
+#include "framebuffer.h"
+#include "thread_pool.h"
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* A clear of a target without fast clears, split into rows of tiles. */
+typedef struct clear_task {
+  framebuffer *fb;
+  unsigned what;
+  color c;
+  float z;
+} clear_task;
+
+static void clear_rows(framebuffer *fb, unsigned what, color c, float z,
+                       size_t y0, size_t y1);
+static void clear_tile_rows(void *data, size_t i);
+static void stream_fill(void *buffer, const void *value, size_t n);
+
+static void fill_pixels(uint8_t *buffer, size_t w, size_t h, size_t stride,
+                        const void *value, size_t size);
 
 int make_framebuffer(framebuffer *fb, size_t w, size_t h) {
+  color *pixels = malloc(sizeof(*pixels)*w*h);
+  if (!pixels) return -1;
+
+  if (wrap_framebuffer(fb, w, h, pixels, sizeof(*pixels)*w) < 0) {
+    free(pixels);
+    return -1;
+  }
+
+  fb->owns_color_buffer = true;
+
+  if (set_fast_clear(fb, true) < 0) {
+    framebuffer_release(fb);
+    return -1;
+  }
+
+  return 0;
+}
+
+int wrap_framebuffer(framebuffer *fb, size_t w, size_t h,
+                     color *pixels, size_t stride) {
+  if (stride % sizeof(*pixels) != 0 || stride < sizeof(*pixels)*w)
+    return -1;
+
   fb->w = w;
   fb->h = h;
 
-  fb->color_buffer = malloc(sizeof(*fb->color_buffer)*w*h);
-  if (!fb->color_buffer) return -1;
+  fb->stride = stride / sizeof(*pixels);
+  fb->color_buffer = pixels;
+  fb->owns_color_buffer = false;
 
   fb->depth_buffer = malloc(sizeof(*fb->depth_buffer)*w*h);
-  if (!fb->depth_buffer) {
-    free(fb->color_buffer);
+  if (!fb->depth_buffer) return -1;
+
+  fb->depth_blocks_x = (w + DepthBlockSize - 1) / DepthBlockSize;
+  fb->depth_blocks_y = (h + DepthBlockSize - 1) / DepthBlockSize;
+  fb->depth_min = NULL;
+  fb->depth_max = NULL;
+
+  fb->tiles_x = (w + TileSize - 1) / TileSize;
+  fb->tiles_y = (h + TileSize - 1) / TileSize;
+  fb->cleared = NULL;
+  fb->clear_colors = NULL;
+  fb->clear_depths = NULL;
+
+  /* Nothing has been read yet. */
+  fb->dirty = malloc(sizeof(*fb->dirty) * fb->tiles_x * fb->tiles_y);
+  if (!fb->dirty) {
+    free(fb->depth_buffer);
     return -1;
   }
 
+  for (size_t i = 0; i < fb->tiles_x*fb->tiles_y; i++)
+    fb->dirty[i] = true;
+
   return 0;
 }
 
 void framebuffer_release(framebuffer *fb) {
-  free(fb->color_buffer);
+  if (fb->owns_color_buffer) free(fb->color_buffer);
   free(fb->depth_buffer);
+  free(fb->depth_min);
+  free(fb->depth_max);
+  free(fb->cleared);
+  free(fb->clear_colors);
+  free(fb->clear_depths);
+  free(fb->dirty);
 }
 
 void clear_color_buffer(framebuffer *fb, color c) {
-  for (size_t i = 0; i < fb->w*fb->h; i++)
-    fb->color_buffer[i] = c;
+  if (!fb->cleared) {
+    clear_rows(fb, TileColorCleared, c, 0, 0, fb->h);
+    return;
+  }
+
+  /* Tiles that were not drawn to since the same clear keep their colors. */
+  for (size_t i = 0; i < fb->tiles_x*fb->tiles_y; i++) {
+    if (!(fb->cleared[i] & TileColorCleared) ||
+        memcmp(&c, &fb->clear_colors[i], sizeof(c)) != 0)
+      fb->dirty[i] = true;
+
+    fb->cleared[i] |= TileColorCleared;
+    fb->clear_colors[i] = c;
+  }
 }
 
 void clear_depth_buffer(framebuffer *fb, float z) {
-  for (size_t i = 0; i < fb->w*fb->h; i++)
-    fb->depth_buffer[i] = z;
+  if (!fb->cleared) {
+    clear_rows(fb, TileDepthCleared, (color){0, 0, 0, 0}, z, 0, fb->h);
+    return;
+  }
+
+  for (size_t i = 0; i < fb->tiles_x*fb->tiles_y; i++) {
+    fb->cleared[i] |= TileDepthCleared;
+    fb->clear_depths[i] = z;
+  }
+}
+
+void clear_target_color(renderer *state, color c) {
+  framebuffer *fb = state->target;
+
+  discard_deferred(state);
+
+  if (fb->cleared || !state->pool) {
+    clear_color_buffer(fb, c);
+    return;
+  }
+
+  clear_task task = {fb, TileColorCleared, c, 0};
+  thread_pool_run(state->pool, fb->tiles_y, clear_tile_rows, &task);
+}
+
+void clear_target_depth(renderer *state, float z) {
+  framebuffer *fb = state->target;
+
+  if (fb->cleared || !state->pool) {
+    clear_depth_buffer(fb, z);
+    return;
+  }
+
+  clear_task task = {fb, TileDepthCleared, {0, 0, 0, 0}, z};
+  thread_pool_run(state->pool, fb->tiles_y, clear_tile_rows, &task);
+}
+
+int set_fast_clear(framebuffer *fb, bool on) {
+  if (!on) {
+    if (fb->cleared) fill_cleared_tiles(fb);
+
+    free(fb->cleared);
+    free(fb->clear_colors);
+    free(fb->clear_depths);
+
+    fb->cleared = NULL;
+    fb->clear_colors = NULL;
+    fb->clear_depths = NULL;
+    return 0;
+  }
+
+  if (fb->cleared) return 0;
+
+  size_t n = fb->tiles_x * fb->tiles_y;
+
+  uint8_t *cleared = calloc(n, sizeof(*cleared));
+  color *colors = malloc(sizeof(*colors) * n);
+  float *depths = malloc(sizeof(*depths) * n);
+
+  if (!cleared || !colors || !depths) {
+    free(cleared);
+    free(colors);
+    free(depths);
+    return -1;
+  }
+
+  fb->cleared = cleared;
+  fb->clear_colors = colors;
+  fb->clear_depths = depths;
+
+  return 0;
+}
+
+bool get_fast_clear(const framebuffer *fb) {
+  return fb->cleared != NULL;
+}
+
+void fill_cleared_tile(framebuffer *fb, size_t tile) {
+  unsigned what = fb->cleared[tile];
+
+  size_t tx = tile % fb->tiles_x, ty = tile / fb->tiles_x;
+
+  size_t x0 = tx * TileSize, x1 = x0 + TileSize;
+  size_t y0 = ty * TileSize, y1 = y0 + TileSize;
+  if (x1 > fb->w) x1 = fb->w;
+  if (y1 > fb->h) y1 = fb->h;
+
+  for (size_t y = y0; y < y1; y++) {
+    if (what & TileColorCleared) {
+      for (size_t x = x0; x < x1; x++)
+        fb->color_buffer[x+y*fb->stride] = fb->clear_colors[tile];
+    }
+
+    if (what & TileDepthCleared) {
+      for (size_t x = x0; x < x1; x++)
+        fb->depth_buffer[x+y*fb->w] = fb->clear_depths[tile];
+    }
+  }
+
+  if ((what & TileDepthCleared) && fb->depth_min) {
+    size_t bx1 = (x1 + DepthBlockSize - 1) / DepthBlockSize;
+    size_t by1 = (y1 + DepthBlockSize - 1) / DepthBlockSize;
+
+    for (size_t by = y0 / DepthBlockSize; by < by1; by++) {
+      for (size_t bx = x0 / DepthBlockSize; bx < bx1; bx++) {
+        size_t i = bx + by*fb->depth_blocks_x;
+        fb->depth_min[i] = fb->depth_max[i] = fb->clear_depths[tile];
+      }
+    }
+  }
+
+  fb->cleared[tile] = 0;
+}
+
+void fill_cleared_tiles(framebuffer *fb) {
+  for (size_t i = 0; i < fb->tiles_x*fb->tiles_y; i++) {
+    if (fb->cleared[i]) fill_cleared_tile(fb, i);
+  }
+}
+
+static void clear_rows(framebuffer *fb, unsigned what, color c, float z,
+                       size_t y0, size_t y1) {
+  if (what & TileColorCleared) {
+    if (fb->stride == fb->w)
+      stream_fill(fb->color_buffer + y0*fb->w, &c, (y1 - y0) * fb->w);
+    else {
+      for (size_t y = y0; y < y1; y++)
+        stream_fill(fb->color_buffer + y*fb->stride, &c, fb->w);
+    }
+
+    size_t ty1 = (y1 + TileSize - 1) / TileSize;
+    for (size_t i = y0 / TileSize * fb->tiles_x; i < ty1 * fb->tiles_x; i++)
+      fb->dirty[i] = true;
+  }
+
+  if (what & TileDepthCleared) {
+    stream_fill(fb->depth_buffer + y0*fb->w, &z, (y1 - y0) * fb->w);
+
+    if (fb->depth_min) {
+      size_t by1 = (y1 + DepthBlockSize - 1) / DepthBlockSize;
+
+      for (size_t i = y0 / DepthBlockSize * fb->depth_blocks_x;
+           i < by1 * fb->depth_blocks_x; i++)
+        fb->depth_min[i] = fb->depth_max[i] = z;
+    }
+  }
+}
+
+static void clear_tile_rows(void *data, size_t i) {
+  clear_task *task = data;
+
+  size_t y0 = i * TileSize, y1 = y0 + TileSize;
+  if (y1 > task->fb->h) y1 = task->fb->h;
+
+  clear_rows(task->fb, task->what, task->c, task->z, y0, y1);
+}
+
+/*
+ * Fills n 4-byte values. Targets are usually larger than the cache, so the
+ * stores go around it, instead of reading every line just to overwrite it.
+ */
+static void stream_fill(void *buffer, const void *value, size_t n) {
+  uint8_t *p = buffer;
+
+#ifdef __SSE2__
+  for (; n != 0 && (uintptr_t)p % 16 != 0; n--, p += 4)
+    memcpy(p, value, 4);
+
+  int bits;
+  memcpy(&bits, value, 4);
+
+  __m128i v = _mm_set1_epi32(bits);
+  for (; n >= 4; n -= 4, p += 16)
+    _mm_stream_si128((__m128i*)p, v);
+
+  _mm_sfence();
+#endif
+
+  for (; n != 0; n--, p += 4)
+    memcpy(p, value, 4);
+}
+
+int set_hierarchical_depth(framebuffer *fb, bool on) {
+  if (!on) {
+    free(fb->depth_min);
+    free(fb->depth_max);
+    fb->depth_min = fb->depth_max = NULL;
+    return 0;
+  }
+
+  if (fb->depth_min) return 0;
+
+  size_t n = fb->depth_blocks_x * fb->depth_blocks_y;
+
+  fb->depth_min = malloc(sizeof(*fb->depth_min) * n);
+  if (!fb->depth_min) return -1;
+
+  fb->depth_max = malloc(sizeof(*fb->depth_max) * n);
+  if (!fb->depth_max) {
+    free(fb->depth_min);
+    fb->depth_min = NULL;
+    return -1;
+  }
+
+  for (size_t by = 0; by < fb->depth_blocks_y; by++) {
+    for (size_t bx = 0; bx < fb->depth_blocks_x; bx++)
+      update_depth_block(fb, bx, by);
+  }
+
+  return 0;
+}
+
+bool get_hierarchical_depth(const framebuffer *fb) {
+  return fb->depth_min != NULL;
+}
+
+void update_depth_block(framebuffer *fb, size_t bx, size_t by) {
+  size_t tile = (bx*DepthBlockSize) / TileSize +
+    (by*DepthBlockSize) / TileSize * fb->tiles_x;
+
+  if (fb->cleared && (fb->cleared[tile] & TileDepthCleared)) {
+    fb->depth_min[bx+by*fb->depth_blocks_x] = fb->clear_depths[tile];
+    fb->depth_max[bx+by*fb->depth_blocks_x] = fb->clear_depths[tile];
+    return;
+  }
+
+  float lo = INFINITY, hi = -INFINITY;
+
+  for (size_t y = by*DepthBlockSize;
+       y < (by+1)*DepthBlockSize && y < fb->h; y++) {
+    for (size_t x = bx*DepthBlockSize;
+         x < (bx+1)*DepthBlockSize && x < fb->w; x++) {
+      lo = fminf(lo, fb->depth_buffer[x+y*fb->w]);
+      hi = fmaxf(hi, fb->depth_buffer[x+y*fb->w]);
+    }
+  }
+
+  fb->depth_min[bx+by*fb->depth_blocks_x] = lo;
+  fb->depth_max[bx+by*fb->depth_blocks_x] = hi;
 }
 
 void framebuffer_read(const framebuffer *fb,
                       size_t x, size_t y, size_t w, size_t h,
                       color_format format, color_type type, void *buffer) {
-  color_buffer_read(fb->color_buffer, fb->w, fb->h,
-                    x, y, w, h, format, type, buffer);
+  if (is_compressed(format)) return;
+
+  if (!fb->cleared || w == 0 || h == 0) {
+    color_buffer_read(fb->color_buffer, fb->stride, fb->h,
+                      x, y, w, h, format, type, buffer);
+    return;
+  }
+
+  size_t size = format * (type == ColorTypeFloat ? sizeof(float) : 1);
+  size_t tx_end = (x + w - 1) / TileSize + 1;
+
+  /*
+   * Tiles that are still pending are read as their clear color, and runs of
+   * the other tiles along a row of tiles from the buffer.
+   */
+  for (size_t ty = y / TileSize; ty <= (y + h - 1) / TileSize; ty++) {
+    size_t y0 = ty * TileSize, y1 = y0 + TileSize;
+    if (y0 < y) y0 = y;
+    if (y1 > y + h) y1 = y + h;
+
+    for (size_t tx = x / TileSize, tx1; tx < tx_end; tx = tx1) {
+      size_t tile = tx + ty*fb->tiles_x;
+      bool cleared = fb->cleared[tile] & TileColorCleared;
+
+      tx1 = tx + 1;
+      while (!cleared && tx1 < tx_end &&
+             !(fb->cleared[tx1 + ty*fb->tiles_x] & TileColorCleared))
+        tx1++;
+
+      size_t x0 = tx * TileSize, x1 = tx1 * TileSize;
+      if (x0 < x) x0 = x;
+      if (x1 > x + w) x1 = x + w;
+
+      uint8_t *out = (uint8_t*)buffer + ((x0 - x) + (y0 - y)*w) * size;
+
+      if (cleared) {
+        float value[4] = {0, 0, 0, 0};
+        color_buffer_read(&fb->clear_colors[tile], 1, 1, 0, 0, 1, 1,
+                          format, type, value);
+        fill_pixels(out, x1 - x0, y1 - y0, w*size, value, size);
+        continue;
+      }
+
+      /* Runs across the whole region are read in one go. */
+      size_t rows = x1 - x0 == w ? y1 - y0 : 1;
+
+      for (size_t j = y0; j < y1; j += rows, out += rows*w*size) {
+        color_buffer_read(fb->color_buffer, fb->stride, fb->h,
+                          x0, j, x1 - x0, rows, format, type, out);
+      }
+    }
+  }
 }
 
 void depthbuffer_read(const framebuffer *fb,
@@ -45,9 +417,66 @@ void depthbuffer_read(const framebuffer *fb,
                       float *buffer) {
   for (size_t j = 0; j < h; j++) {
     for (size_t i = 0; i < w; i++) {
-      buffer[i+j*w] = fb->depth_buffer[(x+i)+(y+j)*fb->w];
+      size_t tile = (x+i)/TileSize + (y+j)/TileSize*fb->tiles_x;
+
+      if (fb->cleared && (fb->cleared[tile] & TileDepthCleared))
+        buffer[i+j*w] = fb->clear_depths[tile];
+      else
+        buffer[i+j*w] = fb->depth_buffer[(x+i)+(y+j)*fb->w];
+    }
+  }
+}
+
+size_t framebuffer_dirty_rects(const framebuffer *fb,
+                               pixel_rect *rects, size_t max) {
+  size_t n = 0;
+
+  for (size_t ty = 0; ty < fb->tiles_y; ty++) {
+    for (size_t tx = 0; tx < fb->tiles_x; tx++) {
+      if (!fb->dirty[tx + ty*fb->tiles_x]) continue;
+
+      size_t run = 1;
+      while (tx + run < fb->tiles_x && fb->dirty[tx + run + ty*fb->tiles_x])
+        run++;
+
+      if (n < max) {
+        size_t x = tx * TileSize, y = ty * TileSize;
+        size_t x1 = (tx + run) * TileSize, y1 = y + TileSize;
+
+        rects[n] = (pixel_rect){
+          x, y,
+          (x1 < fb->w ? x1 : fb->w) - x,
+          (y1 < fb->h ? y1 : fb->h) - y,
+        };
+      }
+
+      n++;
+      tx += run - 1;
     }
   }
+
+  return n;
+}
+
+void framebuffer_read_rects(const framebuffer *fb,
+                            size_t n, const pixel_rect *rects,
+                            color_format format, color_type type,
+                            void *buffer) {
+  if (is_compressed(format)) return;
+
+  size_t size = format * (type == ColorTypeFloat ? sizeof(float) : 1);
+  uint8_t *out = buffer;
+
+  for (size_t i = 0; i < n; i++) {
+    framebuffer_read(fb, rects[i].x, rects[i].y, rects[i].w, rects[i].h,
+                     format, type, out);
+    out += rects[i].w * rects[i].h * size;
+  }
+}
+
+void framebuffer_acknowledge(framebuffer *fb) {
+  for (size_t i = 0; i < fb->tiles_x*fb->tiles_y; i++)
+    fb->dirty[i] = false;
 }
 
 size_t framebuffer_width(const framebuffer *fb) {
@@ -57,3 +486,13 @@ size_t framebuffer_width(const framebuffer *fb) {
 size_t framebuffer_height(const framebuffer *fb) {
   return fb->h;
 }
+
+/* Fills w by h pixels of size bytes with value, in rows stride bytes apart. */
+static void fill_pixels(uint8_t *buffer, size_t w, size_t h, size_t stride,
+                        const void *value, size_t size) {
+  for (size_t j = 0; j < h; j++) {
+    uint8_t *row = buffer + j*stride;
+    for (size_t i = 0; i < w; i++, row += size)
+      memcpy(row, value, size);
+  }
+}
@@ -0,0 +1,30 @@
+#ifndef FRAMEBUFFER_H_
+#define FRAMEBUFFER_H_
+
+#include "rasterizer.h"
+
+/* Bits of framebuffer.cleared: what still has to be filled in a tile. */
+enum {
+  TileColorCleared = 1 << 0,
+  TileDepthCleared = 1 << 1,
+};
+
+/* Recomputes the depth range of a block of the hierarchical depth buffer. */
+void update_depth_block(framebuffer *fb, size_t bx, size_t by);
+
+/*
+ * Fills a tile with the values it was last cleared to. Must be called before
+ * its pixels are accessed, if fb->cleared[tile] is not 0.
+ */
+void fill_cleared_tile(framebuffer *fb, size_t tile);
+
+/* Fills every tile that is still pending. */
+void fill_cleared_tiles(framebuffer *fb);
+
+/*
+ * Forgets the draws a renderer in deferred mode did not resolve yet, before
+ * the color of its target is cleared.
+ */
+void discard_deferred(renderer *state);
+
+#endif
@@ -1,439 +1,1132 @@
 #include "rasterizer.h"
+#include "thread_pool.h"
+#include "tile_bins.h"
+#include "framebuffer.h"
+#include "fragment.h"
+#include "vertex_streams.h"
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
-typedef struct screen_pos {
-  int x, y;
-} screen_pos;
+/*
+ * Triangles are rasterized without clipping as long as their vertices are no
+ * further than this many pixels outside of the target. This keeps fixed-point
+ * coordinates within 32 bits and edge functions within 64 bits.
+ */
+#define GuardBand 8192
+
+/*
+ * Draws recorded in deferred mode: every triangle that was drawn since the
+ * last resolve, with the state it was drawn with, and the id of the triangle
+ * visible at each pixel.
+ */
+typedef struct deferred_draw {
+  const fragment_pipeline *pipeline;
+  shading_state shading;
+  size_t first_light;
+} deferred_draw;
+
+typedef struct deferred_triangle {
+  uint32_t draw;
+  triangle_setup setup;
+} deferred_triangle;
+
+typedef struct deferred_frame {
+  size_t w, h;
+
+  /* 1 + the index of the visible triangle, or 0 where nothing was drawn. */
+  uint32_t *visibility;
+
+  size_t draw_count, draw_capacity;
+  deferred_draw *draws;
+
+  size_t light_count, light_capacity;
+  light *lights;
+
+  size_t triangle_count, triangle_capacity;
+  deferred_triangle *triangles;
+} deferred_frame;
+
+/*
+ * Depth bounds computed for a block are widened by this much, since they are
+ * not rounded the same way as the depth of individual fragments.
+ */
+#define DepthBoundsEpsilon 1e-5f
+
+/*
+ * Bits of processed_vertex.clip_code. Triangles with all vertices outside of
+ * the same plane of the view volume are rejected. The others are only clipped
+ * when a vertex lies outside of the near or far plane, or of the guard band.
+ */
+enum {
+  ClipNear        = 1 << 0,
+  ClipFar         = 1 << 1,
+  ClipGuardLeft   = 1 << 2,
+  ClipGuardRight  = 1 << 3,
+  ClipGuardBottom = 1 << 4,
+  ClipGuardTop    = 1 << 5,
+
+  OutsideLeft     = 1 << 6,
+  OutsideRight    = 1 << 7,
+  OutsideBottom   = 1 << 8,
+  OutsideTop      = 1 << 9,
+
+  ClipInvalid     = 1 << 10,
+};
+
+#define ClipPlanes (ClipNear | ClipFar | ClipGuardLeft | ClipGuardRight | \
+                    ClipGuardBottom | ClipGuardTop)
+#define RejectPlanes (ClipNear | ClipFar | OutsideLeft | OutsideRight | \
+                      OutsideBottom | OutsideTop)
+
+#define ClipPlaneCount  6
+#define MaxClipVertices (3 + ClipPlaneCount)
+
+/* Set in vertex indices that refer to renderer.clip_vertices. */
+#define ClippedVertex 0x80000000u
+
+/*
+ * Vertices of a draw are processed in chunks of this many, in parallel when
+ * there are several threads. Every vertex belongs to exactly one chunk, so it
+ * is processed at most once, and the same way as on a single thread.
+ */
+#define VertexChunkSize 4096
+
+typedef struct vertex_batch {
+  renderer *state;
+  const vertex *in;
+
+  /* The n vertices to process are in[indices[i]]. */
+  const uint32_t *indices;
+  size_t n;
+} vertex_batch;
 
 static int min(int a, int b);
 static int max(int a, int b);
 
-static uint8_t clamp(float v);
-
-static int allocate_buffer(renderer *state, size_t n);
-static processed_vertex process_vertex(renderer *state, vertex v);
-
-static void emit_triangle(renderer *state,
-                          processed_vertex a, processed_vertex b,
-                          processed_vertex c);
-
-static bool cull(renderer *state,
-                 processed_vertex a,
-                 processed_vertex b,
-                 processed_vertex c);
+static void *reserve(void *buffer, size_t *capacity, size_t n, size_t size);
+
+static int prepare_vertices(renderer *state, vertex_array *array,
+                            const uint32_t *indices, size_t i, size_t n);
+static void process_batch(renderer *state, vertex_batch *batch);
+static void process_chunk(void *data, size_t i);
+static void process_vertices(renderer *state, const vertex *in,
+                             size_t first, size_t n);
+
+static int begin_triangles(renderer *state);
+static int submit_triangle(renderer *state, uint32_t a, uint32_t b,
+                           uint32_t c);
+static int end_triangles(renderer *state);
+
+static unsigned clip_code(renderer *state, vector4 pos);
+static int clip_triangle(renderer *state, uint32_t a, uint32_t b, uint32_t c);
+static size_t clip_polygon(processed_vertex *out, const processed_vertex *in,
+                           size_t n, int plane, vector2 guard);
+static float plane_distance(vector4 pos, int plane, vector2 guard);
+static processed_vertex clip_lerp(processed_vertex a, processed_vertex b,
+                                  float t);
+static void project_vertex(vertex_streams *s, size_t i);
+
+static const vertex_streams *vertex_source(renderer *state, uint32_t *i);
+static int output_triangle(renderer *state, uint32_t a, uint32_t b,
+                           uint32_t c);
+
+static int bin_triangle(renderer *state, uint32_t a, uint32_t b, uint32_t c,
+                        uint32_t id);
+static screen_rect tile_rect(renderer *state, size_t i);
+static void draw_tile(void *data, size_t i);
+
+static int record_draw(renderer *state);
+static int defer_triangle(renderer *state, uint32_t a, uint32_t b, uint32_t c,
+                          uint32_t *id);
+static void resolve_tile(void *data, size_t i);
+static void resolve_rect(renderer *state, screen_rect rect);
+
+static bool setup_triangle(renderer *state, uint32_t a, uint32_t b, uint32_t c,
+                           triangle_setup *tri);
+static void setup_planes(triangle_setup *tri, const vertex_streams *src[3],
+                         const uint32_t i[3]);
+static plane make_plane(const vector3 basis[3], vector3 inv_w,
+                        float a, float b, float c);
+static void emit_triangle(renderer *state, screen_rect rect,
+                          const triangle_setup *tri, uint32_t id);
+
+static edge make_edge(screen_pos p, screen_pos q);
+static int64_t edge_at(edge e, int x, int y);
+static bool block_outside(edge e, int x, int y);
+static bool block_hidden(renderer *state, size_t block, size_t tile,
+                         bool cleared, float z_min, float z_max);
+
+static bool cull(renderer *state, vector3 a, vector3 b, vector3 c);
 
 static screen_pos ndc_to_screen(renderer *state, vector3 pos);
+static screen_rect triangle_bounds(screen_pos p0, screen_pos p1,
+                                   screen_pos p2);
 
-static processed_vertex interpolate(processed_vertex a, processed_vertex b,
-                                    processed_vertex c,
-                                    vector3 coord);
-static vector3 interpolate_vector3(vector3 a, vector3 b, vector3 c,
-                                   float wfactor, vector3 coord);
-static vector2 interpolate_vector2(vector2 a, vector2 b, vector2 c,
-                                   float wfactor, vector3 coord);
-static color interpolate_color(color a, color b, color c,
-                               float wfactor, vector3 coord);
-
-static void draw_fragment(renderer *state, processed_vertex v,
-                          screen_pos p);
-static bool depth_check(renderer *state, processed_vertex v,
-                        screen_pos p);
+static shading_state current_shading(const renderer *state);
 
 int draw_array(renderer *state, draw_mode mode,
                vertex_array *array, size_t i, size_t n) {
-  if (allocate_buffer(state, n) < 0) return -1;
-
-  for (size_t offset = 0; offset < n; offset++)
-    state->vertices[i] = process_vertex(state, array->data[offset+i]);
+  if (prepare_vertices(state, array, NULL, i, n) < 0) return -1;
+  if (begin_triangles(state) < 0) return -1;
 
   switch (mode) {
   case DrawTriangles:
     if (n < 3) return 0;
 
-    for (size_t i = 0; i < n-2; i += 3) {
-      emit_triangle(state, state->vertices[i], state->vertices[i+1],
-                    state->vertices[i+2]);
+    for (size_t offset = i; offset < i+n-2; offset += 3) {
+      if (submit_triangle(state, offset, offset+1, offset+2) < 0)
+        return -1;
     }
     break;
   case DrawTriangleStrip:
     if (n < 3) return 0;
 
-    emit_triangle(state, state->vertices[0], state->vertices[1],
-                  state->vertices[2]);
+    if (submit_triangle(state, i, i+1, i+2) < 0) return -1;
 
-    for (size_t i = 3; i < n; i++) {
-      emit_triangle(state, state->vertices[i-1], state->vertices[i-2],
-                    state->vertices[i]);
+    for (size_t offset = i+3; offset < i+n; offset++) {
+      if (submit_triangle(state, offset-1, offset-2, offset) < 0)
+        return -1;
     }
     break;
   case DrawTriangleFan: {
     if (n < 3) return 0;
 
-    processed_vertex first = state->vertices[0];
-    for (size_t i = 2; i < n; i++)
-      emit_triangle(state, first, state->vertices[i-1], state->vertices[i]);
-
+    for (size_t offset = i+2; offset < i+n; offset++) {
+      if (submit_triangle(state, i, offset-1, offset) < 0)
+        return -1;
+    }
     break;
   }
   }
 
-  return 0;
+  return end_triangles(state);
 }
 
 int draw_elements(renderer *state, draw_mode mode,
                   index_array *indices, vertex_array *array,
                   size_t i, size_t n) {
-  if (allocate_buffer(state, array->n) < 0) return -1;
-
-  for (size_t i = 0; i < array->n; i++)
-    state->vertices[i].done = false;
+  if (prepare_vertices(state, array, indices->data, i, n) < 0) return -1;
+  if (begin_triangles(state) < 0) return -1;
 
-  for (size_t offset = 0; offset < n; offset++) {
-    uint32_t vertex_i = indices->data[offset + i];
-    if (!state->vertices[vertex_i].done)
-      state->vertices[vertex_i] = process_vertex(state, array->data[vertex_i]);
-  }
+  const uint32_t *index = indices->data + i;
 
   switch (mode) {
   case DrawTriangles:
     if (n < 3) return 0;
 
-    for (size_t i = 0; i < n-2; i += 3) {
-      emit_triangle(state,
-                    state->vertices[indices->data[i]],
-                    state->vertices[indices->data[i+1]],
-                    state->vertices[indices->data[i+2]]);
+    for (size_t offset = 0; offset < n-2; offset += 3) {
+      if (submit_triangle(state, index[offset], index[offset+1],
+                          index[offset+2]) < 0)
+        return -1;
     }
     break;
   case DrawTriangleStrip:
     if (n < 3) return 0;
 
-    emit_triangle(state,
-                  state->vertices[indices->data[i]],
-                  state->vertices[indices->data[i+1]],
-                  state->vertices[indices->data[i+2]]);
+    if (submit_triangle(state, index[0], index[1], index[2]) < 0)
+      return -1;
 
     for (size_t offset = 3; offset < n; offset++) {
-      emit_triangle(state,
-                    state->vertices[indices->data[i+offset-1]],
-                    state->vertices[indices->data[i+offset-2]],
-                    state->vertices[indices->data[i+offset]]);
+      if (submit_triangle(state, index[offset-1], index[offset-2],
+                          index[offset]) < 0)
+        return -1;
     }
     break;
   case DrawTriangleFan: {
     if (n < 3) return 0;
 
-    processed_vertex first = state->vertices[indices->data[i]];
-    for (size_t offset = 2; offset < n; offset++)
-      emit_triangle(state, first,
-                    state->vertices[indices->data[i+offset-1]],
-                    state->vertices[indices->data[i+offset]]);
-
+    for (size_t offset = 2; offset < n; offset++) {
+      if (submit_triangle(state, index[0], index[offset-1],
+                          index[offset]) < 0)
+        return -1;
+    }
     break;
   }
   }
 
+  return end_triangles(state);
+}
+
+/*
+ * Makes sure the vertices used by a draw have been processed: either
+ * indices[i..i+n), or the range [i, i+n) itself when indices is NULL.
+ *
+ * Processed vertices are stamped with the current epoch, which only changes
+ * when a different vertex array or different transforms are used. Vertices
+ * shared with earlier draws, or with earlier frames, are therefore not
+ * processed again, and the cost of a draw does not depend on the size of the
+ * vertex array.
+ */
+static int prepare_vertices(renderer *state, vertex_array *array,
+                            const uint32_t *indices, size_t i, size_t n) {
+  vertex_streams *vertices = &state->vertices;
+  if (vertex_streams_reserve(vertices, array->n) < 0) return -1;
+
+  uint32_t *pending = reserve(state->pending_vertices,
+                              &state->pending_capacity, n, sizeof(*pending));
+  if (!pending) return -1;
+  state->pending_vertices = pending;
+
+  if (state->vertices_array_version != array->version ||
+      state->vertices_transform_version != state->transform_version) {
+    vertex_streams_invalidate(vertices);
+    state->vertices_array_version = array->version;
+    state->vertices_transform_version = state->transform_version;
+
+    state->vertices_model_view = state->model_view;
+    state->vertices_projection = state->projection;
+  }
+
+  size_t pending_count = 0;
+  for (size_t offset = i; offset < i + n; offset++) {
+    uint32_t vertex_i = indices ? indices[offset] : offset;
+    if (vertices->epochs[vertex_i] != vertices->epoch) {
+      vertices->epochs[vertex_i] = vertices->epoch;
+      pending[pending_count++] = vertex_i;
+    }
+  }
+
+  process_batch(state, &(vertex_batch){state, array->data, pending,
+                                       pending_count});
   return 0;
 }
 
-static int allocate_buffer(renderer *state, size_t n) {
-  if (state->vertex_count >= n) return 0;
+static void process_batch(renderer *state, vertex_batch *batch) {
+  size_t chunks = (batch->n + VertexChunkSize - 1) / VertexChunkSize;
+
+  if (state->pool && chunks > 1)
+    thread_pool_run(state->pool, chunks, process_chunk, batch);
+  else {
+    for (size_t i = 0; i < chunks; i++)
+      process_chunk(batch, i);
+  }
+}
+
+static void process_chunk(void *data, size_t i) {
+  const vertex_batch *batch = data;
+  const uint32_t *indices = batch->indices;
+
+  size_t first = i * VertexChunkSize;
+  size_t end = first + VertexChunkSize;
+  if (end > batch->n) end = batch->n;
+
+  /* Runs of consecutive indices are processed together. */
+  while (first < end) {
+    size_t last = first + 1;
+    while (last < end && indices[last] == indices[last-1] + 1) last++;
+
+    process_vertices(batch->state, batch->in + indices[first], indices[first],
+                     last - first);
+    first = last;
+  }
+}
+
+/* Processes n vertices from in, into the streams starting at first. */
+static void process_vertices(renderer *state, const vertex *in,
+                             size_t first, size_t n) {
+  vertex_streams *out = &state->vertices;
+
+  /* eye holds the position in eye space until it has been projected. */
+  vector3 *eye = out->eye + first;
+  mat4_apply_n(state->model_view, &in->pos, sizeof(*in), eye, n);
+  mat4_project_n(state->projection, eye, sizeof(*eye), out->clip_pos + first,
+                 n);
+
+  vector3 *normal = out->normal + first;
+  mat3_apply_n(state->normal_matrix, &in->normal, sizeof(*in), normal, n);
+  vector3_normalize_n(normal, sizeof(*normal), normal, n);
+
+  for (size_t i = 0; i < n; i++) {
+    size_t j = first + i;
 
-  processed_vertex *buffer = malloc(sizeof(*buffer) * n);
-  if (!buffer)
+    out->eye[j] = vector3_scale(-1, out->eye[j]);
+
+    out->tex_coord[j] = in[i].tex_coord;
+    out->base_color[j] = in[i].col;
+
+    out->clip_code[j] = clip_code(state, out->clip_pos[j]);
+    project_vertex(out, j);
+  }
+}
+
+static int begin_triangles(renderer *state) {
+  state->clip_vertex_count = 0;
+  state->pipeline = select_fragment_pipeline(state);
+
+  if (state->deferred && record_draw(state) < 0) return -1;
+
+  if (!state->pool) return 0;
+
+  if (!state->bins) {
+    state->bins = malloc(sizeof(*state->bins));
+    if (!state->bins) return -1;
+    make_tile_bins(state->bins);
+  }
+
+  /* Also drops the triangles of a draw that failed before reaching its tiles. */
+  return tile_bins_reset(state->bins,
+                         state->target->tiles_x * state->target->tiles_y);
+}
+
+static int submit_triangle(renderer *state, uint32_t a, uint32_t b,
+                           uint32_t c) {
+  const unsigned *codes = state->vertices.clip_code;
+
+  unsigned all = codes[a] & codes[b] & codes[c];
+  unsigned any = codes[a] | codes[b] | codes[c];
+
+  if ((all & RejectPlanes) || (any & ClipInvalid)) return 0;
+
+  if (any & ClipPlanes)
+    return clip_triangle(state, a, b, c);
+  else
+    return output_triangle(state, a, b, c);
+}
+
+static unsigned clip_code(renderer *state, vector4 pos) {
+  /* Infinities and NaNs propagate through the sum. */
+  if (!isfinite(pos.x + pos.y + pos.z + pos.w)) return ClipInvalid;
+
+  float guard_x = (1 + 2.0f * GuardBand / state->target->w) * pos.w;
+  float guard_y = (1 + 2.0f * GuardBand / state->target->h) * pos.w;
+
+  unsigned code = 0;
+
+  if (pos.z < -pos.w) code |= ClipNear;
+  if (pos.z > +pos.w) code |= ClipFar;
+
+  if (pos.x < -guard_x) code |= ClipGuardLeft;
+  if (pos.x > +guard_x) code |= ClipGuardRight;
+  if (pos.y < -guard_y) code |= ClipGuardBottom;
+  if (pos.y > +guard_y) code |= ClipGuardTop;
+
+  if (pos.x < -pos.w) code |= OutsideLeft;
+  if (pos.x > +pos.w) code |= OutsideRight;
+  if (pos.y < -pos.w) code |= OutsideBottom;
+  if (pos.y > +pos.w) code |= OutsideTop;
+
+  return code;
+}
+
+/*
+ * Sutherland-Hodgman clipping against every plane crossed by the triangle.
+ * The resulting convex polygon is stored in clip_vertices and drawn as a fan.
+ */
+static int clip_triangle(renderer *state, uint32_t a, uint32_t b,
+                         uint32_t c) {
+  if (vertex_streams_reserve(&state->clip_vertices,
+                             state->clip_vertex_count + MaxClipVertices) < 0)
     return -1;
 
-  free(state->vertices);
-  state->vertices = buffer;
-  state->vertex_count = n;
+  /* Single-threaded draws emit the triangle right away. */
+  if (!state->pool) state->clip_vertex_count = 0;
+
+  const vertex_streams *vertices = &state->vertices;
+  unsigned any = vertices->clip_code[a] | vertices->clip_code[b] |
+                 vertices->clip_code[c];
+
+  vector2 guard = {
+    1 + 2.0f * GuardBand / state->target->w,
+    1 + 2.0f * GuardBand / state->target->h,
+  };
+
+  processed_vertex polygon[2][MaxClipVertices];
+  size_t n = 3;
+  int current = 0;
+
+  polygon[0][0] = load_vertex(vertices, a);
+  polygon[0][1] = load_vertex(vertices, b);
+  polygon[0][2] = load_vertex(vertices, c);
+
+  for (int plane = 0; plane < ClipPlaneCount && n >= 3; plane++) {
+    if (!(any & (1 << plane))) continue;
+
+    n = clip_polygon(polygon[!current], polygon[current], n, plane, guard);
+    current = !current;
+  }
+
+  if (n < 3) return 0;
+
+  uint32_t first = state->clip_vertex_count;
+  for (size_t i = 0; i < n; i++) {
+    store_vertex(&state->clip_vertices, first + i, polygon[current][i]);
+    project_vertex(&state->clip_vertices, first + i);
+  }
+  state->clip_vertex_count += n;
+
+  for (size_t i = 2; i < n; i++) {
+    if (output_triangle(state, ClippedVertex | first,
+                        ClippedVertex | (first + i - 1),
+                        ClippedVertex | (first + i)) < 0)
+      return -1;
+  }
 
   return 0;
 }
 
-static processed_vertex process_vertex(renderer *state, vertex v) {
-  vector3 pos_to_eye = mat4_apply(state->model_view, v.pos);
+static size_t clip_polygon(processed_vertex *out, const processed_vertex *in,
+                           size_t n, int plane, vector2 guard) {
+  size_t out_n = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    const processed_vertex *a = &in[i];
+    const processed_vertex *b = &in[(i + 1) % n];
+
+    float da = plane_distance(a->clip_pos, plane, guard);
+    float db = plane_distance(b->clip_pos, plane, guard);
+
+    if (da >= 0) out[out_n++] = *a;
+
+    /*
+     * Always interpolate from the inside vertex, so that an edge shared by two
+     * triangles is cut at exactly the same point in both.
+     */
+    if (da >= 0 && db < 0)
+      out[out_n++] = clip_lerp(*a, *b, da / (da - db));
+    else if (da < 0 && db >= 0)
+      out[out_n++] = clip_lerp(*b, *a, db / (db - da));
+  }
+
+  return out_n;
+}
+
+/* Positive on the inside of the plane. */
+static float plane_distance(vector4 pos, int plane, vector2 guard) {
+  switch (1 << plane) {
+  case ClipNear:        return pos.z + pos.w;
+  case ClipFar:         return pos.w - pos.z;
+  case ClipGuardLeft:   return guard.x * pos.w + pos.x;
+  case ClipGuardRight:  return guard.x * pos.w - pos.x;
+  case ClipGuardBottom: return guard.y * pos.w + pos.y;
+  case ClipGuardTop:    return guard.y * pos.w - pos.y;
+  }
+
+  return 0;
+}
 
+static processed_vertex clip_lerp(processed_vertex a, processed_vertex b,
+                                  float t) {
   processed_vertex out;
-  out.done = true;
 
-  out.eye = vector3_scale(-1, pos_to_eye);
-  out.normal = vector3_normalize(mat3_apply(state->normal_matrix, v.normal));
+  out.eye = vector3_add(a.eye, vector3_scale(t, vector3_sub(b.eye, a.eye)));
+  out.normal = vector3_add(a.normal,
+                           vector3_scale(t, vector3_sub(b.normal, a.normal)));
 
-  out.tex_coord = v.tex_coord;
-  out.base_color = v.col;
+  out.tex_coord = (vector2){
+    a.tex_coord.x + t * (b.tex_coord.x - a.tex_coord.x),
+    a.tex_coord.y + t * (b.tex_coord.y - a.tex_coord.y),
+  };
 
-  vector4 projected = mat4_project(state->projection, pos_to_eye);
-  out.frag_pos = (vector3){projected.x/projected.w, projected.y/projected.w,
-                           projected.z/projected.w};
-  out.w = projected.w;
+  out.base_color = (color){
+    a.base_color.r + t * (b.base_color.r - a.base_color.r) + 0.5f,
+    a.base_color.g + t * (b.base_color.g - a.base_color.g) + 0.5f,
+    a.base_color.b + t * (b.base_color.b - a.base_color.b) + 0.5f,
+    a.base_color.a + t * (b.base_color.a - a.base_color.a) + 0.5f,
+  };
+
+  out.clip_pos = (vector4){
+    a.clip_pos.x + t * (b.clip_pos.x - a.clip_pos.x),
+    a.clip_pos.y + t * (b.clip_pos.y - a.clip_pos.y),
+    a.clip_pos.z + t * (b.clip_pos.z - a.clip_pos.z),
+    a.clip_pos.w + t * (b.clip_pos.w - a.clip_pos.w),
+  };
+  out.clip_code = 0;
 
   return out;
 }
 
-static void emit_triangle(renderer *state,
-                          processed_vertex a, processed_vertex b,
-                          processed_vertex c) {
-  if (!cull(state, a, b, c)) {
-    screen_pos p0 = ndc_to_screen(state, a.frag_pos);
-    screen_pos p1 = ndc_to_screen(state, b.frag_pos);
-    screen_pos p2 = ndc_to_screen(state, c.frag_pos);
-
-    if (p0.y > p1.y) {
-      screen_pos t;
-      t = p0;
-      p0 = p1;
-      p1 = t;
-
-      processed_vertex t_v;
-      t_v = a;
-      a = b;
-      b = t_v;
+static void project_vertex(vertex_streams *s, size_t i) {
+  vector4 pos = s->clip_pos[i];
+
+  s->frag_pos[i] = (vector3){pos.x / pos.w, pos.y / pos.w, pos.z / pos.w};
+  s->inv_w[i] = 1 / pos.w;
+}
+
+/* Streams holding vertex i, whose index within them is stored back in i. */
+static const vertex_streams *vertex_source(renderer *state, uint32_t *i) {
+  if (*i & ClippedVertex) {
+    *i &= ~ClippedVertex;
+    return &state->clip_vertices;
+  }
+  else
+    return &state->vertices;
+}
+
+static int output_triangle(renderer *state, uint32_t a, uint32_t b,
+                           uint32_t c) {
+  uint32_t ia = a, ib = b, ic = c;
+  const vertex_streams *sa = vertex_source(state, &ia);
+  const vertex_streams *sb = vertex_source(state, &ib);
+  const vertex_streams *sc = vertex_source(state, &ic);
+
+  if (cull(state, sa->frag_pos[ia], sb->frag_pos[ib], sc->frag_pos[ic]))
+    return 0;
+
+  /* Deferred triangles are set up once, when they are recorded. */
+  uint32_t id = 0;
+  if (state->deferred) {
+    if (defer_triangle(state, a, b, c, &id) < 0) return -1;
+    if (id == 0) return 0;
+  }
+
+  if (!state->pool) {
+    screen_rect rect = {0, 0, state->target->w, state->target->h};
+    triangle_setup tri;
+
+    if (id != 0)
+      emit_triangle(state, rect, &state->deferred->triangles[id-1].setup, id);
+    else if (setup_triangle(state, a, b, c, &tri))
+      emit_triangle(state, rect, &tri, 0);
+
+    return 0;
+  }
+  else
+    return bin_triangle(state, a, b, c, id);
+}
+
+static int end_triangles(renderer *state) {
+  if (!state->pool || state->bins->triangle_count == 0) return 0;
+
+  thread_pool_run(state->pool, state->target->tiles_x * state->target->tiles_y,
+                  draw_tile, state);
+
+  return 0;
+}
+
+static int bin_triangle(renderer *state, uint32_t a, uint32_t b, uint32_t c,
+                        uint32_t id) {
+  tile_bins *bins = state->bins;
+
+  binned_triangle *triangles = reserve(
+    bins->triangles, &bins->triangle_capacity,
+    bins->triangle_count + 1, sizeof(*triangles));
+  if (!triangles) return -1;
+  bins->triangles = triangles;
+
+  uint32_t triangle_i = bins->triangle_count++;
+  bins->triangles[triangle_i] = (binned_triangle){{a, b, c}, id};
+
+  const vertex_streams *sa = vertex_source(state, &a);
+  const vertex_streams *sb = vertex_source(state, &b);
+  const vertex_streams *sc = vertex_source(state, &c);
+
+  screen_pos p0 = ndc_to_screen(state, sa->frag_pos[a]);
+  screen_pos p1 = ndc_to_screen(state, sb->frag_pos[b]);
+  screen_pos p2 = ndc_to_screen(state, sc->frag_pos[c]);
+
+  screen_rect bounds = triangle_bounds(p0, p1, p2);
+
+  int x0 = max(0, bounds.x0);
+  int y0 = max(0, bounds.y0);
+  int x1 = min(state->target->w-1, bounds.x1-1);
+  int y1 = min(state->target->h-1, bounds.y1-1);
+
+  for (int ty = y0 / TileSize; ty <= y1 / TileSize && y0 <= y1; ty++) {
+    for (int tx = x0 / TileSize; tx <= x1 / TileSize && x0 <= x1; tx++) {
+      tile_bin *bin = &bins->bins[tx + ty*state->target->tiles_x];
+
+      uint32_t *triangles = reserve(bin->triangles, &bin->capacity,
+                                    bin->count + 1, sizeof(*triangles));
+      if (!triangles) return -1;
+      bin->triangles = triangles;
+
+      bin->triangles[bin->count++] = triangle_i;
     }
+  }
+
+  return 0;
+}
+
+static screen_rect tile_rect(renderer *state, size_t i) {
+  int tx = i % state->target->tiles_x;
+  int ty = i / state->target->tiles_x;
+
+  return (screen_rect){
+    tx * TileSize, ty * TileSize,
+    min((tx + 1) * TileSize, state->target->w),
+    min((ty + 1) * TileSize, state->target->h),
+  };
+}
+
+static void draw_tile(void *data, size_t i) {
+  renderer *state = data;
+  const tile_bin *bin = &state->bins->bins[i];
+
+  screen_rect rect = tile_rect(state, i);
 
-    if (p1.y > p2.y) {
-      screen_pos t;
-      t = p1;
-      p1 = p2;
-      p2 = t;
+  for (size_t j = 0; j < bin->count; j++) {
+    const binned_triangle *binned =
+      &state->bins->triangles[bin->triangles[j]];
+    triangle_setup tri;
 
-      processed_vertex t_v;
-      t_v = b;
-      b = c;
-      c = t_v;
+    if (binned->id != 0) {
+      emit_triangle(state, rect,
+                    &state->deferred->triangles[binned->id-1].setup,
+                    binned->id);
     }
+    else if (setup_triangle(state, binned->v[0], binned->v[1], binned->v[2],
+                            &tri))
+      emit_triangle(state, rect, &tri, 0);
+  }
+}
 
-    if (p0.y > p1.y) {
-      screen_pos t;
-      t = p0;
-      p0 = p1;
-      p1 = t;
+int set_deferred_shading(renderer *state, bool on) {
+  deferred_frame *frame = state->deferred;
 
-      processed_vertex t_v;
-      t_v = a;
-      a = b;
-      b = t_v;
+  if (!on) {
+    if (frame) {
+      free(frame->visibility);
+      free(frame->draws);
+      free(frame->lights);
+      free(frame->triangles);
+      free(frame);
     }
 
-    if (p0.y == p2.y) return;
+    state->deferred = NULL;
+    return 0;
+  }
+
+  if (frame) return 0;
 
-    float det = (p0.x - p2.x)*(p1.y - p2.y) - (p0.y - p2.y)*(p1.x - p2.x);
+  frame = malloc(sizeof(*frame));
+  if (!frame) return -1;
 
-    int y;
-    float dxdy_02 = (float)(p0.x - p2.x) / (p0.y - p2.y);
+  frame->w = state->target->w;
+  frame->h = state->target->h;
 
-    if (p0.y != p1.y) {
-      float dxdy_01 = (float)(p0.x - p1.x) / (p0.y - p1.y);
-      for (y = max(0, p0.y); y <= min(p1.y, state->target->h-1); y++) {
-        int dy = y - p0.y;
+  frame->visibility = calloc(frame->w * frame->h, sizeof(*frame->visibility));
+  if (!frame->visibility) {
+    free(frame);
+    return -1;
+  }
 
-        int x0 = p0.x + dxdy_01 * dy;
-        int x1 = p0.x + dxdy_02 * dy;
+  frame->draw_count = frame->draw_capacity = 0;
+  frame->draws = NULL;
 
-        if (x0 > x1) {
-          int t;
-          t = x0;
-          x0 = x1;
-          x1 = t;
-        }
+  frame->light_count = frame->light_capacity = 0;
+  frame->lights = NULL;
 
-        for (int x = max(0, x0); x <= min(x1, state->target->w-1); x++) {
-          float s = ((p1.y - p2.y)*(x - p2.x) + (p2.x - p1.x)*(y - p2.y)) / det;
-          float t = ((p2.y - p0.y)*(x - p2.x) + (p0.x - p2.x)*(y - p2.y)) / det;
-          float u = 1 - s - t;
+  frame->triangle_count = frame->triangle_capacity = 0;
+  frame->triangles = NULL;
 
-          processed_vertex v = interpolate(a, b, c, (vector3){s, t, u});
-          draw_fragment(state, v, (screen_pos){x, y});
-        }
-      }
-    }
+  state->deferred = frame;
+  return 0;
+}
 
-    if (p1.y != p2.y) {
-      float dxdy_12 = (float)(p1.x - p2.x) / (p1.y - p2.y);
-      for (y = max(0, p1.y); y <= min(p2.y, state->target->h-1); y++) {
-        int x0 = p1.x + dxdy_12 * (y - p1.y);
-        int x1 = p0.x + dxdy_02 * (y - p0.y);
-
-        if (x0 > x1) {
-          int t;
-          t = x0;
-          x0 = x1;
-          x1 = t;
-        }
-
-        for (int x = max(0, x0); x <= min(x1, state->target->w-1); x++) {
-          float s = ((p1.y - p2.y)*(x - p2.x) + (p2.x - p1.x)*(y - p2.y)) / det;
-          float t = ((p2.y - p0.y)*(x - p2.x) + (p0.x - p2.x)*(y - p2.y)) / det;
-          float u = 1 - s - t;
-
-          processed_vertex v = interpolate(a, b, c, (vector3){s, t, u});
-          draw_fragment(state, v, (screen_pos){x, y});
-        }
-      }
-    }
+bool get_deferred_shading(const renderer *state) {
+  return state->deferred != NULL;
+}
+
+int resolve_deferred(renderer *state) {
+  deferred_frame *frame = state->deferred;
+  if (!frame || frame->triangle_count == 0) return 0;
+
+  if (state->pool) {
+    thread_pool_run(state->pool,
+                    state->target->tiles_x * state->target->tiles_y,
+                    resolve_tile, state);
   }
+  else
+    resolve_rect(state, (screen_rect){0, 0, frame->w, frame->h});
+
+  frame->draw_count = 0;
+  frame->light_count = 0;
+  frame->triangle_count = 0;
+
+  return 0;
 }
 
-static bool cull(renderer *state,
-                 processed_vertex a,
-                 processed_vertex b,
-                 processed_vertex c) {
-  if (!state->culling) return false;
+void discard_deferred(renderer *state) {
+  deferred_frame *frame = state->deferred;
+  if (!frame || frame->triangle_count == 0) return;
 
-  float det =
-      a.frag_pos.x*b.frag_pos.y - a.frag_pos.y*b.frag_pos.x
-    + b.frag_pos.x*c.frag_pos.y - b.frag_pos.y*c.frag_pos.x
-    + c.frag_pos.x*a.frag_pos.y - c.frag_pos.y*a.frag_pos.x;
+  memset(frame->visibility, 0,
+         sizeof(*frame->visibility) * frame->w * frame->h);
 
-  return det > 0;
+  frame->draw_count = 0;
+  frame->light_count = 0;
+  frame->triangle_count = 0;
 }
 
-static screen_pos ndc_to_screen(renderer *state, vector3 pos) {
-  return (screen_pos){
-    (+pos.x + 1) * state->target->w / 2,
-    (+pos.y + 1) * state->target->h / 2
-  };
+static int record_draw(renderer *state) {
+  deferred_frame *frame = state->deferred;
+
+  deferred_draw *draws = reserve(frame->draws, &frame->draw_capacity,
+                                 frame->draw_count + 1, sizeof(*draws));
+  if (!draws) return -1;
+  frame->draws = draws;
+
+  if (state->lighting && state->light_count != 0) {
+    light *lights = reserve(frame->lights, &frame->light_capacity,
+                            frame->light_count + state->light_count,
+                            sizeof(*lights));
+    if (!lights) return -1;
+    frame->lights = lights;
+  }
+
+  deferred_draw *draw = &frame->draws[frame->draw_count++];
+  draw->pipeline = state->pipeline;
+  draw->shading = current_shading(state);
+  draw->first_light = frame->light_count;
+
+  if (state->lighting) {
+    for (size_t i = 0; i < state->light_count; i++)
+      frame->lights[frame->light_count++] = state->processed_lights[i];
+  }
+
+  return 0;
 }
 
-static processed_vertex interpolate(processed_vertex a, processed_vertex b,
-                                    processed_vertex c,
-                                    vector3 coord) {
-  processed_vertex out;
+/* Sets *id to 0 if the triangle does not cover any pixel. */
+static int defer_triangle(renderer *state, uint32_t a, uint32_t b, uint32_t c,
+                          uint32_t *id) {
+  deferred_frame *frame = state->deferred;
 
-  out.frag_pos = interpolate_vector3(a.frag_pos, b.frag_pos, c.frag_pos,
-                                     1.0, coord);
+  deferred_triangle *triangles = reserve(
+    frame->triangles, &frame->triangle_capacity,
+    frame->triangle_count + 1, sizeof(*triangles));
+  if (!triangles) return -1;
+  frame->triangles = triangles;
 
-  float wfactor = coord.x/a.w + coord.y/b.w + coord.z/c.w;
-  coord.x /= a.w;
-  coord.y /= b.w;
-  coord.z /= c.w;
+  deferred_triangle *tri = &frame->triangles[frame->triangle_count];
+  tri->draw = frame->draw_count - 1;
 
-  out.eye = interpolate_vector3(a.eye, b.eye, c.eye, wfactor, coord);
-  out.normal = interpolate_vector3(a.normal, b.normal, c.normal, wfactor,
-                                   coord);
+  if (setup_triangle(state, a, b, c, &tri->setup))
+    *id = ++frame->triangle_count;
+  else
+    *id = 0;
 
-  out.tex_coord = interpolate_vector2(a.tex_coord, b.tex_coord, c.tex_coord,
-                                      wfactor, coord);
-  out.base_color = interpolate_color(a.base_color, b.base_color, c.base_color,
-                                     wfactor, coord);
+  return 0;
+}
 
-  return out;
+static void resolve_tile(void *data, size_t i) {
+  renderer *state = data;
+  resolve_rect(state, tile_rect(state, i));
+}
+
+static void resolve_rect(renderer *state, screen_rect rect) {
+  deferred_frame *frame = state->deferred;
+
+  for (int y = rect.y0; y < rect.y1; y++) {
+    for (int x = rect.x0; x < rect.x1; x++) {
+      uint32_t id = frame->visibility[x + y*frame->w];
+      if (id == 0) continue;
+
+      frame->visibility[x + y*frame->w] = 0;
+
+      const deferred_triangle *tri = &frame->triangles[id-1];
+      const triangle_setup *setup = &tri->setup;
+      const deferred_draw *draw = &frame->draws[tri->draw];
+
+      shading_state shading = draw->shading;
+      shading.lights = frame->lights + draw->first_light;
+
+      draw->pipeline->shade(&shading, state->target, setup, x, y);
+    }
+  }
 }
 
-static vector3 interpolate_vector3(vector3 a, vector3 b, vector3 c,
-                                   float wfactor, vector3 coord) {
-  return (vector3){
-    (coord.x*a.x + coord.y*b.x + coord.z*c.x)/wfactor,
-    (coord.x*a.y + coord.y*b.y + coord.z*c.y)/wfactor,
-    (coord.x*a.z + coord.y*b.z + coord.z*c.z)/wfactor,
+/* Returns false if the triangle does not cover any pixel. */
+static bool setup_triangle(renderer *state, uint32_t a, uint32_t b, uint32_t c,
+                           triangle_setup *tri) {
+  const vertex_streams *src[3] = {
+    vertex_source(state, &a), vertex_source(state, &b),
+    vertex_source(state, &c),
   };
+  uint32_t i[3] = {a, b, c};
+
+  screen_pos p0 = ndc_to_screen(state, src[0]->frag_pos[a]);
+  screen_pos p1 = ndc_to_screen(state, src[1]->frag_pos[b]);
+  screen_pos p2 = ndc_to_screen(state, src[2]->frag_pos[c]);
+
+  int64_t area = (int64_t)(p1.x - p0.x)*(p2.y - p0.y) -
+                 (int64_t)(p1.y - p0.y)*(p2.x - p0.x);
+  if (area == 0) return false;
+
+  if (area < 0) {
+    screen_pos t;
+    t = p1;
+    p1 = p2;
+    p2 = t;
+
+    const vertex_streams *t_src;
+    t_src = src[1];
+    src[1] = src[2];
+    src[2] = t_src;
+
+    uint32_t t_i;
+    t_i = i[1];
+    i[1] = i[2];
+    i[2] = t_i;
+
+    area = -area;
+  }
+
+  for (int k = 0; k < 3; k++)
+    tri->z[k] = src[k]->frag_pos[i[k]].z;
+
+  tri->bounds = triangle_bounds(p0, p1, p2);
+
+  tri->e[0] = make_edge(p1, p2);
+  tri->e[1] = make_edge(p2, p0);
+  tri->e[2] = make_edge(p0, p1);
+
+  tri->inv_area = 1.0f / area;
+
+  setup_planes(tri, src, i);
+
+  return true;
 }
 
-static vector2 interpolate_vector2(vector2 a, vector2 b, vector2 c,
-                                   float wfactor, vector3 coord) {
-  return (vector2){
-    (coord.x*a.x + coord.y*b.x + coord.z*c.x)/wfactor,
-    (coord.x*a.y + coord.y*b.y + coord.z*c.y)/wfactor,
+static void setup_planes(triangle_setup *tri, const vertex_streams *src[3],
+                         const uint32_t i[3]) {
+  const edge *e = tri->e;
+  int x = tri->bounds.x0, y = tri->bounds.y0;
+
+  /* Barycentric weights at the origin of the planes, and their derivatives. */
+  vector3 basis[3] = {
+    {(edge_at(e[0], x, y) + e[0].bias) * tri->inv_area,
+     (edge_at(e[1], x, y) + e[1].bias) * tri->inv_area,
+     (edge_at(e[2], x, y) + e[2].bias) * tri->inv_area},
+    {e[0].a * tri->inv_area, e[1].a * tri->inv_area, e[2].a * tri->inv_area},
+    {e[0].b * tri->inv_area, e[1].b * tri->inv_area, e[2].b * tri->inv_area},
+  };
+
+  vector3 inv_w = {
+    src[0]->inv_w[i[0]], src[1]->inv_w[i[1]], src[2]->inv_w[i[2]],
   };
+
+  tri->inv_w = make_plane(basis, inv_w, 1, 1, 1);
+
+  vector3 eye[3], normal[3];
+  vector2 tex_coord[3];
+  color base_color[3];
+
+  for (int k = 0; k < 3; k++) {
+    eye[k] = src[k]->eye[i[k]];
+    normal[k] = src[k]->normal[i[k]];
+    tex_coord[k] = src[k]->tex_coord[i[k]];
+    base_color[k] = src[k]->base_color[i[k]];
+  }
+
+  tri->eye[0] = make_plane(basis, inv_w, eye[0].x, eye[1].x, eye[2].x);
+  tri->eye[1] = make_plane(basis, inv_w, eye[0].y, eye[1].y, eye[2].y);
+  tri->eye[2] = make_plane(basis, inv_w, eye[0].z, eye[1].z, eye[2].z);
+
+  tri->normal[0] = make_plane(basis, inv_w,
+                              normal[0].x, normal[1].x, normal[2].x);
+  tri->normal[1] = make_plane(basis, inv_w,
+                              normal[0].y, normal[1].y, normal[2].y);
+  tri->normal[2] = make_plane(basis, inv_w,
+                              normal[0].z, normal[1].z, normal[2].z);
+
+  tri->tex_coord[0] = make_plane(basis, inv_w, tex_coord[0].x,
+                                 tex_coord[1].x, tex_coord[2].x);
+  tri->tex_coord[1] = make_plane(basis, inv_w, tex_coord[0].y,
+                                 tex_coord[1].y, tex_coord[2].y);
+
+  tri->base_color[0] = make_plane(basis, inv_w, base_color[0].r,
+                                  base_color[1].r, base_color[2].r);
+  tri->base_color[1] = make_plane(basis, inv_w, base_color[0].g,
+                                  base_color[1].g, base_color[2].g);
+  tri->base_color[2] = make_plane(basis, inv_w, base_color[0].b,
+                                  base_color[1].b, base_color[2].b);
+  tri->base_color[3] = make_plane(basis, inv_w, base_color[0].a,
+                                  base_color[1].a, base_color[2].a);
 }
 
-static color interpolate_color(color a, color b, color c,
-                               float wfactor, vector3 coord) {
-  return (color){
-    (coord.x*a.r + coord.y*b.r + coord.z*c.r)/wfactor,
-    (coord.x*a.g + coord.y*b.g + coord.z*c.g)/wfactor,
-    (coord.x*a.b + coord.y*b.b + coord.z*c.b)/wfactor,
-    (coord.x*a.a + coord.y*b.a + coord.z*c.a)/wfactor,
+/* Plane of the vertex values (a, b, c) divided by w. */
+static plane make_plane(const vector3 basis[3], vector3 inv_w,
+                        float a, float b, float c) {
+  vector3 v = vector3_mul(inv_w, (vector3){a, b, c});
+  return (plane){
+    vector3_dot(basis[0], v), vector3_dot(basis[1], v),
+    vector3_dot(basis[2], v),
   };
 }
 
-static void draw_fragment(renderer *state, processed_vertex v,
-                          screen_pos pos) {
-  if (depth_check(state, v, pos)) {
-    color tex_color = (color){255,255,255,255};
-    if (state->tex) {
-      vector2 tex_coord = v.tex_coord;
+/*
+ * Draws the part of the triangle inside rect. Triangles with a non-zero id are
+ * only recorded in the visibility buffer, to be shaded by resolve_deferred.
+ */
+static void emit_triangle(renderer *state, screen_rect rect,
+                          const triangle_setup *tri, uint32_t id) {
+  int x0 = max(rect.x0, tri->bounds.x0);
+  int y0 = max(rect.y0, tri->bounds.y0);
+  int x1 = min(rect.x1-1, tri->bounds.x1-1);
+  int y1 = min(rect.y1-1, tri->bounds.y1-1);
 
-      if (0 <= tex_coord.x && tex_coord.x <= 1 &&
-          0 <= tex_coord.y && tex_coord.y <= 1) {
-        int x = tex_coord.x * (state->tex->w-1);
-        int y = tex_coord.y * (state->tex->h-1);
+  if (x0 > x1 || y0 > y1) return;
 
-        tex_color = state->tex->data[x+y*state->tex->w];
-      }
-    }
+  edge e0 = tri->e[0], e1 = tri->e[1], e2 = tri->e[2];
+  float inv_area = tri->inv_area;
+
+  framebuffer *fb = state->target;
+  bool hierarchical_depth = state->depth_test_flag && fb->depth_min;
+
+  const fragment_pipeline *pipeline = state->pipeline;
+  shading_state shading = current_shading(state);
+  uint32_t *visibility = id != 0 ? state->deferred->visibility : NULL;
+
+  /* Depth is linear in screen space. */
+  float za = tri->z[0], zb = tri->z[1], zc = tri->z[2];
+  float dzdx = (e0.a*za + e1.a*zb + e2.a*zc) * inv_area;
+  float dzdy = (e0.b*za + e1.b*zb + e2.b*zc) * inv_area;
 
-    color light = (color){0,0,0,255};
-
-    if (state->lighting) {
-      vector3 n = vector3_normalize(v.normal);
-      vector3 e = vector3_normalize(v.eye);
-
-      for (size_t i = 0; i < state->light_count; i++) {
-        vector3 l = vector3_normalize(
-          vector3_add(e, state->processed_lights[i].pos));
-        vector3 r = vector3_reflect(vector3_scale(-1, l), n);
-
-        float diffuse = fmaxf(0, -vector3_dot(l, n));
-        float specular = powf(fmaxf(vector3_dot(r, e), 0.0),
-                              state->mat.specular_power);
-
-        light.r = clamp(
-          light.r +
-          state->processed_lights[i].ambient.r +
-          diffuse * state->processed_lights[i].diffuse.r +
-          specular * state->processed_lights[i].specular.r);
-        light.g = clamp(
-          light.g +
-          state->processed_lights[i].ambient.g +
-          diffuse * state->processed_lights[i].diffuse.g +
-          specular * state->processed_lights[i].specular.g);
-        light.b = clamp(
-          light.b +
-          state->processed_lights[i].ambient.b +
-          diffuse * state->processed_lights[i].diffuse.b +
-          specular * state->processed_lights[i].specular.b);
+  float tri_z_min = fminf(za, fminf(zb, zc));
+  float tri_z_max = fmaxf(za, fmaxf(zb, zc));
+
+  for (int by = y0 & ~(BlockSize-1); by <= y1; by += BlockSize) {
+    for (int bx = x0 & ~(BlockSize-1); bx <= x1; bx += BlockSize) {
+      if (block_outside(e0, bx, by) || block_outside(e1, bx, by) ||
+          block_outside(e2, bx, by))
+        continue;
+
+      int block_x0 = max(bx, x0), block_x1 = min(bx + BlockSize-1, x1);
+      int block_y0 = max(by, y0), block_y1 = min(by + BlockSize-1, y1);
+
+      int64_t row0 = edge_at(e0, block_x0, block_y0);
+      int64_t row1 = edge_at(e1, block_x0, block_y0);
+      int64_t row2 = edge_at(e2, block_x0, block_y0);
+
+      size_t block_i = bx/BlockSize + (by/BlockSize)*fb->depth_blocks_x;
+
+      size_t tile_i = bx/TileSize + (by/TileSize)*fb->tiles_x;
+      unsigned cleared = fb->cleared ? fb->cleared[tile_i] : 0;
+
+      if (hierarchical_depth) {
+        float z = ((row0 + e0.bias)*za + (row1 + e1.bias)*zb +
+                   (row2 + e2.bias)*zc) * inv_area;
+
+        float dx = block_x1 - block_x0, dy = block_y1 - block_y0;
+        float z_min = z + fminf(0, dzdx)*dx + fminf(0, dzdy)*dy;
+        float z_max = z + fmaxf(0, dzdx)*dx + fmaxf(0, dzdy)*dy;
+
+        if (block_hidden(state, block_i, tile_i, cleared & TileDepthCleared,
+                         fmaxf(z_min, tri_z_min) - DepthBoundsEpsilon,
+                         fminf(z_max, tri_z_max) + DepthBoundsEpsilon))
+          continue;
       }
+
+      /*
+       * Tiles are only filled once a block in them is drawn to. Each tile is
+       * drawn by a single thread, which owns all of its blocks.
+       */
+      if (cleared) fill_cleared_tile(fb, tile_i);
+
+      raster_block block = {
+        bx, by, {block_x0, block_y0, block_x1 + 1, block_y1 + 1},
+        {row0, row1, row2},
+      };
+
+      bool written = pipeline->draw_block(fb, &shading, tri, &block,
+                                          visibility, id);
+
+      if (written) fb->dirty[tile_i] = true;
+
+      if (hierarchical_depth && written)
+        update_depth_block(fb, bx/BlockSize, by/BlockSize);
     }
-    else
-      light = (color){255,255,255,255};
-
-    size_t i = pos.x+pos.y*state->target->w;
-
-    color src = {
-      (float)v.base_color.r * (float)tex_color.r/255.0 * (float)light.r/255.0,
-      (float)v.base_color.g * (float)tex_color.g/255.0 * (float)light.g/255.0,
-      (float)v.base_color.b * (float)tex_color.b/255.0 * (float)light.b/255.0,
-      v.base_color.a * tex_color.a/255.0,
-    };
-    state->target->color_buffer[i] = src;
   }
 }
 
-static bool depth_check(renderer *state, processed_vertex v,
-                        screen_pos pos) {
-  if (state->depth_test_flag){
-    size_t i = pos.x+pos.y*state->target->w;
-    float dst = state->target->depth_buffer[i];
-    float src = v.frag_pos.z;
+static edge make_edge(screen_pos p, screen_pos q) {
+  int64_t a = p.y - q.y;
+  int64_t b = q.x - p.x;
+  int64_t c = (int64_t)p.x*q.y - (int64_t)q.x*p.y;
 
-    bool passed;
-    switch (state->depth_func) {
-    case DepthTestNever:  passed = false; break;
-    case DepthTestAlways: passed = true;  break;
+  bool top_left = a > 0 || (a == 0 && b < 0);
 
-    case DepthTestEQ: passed = src == dst; break;
-    case DepthTestLT: passed = src <  dst; break;
-    case DepthTestLE: passed = src <= dst; break;
-    case DepthTestGT: passed = src >  dst; break;
-    case DepthTestGE: passed = src >= dst; break;
-    }
+  /* Move the origin from subpixel (0, 0) to the center of pixel (0, 0). */
+  edge e;
+  e.a = a * SubpixelOne;
+  e.b = b * SubpixelOne;
+  e.c = c + (a + b) * (SubpixelOne / 2);
+
+  e.bias = top_left ? 0 : 1;
+  e.c -= e.bias;
 
-    if (passed) state->target->depth_buffer[i] = src;
-    return passed;
+  return e;
+}
+
+static int64_t edge_at(edge e, int x, int y) {
+  return e.a*x + e.b*y + e.c;
+}
+
+static bool block_outside(edge e, int x, int y) {
+  /* Test the corner of the block where the edge function is largest. */
+  if (e.a > 0) x += BlockSize-1;
+  if (e.b > 0) y += BlockSize-1;
+
+  return edge_at(e, x, y) < 0;
+}
+
+/*
+ * Whether no fragment with a depth in [z_min, z_max] can pass the test. The
+ * depth range of blocks in tiles that are still cleared is the clear depth.
+ */
+static bool block_hidden(renderer *state, size_t block, size_t tile,
+                         bool cleared, float z_min, float z_max) {
+  float dst_min = state->target->depth_min[block];
+  float dst_max = state->target->depth_max[block];
+
+  if (cleared) dst_min = dst_max = state->target->clear_depths[tile];
+
+  switch (state->depth_func) {
+  case DepthTestNever:  return true;
+  case DepthTestAlways: return false;
+
+  case DepthTestEQ: return z_min > dst_max || z_max < dst_min;
+  case DepthTestLT: return z_min >= dst_max;
+  case DepthTestLE: return z_min >  dst_max;
+  case DepthTestGT: return z_max <= dst_min;
+  case DepthTestGE: return z_max <  dst_min;
   }
-  else
-    return true;
+
+  return false;
+}
+
+static bool cull(renderer *state, vector3 a, vector3 b, vector3 c) {
+  if (!state->culling) return false;
+
+  float det =
+      a.x*b.y - a.y*b.x
+    + b.x*c.y - b.y*c.x
+    + c.x*a.y - c.y*a.x;
+
+  return det > 0;
+}
+
+static screen_pos ndc_to_screen(renderer *state, vector3 pos) {
+  return (screen_pos){
+    floorf((pos.x + 1) * state->target->w / 2 * SubpixelOne + 0.5f),
+    floorf((pos.y + 1) * state->target->h / 2 * SubpixelOne + 0.5f)
+  };
+}
+
+/* Pixels whose centers may be covered by the triangle. */
+static screen_rect triangle_bounds(screen_pos p0, screen_pos p1,
+                                   screen_pos p2) {
+  int x0 = min(p0.x, min(p1.x, p2.x));
+  int y0 = min(p0.y, min(p1.y, p2.y));
+  int x1 = max(p0.x, max(p1.x, p2.x));
+  int y1 = max(p0.y, max(p1.y, p2.y));
+
+  return (screen_rect){
+    (x0 + SubpixelOne/2 - 1) >> SubpixelBits,
+    (y0 + SubpixelOne/2 - 1) >> SubpixelBits,
+    ((x1 - SubpixelOne/2) >> SubpixelBits) + 1,
+    ((y1 - SubpixelOne/2) >> SubpixelBits) + 1,
+  };
+}
+
+static shading_state current_shading(const renderer *state) {
+  return (shading_state){
+    state->tex,
+    state->lighting, state->mat.specular_power,
+    state->light_count, state->processed_lights,
+  };
 }
 
 static int min(int a, int b) {
@@ -444,8 +1137,15 @@ static int max(int a, int b) {
   return a > b ? a : b;
 }
 
-static uint8_t clamp(float v) {
-  if (v > 255) return 255;
-  if (v < 0) return 0;
-  else return v;
+/* Grows a buffer geometrically so that it can hold n elements. */
+static void *reserve(void *buffer, size_t *capacity, size_t n, size_t size) {
+  if (*capacity >= n) return buffer;
+
+  size_t new_capacity = *capacity ? *capacity : 64;
+  while (new_capacity < n) new_capacity *= 2;
+
+  buffer = realloc(buffer, size * new_capacity);
+  if (buffer) *capacity = new_capacity;
+
+  return buffer;
 }
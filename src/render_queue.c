@@ -0,0 +1,274 @@
+#include "rasterizer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* A frame, and the settings of the renderer it was submitted to. */
+typedef struct queued_frame {
+  frame_request request;
+  fence fence;
+
+  size_t light_count;
+  light *lights;
+
+  size_t thread_count;
+  bool fragment_simd;
+  bool deferred;
+} queued_frame;
+
+/*
+ * Frames waiting to be drawn, in a ring buffer. The frame at head stays in the
+ * queue while it is being drawn.
+ */
+typedef struct render_queue {
+  renderer state;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t work_ready;
+  pthread_cond_t work_done;
+
+  size_t head, count, capacity;
+  queued_frame *frames;
+
+  fence completed;
+
+  /* First frame that could not be drawn, or 0. */
+  fence failed;
+
+  bool quit;
+} render_queue;
+
+static void *render_main(void *arg);
+static int run_frame(renderer *state, const queued_frame *frame);
+static int draw_frame(renderer *state, const frame_request *frame);
+static int push_frame(render_queue *queue, const queued_frame *frame);
+
+int set_async_submission(renderer *state, bool on) {
+  render_queue *queue = state->queue;
+
+  if (!on) {
+    if (!queue) return 0;
+
+    pthread_mutex_lock(&queue->lock);
+    queue->quit = true;
+    pthread_cond_signal(&queue->work_ready);
+    pthread_mutex_unlock(&queue->lock);
+
+    /* The thread only exits once every frame has been drawn. */
+    pthread_join(queue->thread, NULL);
+
+    pthread_cond_destroy(&queue->work_done);
+    pthread_cond_destroy(&queue->work_ready);
+    pthread_mutex_destroy(&queue->lock);
+
+    /* The pool goes back to the caller, unless it asked for another size. */
+    if (queue->state.thread_count == state->thread_count) {
+      state->pool = queue->state.pool;
+      queue->state.pool = NULL;
+      queue->state.thread_count = 1;
+    }
+
+    release_renderer(&queue->state);
+    free(queue->frames);
+    free(queue);
+
+    state->queue = NULL;
+
+    if (state->pool || state->thread_count <= 1) return 0;
+
+    size_t n = state->thread_count;
+    state->thread_count = 1;
+    return set_thread_count(state, n);
+  }
+
+  if (queue) return 0;
+
+  queue = malloc(sizeof(*queue));
+  if (!queue) return -1;
+
+  make_renderer(&queue->state, NULL);
+
+  queue->head = queue->count = queue->capacity = 0;
+  queue->frames = NULL;
+
+  queue->completed = state->submitted_fence;
+  queue->failed = 0;
+
+  queue->quit = false;
+
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->work_ready, NULL);
+  pthread_cond_init(&queue->work_done, NULL);
+
+  if (pthread_create(&queue->thread, NULL, render_main, queue) != 0) {
+    pthread_cond_destroy(&queue->work_done);
+    pthread_cond_destroy(&queue->work_ready);
+    pthread_mutex_destroy(&queue->lock);
+
+    release_renderer(&queue->state);
+    free(queue);
+    return -1;
+  }
+
+  /*
+   * Frames are drawn on the pool of the caller rather than on one of their
+   * own. The thread only reads it once a frame is pushed, under the lock.
+   */
+  queue->state.thread_count = state->thread_count;
+  queue->state.pool = state->pool;
+  state->pool = NULL;
+
+  state->queue = queue;
+  return 0;
+}
+
+bool get_async_submission(const renderer *state) {
+  return state->queue != NULL;
+}
+
+fence submit_frame(renderer *state, const frame_request *frame) {
+  render_queue *queue = state->queue;
+
+  if (!queue) {
+    /* Frames that fail are not numbered, so that every fence is signaled. */
+    if (draw_frame(state, frame) < 0) return 0;
+    return ++state->submitted_fence;
+  }
+
+  queued_frame queued = {
+    *frame, state->submitted_fence + 1,
+    state->light_count, NULL,
+    state->thread_count, state->fragment_simd, state->deferred != NULL,
+  };
+
+  if (state->light_count != 0) {
+    queued.lights = malloc(sizeof(*queued.lights) * state->light_count);
+    if (!queued.lights) return 0;
+
+    memcpy(queued.lights, state->lights,
+           sizeof(*queued.lights) * state->light_count);
+  }
+
+  pthread_mutex_lock(&queue->lock);
+  int result = push_frame(queue, &queued);
+  pthread_mutex_unlock(&queue->lock);
+
+  if (result < 0) {
+    free(queued.lights);
+    return 0;
+  }
+
+  return ++state->submitted_fence;
+}
+
+bool fence_signaled(const renderer *state, fence f) {
+  render_queue *queue = state->queue;
+  if (!queue) return f <= state->submitted_fence;
+
+  pthread_mutex_lock(&queue->lock);
+  bool signaled = f <= queue->completed;
+  pthread_mutex_unlock(&queue->lock);
+
+  return signaled;
+}
+
+int fence_wait(renderer *state, fence f) {
+  render_queue *queue = state->queue;
+  if (!queue) return 0;
+
+  pthread_mutex_lock(&queue->lock);
+
+  while (queue->completed < f)
+    pthread_cond_wait(&queue->work_done, &queue->lock);
+
+  bool failed = queue->failed != 0 && queue->failed <= f;
+
+  pthread_mutex_unlock(&queue->lock);
+
+  return failed ? -1 : 0;
+}
+
+static void *render_main(void *arg) {
+  render_queue *queue = arg;
+
+  pthread_mutex_lock(&queue->lock);
+
+  for (;;) {
+    while (!queue->quit && queue->count == 0)
+      pthread_cond_wait(&queue->work_ready, &queue->lock);
+
+    if (queue->count == 0) break;
+
+    queued_frame frame = queue->frames[queue->head];
+
+    pthread_mutex_unlock(&queue->lock);
+    int result = run_frame(&queue->state, &frame);
+    free(frame.lights);
+    pthread_mutex_lock(&queue->lock);
+
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+
+    queue->completed = frame.fence;
+    if (result < 0 && queue->failed == 0)
+      queue->failed = frame.fence;
+
+    pthread_cond_broadcast(&queue->work_done);
+  }
+
+  pthread_mutex_unlock(&queue->lock);
+  return NULL;
+}
+
+static int run_frame(renderer *state, const queued_frame *frame) {
+  if (set_target(state, frame->request.target) < 0) return -1;
+
+  if (set_lights(state, frame->light_count, frame->lights) < 0) return -1;
+  if (set_thread_count(state, frame->thread_count) < 0) return -1;
+  if (set_fragment_simd(state, frame->fragment_simd) < 0) return -1;
+  if (set_deferred_shading(state, frame->deferred) < 0) return -1;
+
+  return draw_frame(state, &frame->request);
+}
+
+/*
+ * The target is left bound, since binding another one of a different size
+ * would reallocate deferred buffers and drop processed vertices for nothing.
+ */
+static int draw_frame(renderer *state, const frame_request *frame) {
+  if (set_target(state, frame->target) < 0) return -1;
+
+  if (frame->clear_color_flag) clear_target_color(state, frame->clear_color);
+  if (frame->clear_depth_flag) clear_target_depth(state, frame->clear_depth);
+
+  int result = submit_command_buffer(state, frame->commands, frame->sort);
+  if (result == 0 && state->deferred) result = resolve_deferred(state);
+
+  return result;
+}
+
+/* Must be called with the lock held. */
+static int push_frame(render_queue *queue, const queued_frame *frame) {
+  if (queue->count == queue->capacity) {
+    size_t capacity = queue->capacity ? queue->capacity * 2 : 4;
+
+    queued_frame *frames = malloc(sizeof(*frames) * capacity);
+    if (!frames) return -1;
+
+    for (size_t i = 0; i < queue->count; i++)
+      frames[i] = queue->frames[(queue->head + i) % queue->capacity];
+
+    free(queue->frames);
+
+    queue->frames = frames;
+    queue->head = 0;
+    queue->capacity = capacity;
+  }
+
+  queue->frames[(queue->head + queue->count) % queue->capacity] = *frame;
+  queue->count++;
+
+  pthread_cond_signal(&queue->work_ready);
+  return 0;
+}
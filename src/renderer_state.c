@@ -1,4 +1,8 @@
 #include "rasterizer.h"
+#include "thread_pool.h"
+#include "tile_bins.h"
+#include "fragment.h"
+#include "vertex_streams.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -11,10 +15,15 @@ void make_renderer(renderer *state, framebuffer *target) {
 
   state->tex = NULL;
 
+  state->model = Mat4Identity;
+  state->view = Mat4Identity;
+
   state->model_view = Mat4Identity;
   state->projection = Mat4Identity;
   state->normal_matrix = Mat3Identity;
 
+  state->transform_version = 0;
+
   state->mat = (material){
     {255, 255, 255, 255},
     {255, 255, 255, 255},
@@ -33,14 +42,79 @@ void make_renderer(renderer *state, framebuffer *target) {
 
   state->culling = false;
 
-  state->vertex_count = 0;
-  state->vertices = NULL;
+  state->fragment_simd = fragment_simd_supported();
+  state->pipeline = NULL;
+
+  make_vertex_streams(&state->vertices);
+  state->vertices_array_version = 0;
+  state->vertices_transform_version = 0;
+  state->vertices_model_view = Mat4Identity;
+  state->vertices_projection = Mat4Identity;
+
+  state->pending_capacity = 0;
+  state->pending_vertices = NULL;
+
+  state->thread_count = 1;
+  state->pool = NULL;
+
+  state->clip_vertex_count = 0;
+  make_vertex_streams(&state->clip_vertices);
+
+  state->bins = NULL;
+
+  state->deferred = NULL;
+
+  state->submitted_fence = 0;
+  state->queue = NULL;
 }
 
 void release_renderer(renderer *state) {
+  set_async_submission(state, false);
+
   free(state->lights);
   free(state->processed_lights);
-  free(state->vertices);
+  vertex_streams_release(&state->vertices);
+  free(state->pending_vertices);
+
+  if (state->pool) {
+    thread_pool_release(state->pool);
+    free(state->pool);
+  }
+
+  vertex_streams_release(&state->clip_vertices);
+
+  if (state->bins) {
+    tile_bins_release(state->bins);
+    free(state->bins);
+  }
+
+  set_deferred_shading(state, false);
+}
+
+int set_target(renderer *state, framebuffer *target) {
+  framebuffer *old = state->target;
+  if (target == old) return 0;
+
+  /* Draws that were not resolved yet are shaded into the target they hit. */
+  if (old && resolve_deferred(state) < 0) return -1;
+
+  state->target = target;
+
+  if (old && old->w == target->w && old->h == target->h) return 0;
+
+  /* Clip codes depend on the size of the target. */
+  state->vertices_array_version = 0;
+
+  if (state->deferred) {
+    set_deferred_shading(state, false);
+    return set_deferred_shading(state, true);
+  }
+
+  return 0;
+}
+
+framebuffer *current_target(const renderer *state) {
+  return state->target;
 }
 
 void use_texture(renderer *state, texture *tex) {
@@ -52,9 +126,30 @@ texture *current_texture(const renderer *state) {
 }
 
 void set_mvp(renderer *state, mat4 model, mat4 view, mat4 projection) {
+  if (memcmp(&model, &state->model, sizeof(model)) == 0 &&
+      memcmp(&view, &state->view, sizeof(view)) == 0 &&
+      memcmp(&projection, &state->projection, sizeof(projection)) == 0)
+    return;
+
+  state->model = model;
+  state->view = view;
+
   state->model_view = mat4_mul(model, view);
   state->projection = projection;
 
+  /*
+   * Going back to the transforms processed vertices were computed with, as
+   * submit_command_buffer does when it restores the state of the caller, keeps
+   * them. transform_version is never below vertices_transform_version, so that
+   * other transforms always get a version of their own.
+   */
+  if (memcmp(&state->model_view, &state->vertices_model_view,
+             sizeof(mat4)) == 0 &&
+      memcmp(&projection, &state->vertices_projection, sizeof(mat4)) == 0)
+    state->transform_version = state->vertices_transform_version;
+  else
+    state->transform_version++;
+
   state->normal_matrix = mat3_transposed_inverse(
     mat4_upper_left_33(state->model_view));
 
@@ -117,6 +212,43 @@ bool get_depth_test(const renderer *state) { return state->depth_test_flag; }
 void set_culling(renderer *state, bool on) { state->culling = on; }
 bool get_culling(const renderer *state) { return state->culling; }
 
+int set_thread_count(renderer *state, size_t n) {
+  if (n == 0) n = 1;
+  if (n == state->thread_count) return 0;
+
+  thread_pool *pool = NULL;
+  if (n > 1 && !state->queue) {
+    pool = malloc(sizeof(*pool));
+    if (!pool) return -1;
+
+    if (make_thread_pool(pool, n - 1) < 0) {
+      free(pool);
+      return -1;
+    }
+  }
+
+  if (state->pool) {
+    thread_pool_release(state->pool);
+    free(state->pool);
+  }
+
+  state->pool = pool;
+  state->thread_count = n;
+
+  return 0;
+}
+
+size_t get_thread_count(const renderer *state) { return state->thread_count; }
+
+int set_fragment_simd(renderer *state, bool on) {
+  if (on && !fragment_simd_supported()) return -1;
+
+  state->fragment_simd = on;
+  return 0;
+}
+
+bool get_fragment_simd(const renderer *state) { return state->fragment_simd; }
+
 static void update_all_lights(renderer *state) {
   for (size_t i = 0; i < state->light_count; i++)
     update_light(state, i);
@@ -1,34 +1,124 @@
 #include "rasterizer.h"
+#include "texture.h"
 #include "color_buffer.h"
 #include <stdlib.h>
+#include <string.h>
+
+/* Pixels converted at a time when reading or writing tiled textures. */
+#define RowChunkSize 256
+
+static void init_texture(texture *tex, size_t w, size_t h);
+static int load_compressed(texture *tex, size_t w, size_t h,
+                           color_format format, const void *buffer);
+
+static void write_tiled(texture *tex, size_t x, size_t y, size_t w, size_t h,
+                        color_format format, color_type type,
+                        const void *buffer);
+static void read_tiled(const texture *tex, size_t x, size_t y,
+                       size_t w, size_t h,
+                       color_format format, color_type type, void *buffer);
+static size_t pixel_size(color_format format, color_type type);
+
+static void write_compressed(texture *tex, size_t x, size_t y,
+                             size_t w, size_t h,
+                             color_format format, color_type type,
+                             const void *buffer);
+static void write_blocks(texture *tex, size_t x, size_t y, size_t w, size_t h,
+                         const void *buffer);
+static void read_blocks(const texture *tex, size_t x, size_t y,
+                        size_t w, size_t h, void *buffer);
+
+static size_t padded(size_t n);
+static size_t level_size(color_format format, size_t w, size_t h);
+
+static void build_mipmaps(texture *tex, pixel_rect rect);
+static void downsample(texture_level *dst, const texture_level *src,
+                       pixel_rect rect);
+static color average(const texture_level *src, size_t x, size_t y);
+static void store_block(texture_level *level, size_t x, size_t y,
+                        const color texels[BlockTexelCount]);
 
 int load_texture(texture *tex, size_t w, size_t h,
                  color_format format, color_type type, const void *buffer) {
-  color *own_buffer = malloc(sizeof(*own_buffer) * w * h);
+  if (is_compressed(format))
+    return load_compressed(tex, w, h, format, buffer);
+
+  size_t stride = padded(w);
+
+  color *own_buffer = malloc(level_size(ColorRGBA, w, h));
   if (!own_buffer) return -1;
 
-  tex->w    = w;
-  tex->h    = h;
-  tex->data = own_buffer;
+  wrap_texture(tex, w, h, own_buffer, sizeof(*own_buffer) * stride);
+  tex->owns_data = true;
+  tex->tiled = true;
 
   texture_write(tex, 0, 0, w, h, format, type, buffer);
   return 0;
 }
 
 void release_texture(texture *tex) {
-  free(tex->data);
+  if (tex->owns_data) {
+    free(tex->data);
+    free(tex->blocks);
+  }
+
+  free(tex->mips);
+  free(tex->mip_data);
+}
+
+int wrap_texture(texture *tex, size_t w, size_t h,
+                 color *pixels, size_t stride) {
+  if (stride % sizeof(*pixels) != 0 || stride < sizeof(*pixels) * w)
+    return -1;
+
+  init_texture(tex, w, h);
+
+  tex->stride = stride / sizeof(*pixels);
+  tex->data   = pixels;
+
+  return 0;
 }
 
-void texture_write(texture *tex, size_t x, size_t y, size_t w, size_t h,
-                   color_format format, color_type type, const void *buffer) {
-  color_buffer_write(tex->data, tex->w, tex->h,
-                     x, y, w, h, format, type, buffer);
+int texture_from_framebuffer(texture *tex, framebuffer *fb) {
+  if (set_fast_clear(fb, false) < 0) return -1;
+
+  return wrap_texture(tex, fb->w, fb->h, fb->color_buffer,
+                      sizeof(*fb->color_buffer) * fb->stride);
+}
+
+int texture_write(texture *tex, size_t x, size_t y, size_t w, size_t h,
+                  color_format format, color_type type, const void *buffer) {
+  if (is_compressed(format)) {
+    if (format != tex->format || x % TexelBlockSize || y % TexelBlockSize)
+      return -1;
+    write_blocks(tex, x, y, w, h, buffer);
+  }
+  else if (is_compressed(tex->format))
+    write_compressed(tex, x, y, w, h, format, type, buffer);
+  else if (tex->tiled)
+    write_tiled(tex, x, y, w, h, format, type, buffer);
+  else {
+    color_buffer_write(tex->data, tex->stride, tex->h,
+                       x, y, w, h, format, type, buffer);
+  }
+
+  if (tex->mips) build_mipmaps(tex, (pixel_rect){x, y, w, h});
+  return 0;
 }
 
 void texture_read(const texture *tex, size_t x, size_t y, size_t w, size_t h,
                   color_format format, color_type type, void *buffer) {
-  color_buffer_read(tex->data, tex->w, tex->h,
-                    x, y, w, h, format, type, buffer);
+  if (is_compressed(format)) {
+    if (format == tex->format && x % TexelBlockSize == 0 &&
+        y % TexelBlockSize == 0)
+      read_blocks(tex, x, y, w, h, buffer);
+  }
+  else if (tex->tiled)
+    read_tiled(tex, x, y, w, h, format, type, buffer);
+  else {
+    color_buffer_read(tex->data, tex->stride, tex->h,
+                      x, y, w, h, format, type, buffer);
+  }
 }
 
 size_t texture_width(const texture *tex) {
@@ -38,3 +128,337 @@ size_t texture_width(const texture *tex) {
 size_t texture_height(const texture *tex) {
   return tex->h;
 }
+
+int generate_mipmaps(texture *tex) {
+  if (!tex->mips) {
+    size_t count = 0, size = 0;
+    for (size_t w = tex->w, h = tex->h; w > 1 || h > 1; count++) {
+      w = w > 1 ? w / 2 : 1;
+      h = h > 1 ? h / 2 : 1;
+      size += level_size(tex->format, w, h);
+    }
+
+    if (count == 0) return 0;
+
+    texture_level *mips = malloc(sizeof(*mips) * count);
+    if (!mips) return -1;
+
+    uint8_t *data = malloc(size);
+    if (!data) {
+      free(mips);
+      return -1;
+    }
+
+    size_t w = tex->w, h = tex->h;
+    uint8_t *level_data = data;
+
+    for (size_t i = 0; i < count; i++) {
+      w = w > 1 ? w / 2 : 1;
+      h = h > 1 ? h / 2 : 1;
+
+      mips[i] = (texture_level){w, h, padded(w), NULL, true, tex->format, NULL};
+
+      if (is_compressed(tex->format))
+        mips[i].blocks = level_data;
+      else
+        mips[i].data = (color*)level_data;
+
+      level_data += level_size(tex->format, w, h);
+    }
+
+    tex->mip_count = count;
+    tex->mips = mips;
+    tex->mip_data = data;
+  }
+
+  build_mipmaps(tex, (pixel_rect){0, 0, tex->w, tex->h});
+  return 0;
+}
+
+bool has_mipmaps(const texture *tex) {
+  return tex->mips != NULL;
+}
+
+void set_texture_filter(texture *tex, texture_filter filter) {
+  tex->filter = filter;
+}
+
+texture_filter get_texture_filter(const texture *tex) {
+  return tex->filter;
+}
+
+void set_texture_wrap(texture *tex, texture_wrap wrap) {
+  tex->wrap = wrap;
+}
+
+texture_wrap get_texture_wrap(const texture *tex) {
+  return tex->wrap;
+}
+
+texture_level texture_level_at(const texture *tex, size_t i) {
+  if (i == 0) {
+    return (texture_level){
+      tex->w, tex->h, tex->stride, tex->data, tex->tiled,
+      tex->format, tex->blocks,
+    };
+  }
+  else
+    return tex->mips[i-1];
+}
+
+static void init_texture(texture *tex, size_t w, size_t h) {
+  tex->w         = w;
+  tex->h         = h;
+  tex->stride    = 0;
+  tex->data      = NULL;
+  tex->owns_data = false;
+  tex->tiled     = false;
+
+  tex->format = ColorRGBA;
+  tex->blocks = NULL;
+
+  tex->mip_count = 0;
+  tex->mips      = NULL;
+  tex->mip_data  = NULL;
+
+  tex->filter = FilterNearest;
+  tex->wrap   = WrapBorder;
+}
+
+static int load_compressed(texture *tex, size_t w, size_t h,
+                           color_format format, const void *buffer) {
+  uint8_t *blocks = malloc(level_size(format, w, h));
+  if (!blocks) return -1;
+
+  init_texture(tex, w, h);
+
+  tex->stride    = padded(w);
+  tex->owns_data = true;
+  tex->tiled     = true;
+
+  tex->format = format;
+  tex->blocks = blocks;
+
+  write_blocks(tex, 0, 0, w, h, buffer);
+  return 0;
+}
+
+/* Converts a row at a time, then moves each texel to its block. */
+static void write_tiled(texture *tex, size_t x, size_t y, size_t w, size_t h,
+                        color_format format, color_type type,
+                        const void *buffer) {
+  texture_level level = texture_level_at(tex, 0);
+  size_t size = pixel_size(format, type);
+  color row[RowChunkSize];
+
+  for (size_t j = 0; j < h; j++) {
+    const uint8_t *src = (const uint8_t*)buffer + j*w*size;
+
+    for (size_t i = 0; i < w; i += RowChunkSize) {
+      size_t n = w - i < RowChunkSize ? w - i : RowChunkSize;
+      color_buffer_write(row, n, 1, 0, 0, n, 1, format, type, src + i*size);
+
+      for (size_t k = 0; k < n; k++)
+        level.data[texel_index(&level, x+i+k, y+j)] = row[k];
+    }
+  }
+}
+
+static void read_tiled(const texture *tex, size_t x, size_t y,
+                       size_t w, size_t h,
+                       color_format format, color_type type, void *buffer) {
+  texture_level level = texture_level_at(tex, 0);
+  size_t size = pixel_size(format, type);
+  color row[RowChunkSize];
+
+  for (size_t j = 0; j < h; j++) {
+    uint8_t *dst = (uint8_t*)buffer + j*w*size;
+
+    for (size_t i = 0; i < w; i += RowChunkSize) {
+      size_t n = w - i < RowChunkSize ? w - i : RowChunkSize;
+
+      for (size_t k = 0; k < n; k++)
+        row[k] = texel_at(&level, x+i+k, y+j);
+
+      color_buffer_read(row, n, 1, 0, 0, n, 1, format, type, dst + i*size);
+    }
+  }
+}
+
+static size_t pixel_size(color_format format, color_type type) {
+  return format * (type == ColorTypeByte ? 1 : sizeof(float));
+}
+
+/*
+ * Converts the rows of a row of blocks at a time, then compresses each block
+ * again, with its texels outside of the region decoded first.
+ */
+static void write_compressed(texture *tex, size_t x, size_t y,
+                             size_t w, size_t h,
+                             color_format format, color_type type,
+                             const void *buffer) {
+  texture_level level = texture_level_at(tex, 0);
+  size_t size = pixel_size(format, type);
+  color rows[TexelBlockSize][RowChunkSize];
+
+  size_t x0 = x - x % TexelBlockSize, y0 = y - y % TexelBlockSize;
+
+  for (size_t by = y0; by < y + h; by += TexelBlockSize) {
+    for (size_t bx = x0; bx < x + w; bx += RowChunkSize) {
+      size_t i0 = bx < x ? x : bx;
+      size_t i1 = bx + RowChunkSize < x + w ? bx + RowChunkSize : x + w;
+
+      for (size_t j = by; j < by + TexelBlockSize; j++) {
+        if (j < y || j >= y + h) continue;
+
+        const uint8_t *src = (const uint8_t*)buffer +
+          ((j - y)*w + i0 - x)*size;
+        color_buffer_write(rows[j - by] + (i0 - bx), i1 - i0, 1,
+                           0, 0, i1 - i0, 1, format, type, src);
+      }
+
+      for (size_t cx = bx; cx < i1; cx += TexelBlockSize) {
+        uint8_t *block = texel_block(&level, cx, by);
+        color texels[BlockTexelCount];
+
+        for (size_t k = 0; k < BlockTexelCount; k++) {
+          /* Texels past the edges repeat the last row and column. */
+          size_t tx = cx + k % TexelBlockSize, ty = by + k / TexelBlockSize;
+          if (tx >= level.w) tx = level.w - 1;
+          if (ty >= level.h) ty = level.h - 1;
+
+          if (x <= tx && tx < x + w && y <= ty && ty < y + h)
+            texels[k] = rows[ty - by][tx - bx];
+          else {
+            texels[k] = decode_texel(level.format, block,
+                                     ty % TexelBlockSize * TexelBlockSize +
+                                     tx % TexelBlockSize);
+          }
+        }
+
+        encode_block(level.format, texels, block);
+      }
+    }
+  }
+}
+
+/* x and y are multiples of TexelBlockSize, and buffer holds whole blocks. */
+static void write_blocks(texture *tex, size_t x, size_t y, size_t w, size_t h,
+                         const void *buffer) {
+  texture_level level = texture_level_at(tex, 0);
+  size_t row = padded(w) / TexelBlockSize * compressed_block_size(level.format);
+
+  for (size_t j = 0; j < h; j += TexelBlockSize) {
+    memcpy(texel_block(&level, x, y + j),
+           (const uint8_t*)buffer + j / TexelBlockSize * row, row);
+  }
+}
+
+static void read_blocks(const texture *tex, size_t x, size_t y,
+                        size_t w, size_t h, void *buffer) {
+  texture_level level = texture_level_at(tex, 0);
+  size_t row = padded(w) / TexelBlockSize * compressed_block_size(level.format);
+
+  for (size_t j = 0; j < h; j += TexelBlockSize) {
+    memcpy((uint8_t*)buffer + j / TexelBlockSize * row,
+           texel_block(&level, x, y + j), row);
+  }
+}
+
+/* Rounds n up to a whole number of blocks. */
+static size_t padded(size_t n) {
+  return (n + TexelBlockSize - 1) / TexelBlockSize * TexelBlockSize;
+}
+
+/* Size in bytes of a tiled level. */
+static size_t level_size(color_format format, size_t w, size_t h) {
+  size_t blocks = padded(w) / TexelBlockSize * (padded(h) / TexelBlockSize);
+
+  if (is_compressed(format))
+    return blocks * compressed_block_size(format);
+  else
+    return blocks * BlockTexelCount * sizeof(color);
+}
+
+/* Updates the texels of every level that depend on rect of level 0. */
+static void build_mipmaps(texture *tex, pixel_rect rect) {
+  texture_level src = texture_level_at(tex, 0);
+
+  for (size_t i = 0; i < tex->mip_count; i++) {
+    texture_level *dst = &tex->mips[i];
+
+    /*
+     * Compressed blocks are encoded whole, so any texel of a block the rect
+     * touches may have changed. Odd columns and rows past the last pair are
+     * not part of any average.
+     */
+    size_t x0 = rect.x - rect.x % TexelBlockSize;
+    size_t y0 = rect.y - rect.y % TexelBlockSize;
+    size_t x1 = padded(rect.x + rect.w), y1 = padded(rect.y + rect.h);
+    if (x1 > src.w) x1 = src.w;
+    if (y1 > src.h) y1 = src.h;
+
+    x0 /= 2;
+    y0 /= 2;
+    x1 = (x1 + 1) / 2 < dst->w ? (x1 + 1) / 2 : dst->w;
+    y1 = (y1 + 1) / 2 < dst->h ? (y1 + 1) / 2 : dst->h;
+    if (x0 >= x1 || y0 >= y1) break;
+
+    rect = (pixel_rect){x0, y0, x1 - x0, y1 - y0};
+    downsample(dst, &src, rect);
+    src = *dst;
+  }
+}
+
+/*
+ * Averages blocks of 2x2 texels, or fewer along sides of size 1, a block of
+ * dst at a time, over the blocks that rect of dst touches.
+ */
+static void downsample(texture_level *dst, const texture_level *src,
+                       pixel_rect rect) {
+  size_t x0 = rect.x - rect.x % TexelBlockSize;
+  size_t y0 = rect.y - rect.y % TexelBlockSize;
+
+  for (size_t by = y0; by < rect.y + rect.h; by += TexelBlockSize) {
+    for (size_t bx = x0; bx < rect.x + rect.w; bx += TexelBlockSize) {
+      color texels[BlockTexelCount];
+
+      for (size_t k = 0; k < BlockTexelCount; k++) {
+        /* Texels past the edges repeat the last row and column. */
+        size_t x = bx + k % TexelBlockSize, y = by + k / TexelBlockSize;
+        if (x >= dst->w) x = dst->w - 1;
+        if (y >= dst->h) y = dst->h - 1;
+
+        texels[k] = average(src, x, y);
+      }
+
+      store_block(dst, bx, by, texels);
+    }
+  }
+}
+
+static color average(const texture_level *src, size_t x, size_t y) {
+  size_t x0 = 2*x, x1 = src->w > 1 ? 2*x + 1 : 2*x;
+  size_t y0 = 2*y, y1 = src->h > 1 ? 2*y + 1 : 2*y;
+
+  color a = texel_at(src, x0, y0), b = texel_at(src, x1, y0);
+  color c = texel_at(src, x0, y1), d = texel_at(src, x1, y1);
+
+  return (color){
+    (a.r + b.r + c.r + d.r + 2) / 4,
+    (a.g + b.g + c.g + d.g + 2) / 4,
+    (a.b + b.b + c.b + d.b + 2) / 4,
+    (a.a + b.a + c.a + d.a + 2) / 4,
+  };
+}
+
+/* Tiled blocks are contiguous, like the texels given. */
+static void store_block(texture_level *level, size_t x, size_t y,
+                        const color texels[BlockTexelCount]) {
+  if (is_compressed(level->format))
+    encode_block(level->format, texels, texel_block(level, x, y));
+  else {
+    memcpy(&level->data[texel_index(level, x, y)], texels,
+           sizeof(*texels) * BlockTexelCount);
+  }
+}
@@ -0,0 +1,39 @@
+#ifndef TEXTURE_H_
+#define TEXTURE_H_
+
+#include "rasterizer.h"
+#include "block_compression.h"
+
+/* Width and height of the blocks of tiled levels: one cache line of texels. */
+#define TexelBlockSize 4
+
+/* Level i of the mip chain, where level 0 is the texture itself. */
+texture_level texture_level_at(const texture *tex, size_t i);
+
+/* Index of texel (x, y) in the data of a level. */
+static inline size_t texel_index(const texture_level *level,
+                                 size_t x, size_t y) {
+  if (!level->tiled) return x + y*level->stride;
+
+  size_t bx = x % TexelBlockSize, by = y % TexelBlockSize;
+  return (y - by)*level->stride + (x - bx)*TexelBlockSize +
+    by*TexelBlockSize + bx;
+}
+
+/* Compressed block that contains texel (x, y). */
+static inline uint8_t *texel_block(const texture_level *level,
+                                   size_t x, size_t y) {
+  size_t blocks_x = level->stride / TexelBlockSize;
+  size_t i = x/TexelBlockSize + y/TexelBlockSize * blocks_x;
+
+  return level->blocks + i*compressed_block_size(level->format);
+}
+
+static inline color texel_at(const texture_level *level, size_t x, size_t y) {
+  if (level->format == ColorRGBA) return level->data[texel_index(level, x, y)];
+
+  return decode_texel(level->format, texel_block(level, x, y),
+                      y%TexelBlockSize * TexelBlockSize + x%TexelBlockSize);
+}
+
+#endif
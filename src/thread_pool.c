@@ -0,0 +1,110 @@
+#include "thread_pool.h"
+#include <stdlib.h>
+
+static void *worker_main(void *arg);
+static void run_tasks(thread_pool *pool);
+
+int make_thread_pool(thread_pool *pool, size_t n) {
+  pool->thread_count = 0;
+  pool->threads = malloc(sizeof(*pool->threads) * n);
+  if (n && !pool->threads) return -1;
+
+  pool->task = NULL;
+  pool->data = NULL;
+
+  pool->next = pool->count = pool->pending = 0;
+  pool->generation = 0;
+
+  pool->quit = false;
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_ready, NULL);
+  pthread_cond_init(&pool->work_done, NULL);
+
+  for (size_t i = 0; i < n; i++) {
+    if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0) {
+      thread_pool_release(pool);
+      return -1;
+    }
+
+    pool->thread_count++;
+  }
+
+  return 0;
+}
+
+void thread_pool_release(thread_pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = true;
+  pthread_cond_broadcast(&pool->work_ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (size_t i = 0; i < pool->thread_count; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  pthread_cond_destroy(&pool->work_done);
+  pthread_cond_destroy(&pool->work_ready);
+  pthread_mutex_destroy(&pool->lock);
+
+  free(pool->threads);
+}
+
+void thread_pool_run(thread_pool *pool, size_t n,
+                     thread_pool_task *task, void *data) {
+  if (n == 0) return;
+
+  pthread_mutex_lock(&pool->lock);
+
+  pool->task = task;
+  pool->data = data;
+
+  pool->next = 0;
+  pool->count = n;
+  pool->pending = n;
+
+  pool->generation++;
+  pthread_cond_broadcast(&pool->work_ready);
+
+  run_tasks(pool);
+
+  while (pool->pending != 0)
+    pthread_cond_wait(&pool->work_done, &pool->lock);
+
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void *worker_main(void *arg) {
+  thread_pool *pool = arg;
+  unsigned long seen = 0;
+
+  pthread_mutex_lock(&pool->lock);
+
+  for (;;) {
+    while (!pool->quit && pool->generation == seen)
+      pthread_cond_wait(&pool->work_ready, &pool->lock);
+
+    if (pool->quit) break;
+
+    seen = pool->generation;
+    run_tasks(pool);
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+/* Must be called with the lock held. */
+static void run_tasks(thread_pool *pool) {
+  while (pool->next < pool->count) {
+    size_t i = pool->next++;
+    thread_pool_task *task = pool->task;
+    void *data = pool->data;
+
+    pthread_mutex_unlock(&pool->lock);
+    task(data, i);
+    pthread_mutex_lock(&pool->lock);
+
+    if (--pool->pending == 0)
+      pthread_cond_signal(&pool->work_done);
+  }
+}
@@ -0,0 +1,38 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+typedef void thread_pool_task(void *data, size_t i);
+
+typedef struct thread_pool {
+  size_t thread_count;
+  pthread_t *threads;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work_ready;
+  pthread_cond_t work_done;
+
+  thread_pool_task *task;
+  void *data;
+
+  size_t next, count, pending;
+  unsigned long generation;
+
+  bool quit;
+} thread_pool;
+
+/*
+ * Starts n worker threads. The thread calling thread_pool_run also takes part
+ * in the work, so a pool created with n threads runs n+1 tasks at once.
+ */
+int make_thread_pool(thread_pool *pool, size_t n);
+void thread_pool_release(thread_pool *pool);
+
+/* Calls task(data, i) for every i in [0, n) and waits for all of them. */
+void thread_pool_run(thread_pool *pool, size_t n,
+                     thread_pool_task *task, void *data);
+
+#endif
@@ -0,0 +1,39 @@
+#include "tile_bins.h"
+#include <stdlib.h>
+
+void make_tile_bins(tile_bins *bins) {
+  bins->triangle_count = 0;
+  bins->triangle_capacity = 0;
+  bins->triangles = NULL;
+
+  bins->bin_count = 0;
+  bins->bins = NULL;
+}
+
+void tile_bins_release(tile_bins *bins) {
+  free(bins->triangles);
+
+  for (size_t i = 0; i < bins->bin_count; i++)
+    free(bins->bins[i].triangles);
+  free(bins->bins);
+}
+
+int tile_bins_reset(tile_bins *bins, size_t n) {
+  bins->triangle_count = 0;
+
+  if (bins->bin_count < n) {
+    tile_bin *grown = realloc(bins->bins, sizeof(*grown) * n);
+    if (!grown) return -1;
+
+    for (size_t i = bins->bin_count; i < n; i++)
+      grown[i] = (tile_bin){0, 0, NULL};
+
+    bins->bins = grown;
+    bins->bin_count = n;
+  }
+
+  for (size_t i = 0; i < n; i++)
+    bins->bins[i].count = 0;
+
+  return 0;
+}
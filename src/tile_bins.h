@@ -0,0 +1,36 @@
+#ifndef TILE_BINS_H_
+#define TILE_BINS_H_
+
+#include "rasterizer.h"
+
+/*
+ * Triangle with the processed vertices it was submitted with, or with the id
+ * of the deferred triangle it was recorded as.
+ */
+typedef struct binned_triangle {
+  uint32_t v[3];
+  uint32_t id;
+} binned_triangle;
+
+/* Indices into the triangles of a draw of those that overlap a tile. */
+typedef struct tile_bin {
+  size_t count, capacity;
+  uint32_t *triangles;
+} tile_bin;
+
+/* Triangles of the draw being submitted to a pool of threads, one bin a tile. */
+typedef struct tile_bins {
+  size_t triangle_count, triangle_capacity;
+  binned_triangle *triangles;
+
+  size_t bin_count;
+  tile_bin *bins;
+} tile_bins;
+
+void make_tile_bins(tile_bins *bins);
+void tile_bins_release(tile_bins *bins);
+
+/* Drops every triangle, and makes sure there is a bin for each of n tiles. */
+int tile_bins_reset(tile_bins *bins, size_t n);
+
+#endif
@@ -3,8 +3,33 @@
 #include <math.h>
 #include <string.h>
 
+#ifdef HAVE_AVX2
+#include <immintrin.h>
+#endif
+
 #define Pi 3.14159265358979323846
 
+#define vector_at(in, stride, i) \
+  ((const vector3*)((const char*)(in) + (i)*(stride)))
+
+#ifdef HAVE_AVX2
+
+/*
+ * Batches are transformed eight vectors at a time with AVX2 when the CPU
+ * supports it, using the same operations in the same order as the scalar
+ * functions. These return how many vectors were done; the rest are left to
+ * the scalar loops.
+ */
+#define TargetAvx2 __attribute__((target("avx2")))
+
+static size_t transform_avx2(const float m[4][4], size_t rows, bool affine,
+                             const vector3 *in, size_t stride, float *out,
+                             size_t n);
+static size_t normalize_avx2(const vector3 *in, size_t stride, float *out,
+                             size_t n);
+
+#endif
+
 vector2 vector2_add(vector2 a, vector2 b) {
   return (vector2){a.x+b.x, a.y+b.y};
 }
@@ -184,3 +209,143 @@ vector4 mat4_project(mat4 m, vector3 v) {
       mat4_at(m, 3, 3),
   };
 }
+
+void vector3_normalize_n(const vector3 *in, size_t stride, vector3 *out,
+                         size_t n) {
+  size_t i = 0;
+
+#ifdef HAVE_AVX2
+  if (__builtin_cpu_supports("avx2"))
+    i = normalize_avx2(in, stride, (float*)out, n);
+#endif
+
+  for (; i < n; i++)
+    out[i] = vector3_normalize(*vector_at(in, stride, i));
+}
+
+void mat3_apply_n(mat3 m, const vector3 *in, size_t stride, vector3 *out,
+                  size_t n) {
+  size_t i = 0;
+
+#ifdef HAVE_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    float rows[4][4];
+    for (size_t j = 0; j < 3; j++) {
+      for (size_t k = 0; k < 3; k++) rows[j][k] = mat3_at(m, k, j);
+      rows[j][3] = 0;
+    }
+
+    i = transform_avx2(rows, 3, false, in, stride, (float*)out, n);
+  }
+#endif
+
+  for (; i < n; i++)
+    out[i] = mat3_apply(m, *vector_at(in, stride, i));
+}
+
+void mat4_apply_n(mat4 m, const vector3 *in, size_t stride, vector3 *out,
+                  size_t n) {
+  size_t i = 0;
+
+#ifdef HAVE_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    float rows[4][4];
+    for (size_t j = 0; j < 3; j++)
+      for (size_t k = 0; k < 4; k++) rows[j][k] = mat4_at(m, k, j);
+
+    i = transform_avx2(rows, 3, true, in, stride, (float*)out, n);
+  }
+#endif
+
+  for (; i < n; i++)
+    out[i] = mat4_apply(m, *vector_at(in, stride, i));
+}
+
+void mat4_project_n(mat4 m, const vector3 *in, size_t stride, vector4 *out,
+                    size_t n) {
+  size_t i = 0;
+
+#ifdef HAVE_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    float rows[4][4];
+    for (size_t j = 0; j < 4; j++)
+      for (size_t k = 0; k < 4; k++) rows[j][k] = mat4_at(m, k, j);
+
+    i = transform_avx2(rows, 4, true, in, stride, (float*)out, n);
+  }
+#endif
+
+  for (; i < n; i++)
+    out[i] = mat4_project(m, *vector_at(in, stride, i));
+}
+
+#ifdef HAVE_AVX2
+
+/*
+ * Computes the first rows components of m*(x, y, z, 1), or of m*(x, y, z)
+ * if not affine, for each input vector.
+ */
+TargetAvx2
+static size_t transform_avx2(const float m[4][4], size_t rows, bool affine,
+                             const vector3 *in, size_t stride, float *out,
+                             size_t n) {
+  __m256i index = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                     _mm256_set1_epi32(stride / sizeof(float)));
+
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const float *src = (const float*)vector_at(in, stride, i);
+
+    __m256 x = _mm256_i32gather_ps(src + 0, index, 4);
+    __m256 y = _mm256_i32gather_ps(src + 1, index, 4);
+    __m256 z = _mm256_i32gather_ps(src + 2, index, 4);
+
+    float result[4][8];
+    for (size_t j = 0; j < rows; j++) {
+      __m256 v = _mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(m[j][0])),
+                      _mm256_mul_ps(y, _mm256_set1_ps(m[j][1]))),
+        _mm256_mul_ps(z, _mm256_set1_ps(m[j][2])));
+      if (affine) v = _mm256_add_ps(v, _mm256_set1_ps(m[j][3]));
+
+      _mm256_storeu_ps(result[j], v);
+    }
+
+    for (size_t k = 0; k < 8; k++)
+      for (size_t j = 0; j < rows; j++) out[(i + k)*rows + j] = result[j][k];
+  }
+
+  return i;
+}
+
+TargetAvx2
+static size_t normalize_avx2(const vector3 *in, size_t stride, float *out,
+                             size_t n) {
+  __m256i index = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                     _mm256_set1_epi32(stride / sizeof(float)));
+
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const float *src = (const float*)vector_at(in, stride, i);
+
+    __m256 x = _mm256_i32gather_ps(src + 0, index, 4);
+    __m256 y = _mm256_i32gather_ps(src + 1, index, 4);
+    __m256 z = _mm256_i32gather_ps(src + 2, index, 4);
+
+    __m256 norm = _mm256_sqrt_ps(_mm256_add_ps(
+      _mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)),
+      _mm256_mul_ps(z, z)));
+
+    float result[3][8];
+    _mm256_storeu_ps(result[0], _mm256_div_ps(x, norm));
+    _mm256_storeu_ps(result[1], _mm256_div_ps(y, norm));
+    _mm256_storeu_ps(result[2], _mm256_div_ps(z, norm));
+
+    for (size_t k = 0; k < 8; k++)
+      for (size_t j = 0; j < 3; j++) out[(i + k)*3 + j] = result[j][k];
+  }
+
+  return i;
+}
+
+#endif
@@ -2,11 +2,19 @@
 #include <stdlib.h>
 #include <string.h>
 
+/*
+ * Never 0, which renderers use to mean that they have no vertices. Shared by
+ * every array, so it is only ever updated atomically.
+ */
+static unsigned long last_version = 0;
+
 int make_vertex_array(vertex_array *array, size_t n, const vertex *data) {
   array->n = n;
   array->data = malloc(sizeof(*array->data) * n);
   if (!array->data) return -1;
 
+  vertex_array_touch(array);
+
   if (data)
     vertex_array_write(array, 0, n, data);
 
@@ -20,6 +28,7 @@ void vertex_array_release(vertex_array *array) {
 void vertex_array_write(vertex_array *array, size_t i, size_t n,
                         const vertex *buffer) {
   memcpy(array->data + i, buffer, sizeof(vertex) * n);
+  vertex_array_touch(array);
 }
 
 void vertex_array_read(const vertex_array *array, size_t i, size_t n,
@@ -30,3 +39,12 @@ void vertex_array_read(const vertex_array *array, size_t i, size_t n,
 size_t vertex_array_size(const vertex_array *array) {
   return array->n;
 }
+
+void vertex_array_touch(vertex_array *array) {
+  unsigned long version;
+  do {
+    version = __atomic_add_fetch(&last_version, 1, __ATOMIC_RELAXED);
+  } while (version == 0);
+
+  array->version = version;
+}
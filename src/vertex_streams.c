@@ -0,0 +1,119 @@
+#include "vertex_streams.h"
+#include <stdlib.h>
+#include <string.h>
+
+void make_vertex_streams(vertex_streams *s) {
+  s->capacity = 0;
+
+  s->epoch = 1;
+  s->epochs = NULL;
+
+  s->clip_pos = NULL;
+  s->clip_code = NULL;
+
+  s->frag_pos = NULL;
+  s->inv_w = NULL;
+
+  s->eye = NULL;
+  s->normal = NULL;
+  s->tex_coord = NULL;
+  s->base_color = NULL;
+}
+
+void vertex_streams_release(vertex_streams *s) {
+  free(s->epochs);
+
+  free(s->clip_pos);
+  free(s->clip_code);
+
+  free(s->frag_pos);
+  free(s->inv_w);
+
+  free(s->eye);
+  free(s->normal);
+  free(s->tex_coord);
+  free(s->base_color);
+}
+
+/*
+ * Streams are grown one at a time: if one of them cannot be, those before it
+ * are merely larger than needed.
+ */
+int vertex_streams_reserve(vertex_streams *s, size_t n) {
+  if (s->capacity >= n) return 0;
+
+  size_t capacity = s->capacity ? s->capacity : 64;
+  while (capacity < n) capacity *= 2;
+
+  uint32_t *epochs = realloc(s->epochs, sizeof(*epochs) * capacity);
+  if (!epochs) return -1;
+  memset(epochs + s->capacity, 0, sizeof(*epochs) * (capacity - s->capacity));
+  s->epochs = epochs;
+
+  vector4 *clip_pos = realloc(s->clip_pos, sizeof(*clip_pos) * capacity);
+  if (!clip_pos) return -1;
+  s->clip_pos = clip_pos;
+
+  unsigned *clip_code = realloc(s->clip_code, sizeof(*clip_code) * capacity);
+  if (!clip_code) return -1;
+  s->clip_code = clip_code;
+
+  vector3 *frag_pos = realloc(s->frag_pos, sizeof(*frag_pos) * capacity);
+  if (!frag_pos) return -1;
+  s->frag_pos = frag_pos;
+
+  float *inv_w = realloc(s->inv_w, sizeof(*inv_w) * capacity);
+  if (!inv_w) return -1;
+  s->inv_w = inv_w;
+
+  vector3 *eye = realloc(s->eye, sizeof(*eye) * capacity);
+  if (!eye) return -1;
+  s->eye = eye;
+
+  vector3 *normal = realloc(s->normal, sizeof(*normal) * capacity);
+  if (!normal) return -1;
+  s->normal = normal;
+
+  vector2 *tex_coord = realloc(s->tex_coord, sizeof(*tex_coord) * capacity);
+  if (!tex_coord) return -1;
+  s->tex_coord = tex_coord;
+
+  color *base_color = realloc(s->base_color, sizeof(*base_color) * capacity);
+  if (!base_color) return -1;
+  s->base_color = base_color;
+
+  s->capacity = capacity;
+  return 0;
+}
+
+void vertex_streams_invalidate(vertex_streams *s) {
+  if (++s->epoch != 0) return;
+
+  /* Epoch 0 is never current, so that new vertices start out stale. */
+  memset(s->epochs, 0, sizeof(*s->epochs) * s->capacity);
+  s->epoch = 1;
+}
+
+processed_vertex load_vertex(const vertex_streams *s, size_t i) {
+  return (processed_vertex){
+    s->eye[i], s->normal[i],
+    s->tex_coord[i], s->base_color[i],
+    s->clip_pos[i], s->clip_code[i],
+    s->frag_pos[i], s->inv_w[i],
+  };
+}
+
+void store_vertex(vertex_streams *s, size_t i, processed_vertex v) {
+  s->epochs[i] = s->epoch;
+
+  s->clip_pos[i] = v.clip_pos;
+  s->clip_code[i] = v.clip_code;
+
+  s->frag_pos[i] = v.frag_pos;
+  s->inv_w[i] = v.inv_w;
+
+  s->eye[i] = v.eye;
+  s->normal[i] = v.normal;
+  s->tex_coord[i] = v.tex_coord;
+  s->base_color[i] = v.base_color;
+}
@@ -0,0 +1,18 @@
+#ifndef VERTEX_STREAMS_H_
+#define VERTEX_STREAMS_H_
+
+#include "rasterizer.h"
+
+void make_vertex_streams(vertex_streams *s);
+void vertex_streams_release(vertex_streams *s);
+
+/* Grows every stream geometrically so that they can hold n vertices. */
+int vertex_streams_reserve(vertex_streams *s, size_t n);
+
+/* Marks every vertex as stale, in constant time. */
+void vertex_streams_invalidate(vertex_streams *s);
+
+processed_vertex load_vertex(const vertex_streams *s, size_t i);
+void store_vertex(vertex_streams *s, size_t i, processed_vertex v);
+
+#endif
@@ -0,0 +1,244 @@
+#include "scene.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Compressed textures give back what they were given, as closely as their
+ * format allows, and regions they cannot hold are left alone.
+ */
+
+static int check_compression(void);
+static int check_rejected(void);
+static int check_partial(void);
+
+static int compress(color_format format, size_t w, size_t h,
+                    const uint8_t *pixels, uint8_t *decoded);
+
+int main(void) {
+  int failures = 0;
+
+  failures += check_compression();
+  failures += check_rejected();
+  failures += check_partial();
+
+  if (failures == 0) printf("all checks passed\n");
+  return failures == 0 ? 0 : 1;
+}
+
+/*
+ * Blocks of a single color that 5:6:5 represents exactly come back unchanged,
+ * and gradients within a block come back close to what they were.
+ */
+static int check_compression(void) {
+  static const color_format formats[] = {ColorBC1, ColorBC3};
+  static const char *names[] = {"BC1", "BC3"};
+
+  enum { Size = 32 };
+  uint8_t pixels[Size*Size*4], decoded[Size*Size*4];
+  int failures = 0;
+
+  for (size_t f = 0; f < 2; f++) {
+    fill_checker(pixels, Size, Size, 4,
+                 (color){132, 65, 255, 255}, (color){0, 255, 8, 255});
+
+    /* BC3 also keeps alpha, exactly in blocks of a single one. */
+    if (formats[f] == ColorBC3) {
+      for (size_t i = 0; i < Size*Size; i++) pixels[i*4 + 3] = 77;
+    }
+
+    if (compress(formats[f], Size, Size, pixels, decoded) < 0 ||
+        memcmp(pixels, decoded, sizeof(pixels)) != 0) {
+      fprintf(stderr, "%s: flat blocks changed\n", names[f]);
+      failures++;
+    }
+
+    /* Every channel grows along the texels of each block. */
+    for (size_t y = 0; y < Size; y++) {
+      for (size_t x = 0; x < Size; x++) {
+        uint8_t *p = &pixels[(x + y*Size)*4];
+        size_t t = x%4 + y%4*4;
+
+        p[0] = x/4*10 + 4*t;
+        p[1] = y/4*10 + 2*t;
+        p[2] = 60 + 6*t;
+        p[3] = formats[f] == ColorBC3 ? 100 + 8*t : 255;
+      }
+    }
+
+    if (compress(formats[f], Size, Size, pixels, decoded) < 0) {
+      fprintf(stderr, "%s: could not compress gradients\n", names[f]);
+      failures++;
+      continue;
+    }
+
+    int worst = 0;
+    for (size_t i = 0; i < sizeof(pixels); i++) {
+      int error = abs(pixels[i] - decoded[i]);
+      if (error > worst) worst = error;
+    }
+
+    /*
+     * Blue spans 90 in a block, 30 between two of the four colors: texels are
+     * within half of that, plus the rounding of the endpoints to 5:6:5.
+     */
+    if (worst > 15 + 4) {
+      fprintf(stderr, "%s: gradients off by %d\n", names[f], worst);
+      failures++;
+    }
+  }
+
+  return failures;
+}
+
+/*
+ * Blocks in another compressed format, or away from the corner of a block,
+ * are neither written nor read, and framebuffers read nothing compressed.
+ */
+static int check_rejected(void) {
+  enum { Size = 16 };
+  uint8_t blocks[(Size/4)*(Size/4)*16], other[sizeof(blocks)];
+  uint8_t before[Size*Size*4], after[Size*Size*4];
+  int failures = 0;
+
+  for (size_t i = 0; i < sizeof(blocks); i++) blocks[i] = i*7;
+  memset(other, 0x5a, sizeof(other));
+
+  texture tex;
+  if (load_texture(&tex, Size, Size, ColorBC1, ColorTypeByte, blocks) < 0)
+    return 1;
+
+  texture_read(&tex, 0, 0, Size, Size, ColorRGBA, ColorTypeByte, before);
+
+  if (texture_write(&tex, 0, 0, Size, Size, ColorBC3, ColorTypeByte,
+                    other) == 0) {
+    fprintf(stderr, "BC3 blocks written into BC1\n");
+    failures++;
+  }
+
+  if (texture_write(&tex, 2, 0, 8, 8, ColorBC1, ColorTypeByte, other) == 0 ||
+      texture_write(&tex, 0, 6, 8, 8, ColorBC1, ColorTypeByte, other) == 0) {
+    fprintf(stderr, "blocks written away from a block corner\n");
+    failures++;
+  }
+
+  texture_read(&tex, 0, 0, Size, Size, ColorRGBA, ColorTypeByte, after);
+  if (memcmp(before, after, sizeof(before)) != 0) {
+    fprintf(stderr, "rejected writes changed texels\n");
+    failures++;
+  }
+
+  memset(after, 0xa5, sizeof(after));
+  texture_read(&tex, 0, 0, Size, Size, ColorBC3, ColorTypeByte, after);
+  texture_read(&tex, 4, 2, 8, 8, ColorBC1, ColorTypeByte, after);
+
+  framebuffer fb;
+  if (make_framebuffer(&fb, Size, Size) == 0) {
+    framebuffer_read(&fb, 0, 0, Size, Size, ColorBC1, ColorTypeByte, after);
+    framebuffer_release(&fb);
+  }
+  else {
+    failures++;
+  }
+
+  for (size_t i = 0; i < sizeof(after); i++) {
+    if (after[i] != 0xa5) {
+      fprintf(stderr, "rejected reads wrote into the buffer\n");
+      failures++;
+      break;
+    }
+  }
+
+  release_texture(&tex);
+  return failures;
+}
+
+/*
+ * Writing pixels over part of a compressed texture only encodes again the
+ * blocks they touch.
+ */
+static int check_partial(void) {
+  enum { Size = 16 };
+  uint8_t pixels[Size*Size*4], before[sizeof(pixels)], after[sizeof(pixels)];
+  uint8_t patch[5*3*4];
+  int failures = 0;
+
+  for (size_t y = 0; y < Size; y++) {
+    for (size_t x = 0; x < Size; x++) {
+      uint8_t *p = &pixels[(x + y*Size)*4];
+      p[0] = x*15;
+      p[1] = y*15;
+      p[2] = (x*y) % 256;
+      p[3] = 255;
+    }
+  }
+
+  memset(patch, 200, sizeof(patch));
+
+  uint8_t blocks[(Size/4)*(Size/4)*16] = {0};
+
+  texture tex;
+  if (load_texture(&tex, Size, Size, ColorBC3, ColorTypeByte, blocks) < 0)
+    return 1;
+
+  texture_write(&tex, 0, 0, Size, Size, ColorRGBA, ColorTypeByte, pixels);
+  texture_read(&tex, 0, 0, Size, Size, ColorRGBA, ColorTypeByte, before);
+
+  /* Texels 5 to 9 of rows 5 to 7, within blocks 1 and 2 of block row 1. */
+  if (texture_write(&tex, 5, 5, 5, 3, ColorRGBA, ColorTypeByte, patch) < 0) {
+    release_texture(&tex);
+    return 1;
+  }
+
+  texture_read(&tex, 0, 0, Size, Size, ColorRGBA, ColorTypeByte, after);
+
+  for (size_t y = 0; y < Size; y++) {
+    for (size_t x = 0; x < Size; x++) {
+      bool touched = y/4 == 1 && (x/4 == 1 || x/4 == 2);
+      bool in_patch = x >= 5 && x < 10 && y >= 5 && y < 8;
+      const uint8_t *p = &after[(x + y*Size)*4];
+
+      if (!touched && memcmp(p, &before[(x + y*Size)*4], 4) != 0) {
+        fprintf(stderr, "partial: texel %zu, %zu changed\n", x, y);
+        failures++;
+      }
+      else if (in_patch && abs(p[0] - 200) > 8) {
+        fprintf(stderr, "partial: texel %zu, %zu is %d, not 200\n",
+                x, y, p[0]);
+        failures++;
+      }
+    }
+  }
+
+  release_texture(&tex);
+  return failures;
+}
+
+/*
+ * Compresses pixels into a texture, copies its blocks into another one, and
+ * decodes them from there.
+ */
+static int compress(color_format format, size_t w, size_t h,
+                    const uint8_t *pixels, uint8_t *decoded) {
+  size_t size = (w/4) * (h/4) * (format == ColorBC1 ? 8 : 16);
+  uint8_t *blocks = calloc(size, 1);
+  if (!blocks) return -1;
+
+  texture encoded, copy;
+  int result = -1;
+
+  if (load_texture(&encoded, w, h, format, ColorTypeByte, blocks) == 0) {
+    texture_write(&encoded, 0, 0, w, h, ColorRGBA, ColorTypeByte, pixels);
+    texture_read(&encoded, 0, 0, w, h, format, ColorTypeByte, blocks);
+    release_texture(&encoded);
+
+    if (load_texture(&copy, w, h, format, ColorTypeByte, blocks) == 0) {
+      texture_read(&copy, 0, 0, w, h, ColorRGBA, ColorTypeByte, decoded);
+      release_texture(&copy);
+      result = 0;
+    }
+  }
+
+  free(blocks);
+  return result;
+}
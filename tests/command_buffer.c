@@ -0,0 +1,277 @@
+#include "scene.h"
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Replaying a command buffer must draw what drawing directly does, sorted or
+ * not, and leave the state of the renderer as it was.
+ */
+
+#define Size 64
+
+typedef struct rect {
+  float x0, y0, x1, y1, z;
+  color c;
+
+  bool depth_test;
+  depth_func f;
+} rect;
+
+static int check_scene(scene *s, int view, bool sort);
+static int check_state(scene *s);
+static int check_rects(const char *name, const rect *rects, size_t n);
+
+static int render_scene_commands(scene *s, int view, bool sort, image *out);
+static int render_rects(const rect *rects, size_t n, int how, color *out);
+
+/* How render_rects draws. */
+enum {
+  DrawDirectly,
+  ReplayInOrder,
+  ReplaySorted,
+};
+
+int main(void) {
+  /*
+   * The overlay has no depth test, so it must stay between the draws around
+   * it: the blue rectangle covers it.
+   */
+  static const rect overlay[] = {
+    {-1, -1, 1, 1, 0, {255, 0, 0, 255}, true, DepthTestLT},
+    {-0.5, -0.5, 0.5, 0.5, 0.9, {0, 255, 0, 255}, false, DepthTestLT},
+    {-1, -1, 1, 1, -0.5, {0, 0, 255, 255}, true, DepthTestLT},
+    {-0.2, -0.2, 0.2, 0.2, 0.5, {255, 255, 0, 255}, true, DepthTestLE},
+  };
+
+  /*
+   * Only the middle of the green rectangle is kept by GT, and then only the
+   * middle of the blue one passes LT: sorting them together would draw blue
+   * before green.
+   */
+  static const rect directions[] = {
+    {-1, -1, 1, 1, 0.5, {255, 0, 0, 255}, true, DepthTestLT},
+    {-0.5, -0.5, 0.5, 0.5, 0.8, {0, 255, 0, 255}, true, DepthTestGT},
+    {-1, -1, 1, 1, 0.6, {0, 0, 255, 255}, true, DepthTestLE},
+    {-0.8, -0.8, 0.8, 0.8, 0.7, {255, 0, 255, 255}, true, DepthTestGE},
+  };
+
+  int failures = 0;
+
+  scene s;
+  if (make_scene(&s) < 0) {
+    fprintf(stderr, "could not make the scene\n");
+    return 1;
+  }
+
+  for (int view = 0; view < SceneViewCount; view++) {
+    failures += check_scene(&s, view, false);
+    failures += check_scene(&s, view, true);
+  }
+
+  failures += check_state(&s);
+
+  /* Processed sort keys must follow writes to the arrays. */
+  vertex wall[4];
+  vertex_array_read(&s.wall, 0, 4, wall);
+  for (size_t i = 0; i < 4; i++) wall[i].pos.z += 2.5f;
+  vertex_array_write(&s.wall, 0, 4, wall);
+
+  failures += check_scene(&s, 0, true);
+
+  release_scene(&s);
+
+  failures += check_rects("overlay", overlay,
+                          sizeof(overlay)/sizeof(*overlay));
+  failures += check_rects("depth directions", directions,
+                          sizeof(directions)/sizeof(*directions));
+
+  if (failures == 0) printf("all checks passed\n");
+  return failures == 0 ? 0 : 1;
+}
+
+static int check_scene(scene *s, int view, bool sort) {
+  static const render_path scalar = {"scalar", 1, false, false, false, false};
+  static image expected, got;
+
+  if (render_scene(&scalar, s, view, &expected) < 0 ||
+      render_scene_commands(s, view, sort, &got) < 0) {
+    fprintf(stderr, "could not render view %d\n", view);
+    return 1;
+  }
+
+  if (memcmp(&expected, &got, sizeof(got)) != 0) {
+    fprintf(stderr, "view %d differs when replayed%s\n", view,
+            sort ? " sorted" : "");
+    return 1;
+  }
+
+  return 0;
+}
+
+/* Replaying draws with other states restores those of the caller. */
+static int check_state(scene *s) {
+  command_buffer commands;
+  make_command_buffer(&commands);
+
+  renderer state;
+  make_renderer(&state, NULL);
+
+  int failures = 0;
+
+  if (record_scene(&commands, &state, s, 0) < 0) failures++;
+
+  framebuffer fb;
+  if (make_framebuffer(&fb, SceneWidth, SceneHeight) < 0) {
+    failures++;
+    goto done;
+  }
+
+  if (set_target(&state, &fb) < 0) failures++;
+
+  material m = {
+    {1, 2, 3, 4}, {5, 6, 7, 8}, {9, 10, 11, 12}, 13,
+  };
+  mat4 model = mat4_translate((vector3){1, 2, 3});
+  mat4 view = mat4_scale((vector3){2, 2, 2});
+  mat4 projection = mat4_perspective(Pi/3, 1, 1, 50);
+
+  use_texture(&state, NULL);
+  use_material(&state, m);
+  set_mvp(&state, model, view, projection);
+  set_lighting(&state, false);
+  set_depth_test(&state, false);
+  set_depth_func(&state, DepthTestGE);
+  set_culling(&state, true);
+
+  for (int sort = 0; sort < 2; sort++) {
+    if (submit_command_buffer(&state, &commands, sort) < 0) failures++;
+
+    material restored = current_material(&state);
+
+    if (current_texture(&state) != NULL ||
+        memcmp(&restored, &m, sizeof(m)) != 0 ||
+        memcmp(&state.model, &model, sizeof(model)) != 0 ||
+        memcmp(&state.view, &view, sizeof(view)) != 0 ||
+        memcmp(&state.projection, &projection, sizeof(projection)) != 0 ||
+        get_lighting(&state) || get_depth_test(&state) ||
+        get_depth_func(&state) != DepthTestGE || !get_culling(&state)) {
+      fprintf(stderr, "state not restored after replaying%s\n",
+              sort ? " sorted" : "");
+      failures++;
+    }
+  }
+
+  framebuffer_release(&fb);
+
+done:
+  release_renderer(&state);
+  command_buffer_release(&commands);
+
+  return failures;
+}
+
+static int check_rects(const char *name, const rect *rects, size_t n) {
+  static color expected[Size*Size], got[Size*Size];
+  int failures = 0;
+
+  if (render_rects(rects, n, DrawDirectly, expected) < 0) return 1;
+
+  for (int how = ReplayInOrder; how <= ReplaySorted; how++) {
+    if (render_rects(rects, n, how, got) < 0 ||
+        memcmp(expected, got, sizeof(got)) != 0) {
+      fprintf(stderr, "%s: differs when replayed%s\n", name,
+              how == ReplaySorted ? " sorted" : "");
+      failures++;
+    }
+  }
+
+  return failures;
+}
+
+static int render_scene_commands(scene *s, int view, bool sort, image *out) {
+  framebuffer fb;
+  if (make_framebuffer(&fb, SceneWidth, SceneHeight) < 0) return -1;
+
+  renderer state;
+  make_renderer(&state, &fb);
+
+  command_buffer commands;
+  make_command_buffer(&commands);
+
+  int result = record_scene(&commands, &state, s, view);
+
+  if (result == 0) {
+    clear_target_color(&state, (color){0, 0, 3, 255});
+    clear_target_depth(&state, 1);
+
+    result = submit_command_buffer(&state, &commands, sort);
+
+    framebuffer_read(&fb, 0, 0, SceneWidth, SceneHeight,
+                     ColorRGBA, ColorTypeByte, out->pixels);
+    depthbuffer_read(&fb, 0, 0, SceneWidth, SceneHeight, out->depths);
+  }
+
+  command_buffer_release(&commands);
+  release_renderer(&state);
+  framebuffer_release(&fb);
+
+  return result;
+}
+
+/* Rectangles of one color each, in normalized device coordinates. */
+static int render_rects(const rect *rects, size_t n, int how, color *out) {
+  vertex vertices[4*n];
+
+  for (size_t i = 0; i < n; i++) {
+    const rect *r = &rects[i];
+
+    vertices[i*4+0] = (vertex){{r->x0, r->y0, r->z}, {0, 0, 1}, r->c, {0, 0}};
+    vertices[i*4+1] = (vertex){{r->x1, r->y0, r->z}, {0, 0, 1}, r->c, {0, 0}};
+    vertices[i*4+2] = (vertex){{r->x0, r->y1, r->z}, {0, 0, 1}, r->c, {0, 0}};
+    vertices[i*4+3] = (vertex){{r->x1, r->y1, r->z}, {0, 0, 1}, r->c, {0, 0}};
+  }
+
+  vertex_array array;
+  if (make_vertex_array(&array, 4*n, vertices) < 0) return -1;
+
+  framebuffer fb;
+  if (make_framebuffer(&fb, Size, Size) < 0) {
+    vertex_array_release(&array);
+    return -1;
+  }
+
+  renderer state;
+  make_renderer(&state, &fb);
+
+  command_buffer commands;
+  make_command_buffer(&commands);
+
+  clear_target_color(&state, (color){0, 0, 0, 255});
+  clear_target_depth(&state, 1);
+
+  int result = 0;
+
+  for (size_t i = 0; i < n && result == 0; i++) {
+    set_depth_test(&state, rects[i].depth_test);
+    set_depth_func(&state, rects[i].f);
+
+    if (how == DrawDirectly)
+      result = draw_array(&state, DrawTriangleStrip, &array, i*4, 4);
+    else {
+      result = record_draw_array(&commands, &state, DrawTriangleStrip,
+                                 &array, i*4, 4);
+    }
+  }
+
+  if (result == 0 && how != DrawDirectly)
+    result = submit_command_buffer(&state, &commands, how == ReplaySorted);
+
+  framebuffer_read(&fb, 0, 0, Size, Size, ColorRGBA, ColorTypeByte, out);
+
+  command_buffer_release(&commands);
+  release_renderer(&state);
+  framebuffer_release(&fb);
+  vertex_array_release(&array);
+
+  return result;
+}
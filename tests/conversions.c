@@ -0,0 +1,214 @@
+#include "rasterizer.h"
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Pixels must convert between formats the same way whichever kernels the CPU
+ * selects, over any width, including the tails of rows left after the
+ * vectorized part and rows longer than a chunk of float conversions.
+ */
+
+#define RowWidth 300
+#define RowCount 3
+
+static int check_conversions(void);
+static int check_rows(void);
+static int check_row(const framebuffer *fb, const color *pixels,
+                     size_t x, size_t w);
+
+int main(void) {
+  int failures = 0;
+
+  failures += check_conversions();
+  failures += check_rows();
+
+  if (failures == 0) printf("all checks passed\n");
+  return failures == 0 ? 0 : 1;
+}
+
+/* Pixels come back from a framebuffer in every format they can be read in. */
+static int check_conversions(void) {
+  enum { Size = 16 };
+  uint8_t rgba[Size*Size*4], out[Size*Size*4];
+  color pixels[Size*Size];
+  int failures = 0;
+
+  for (size_t i = 0; i < sizeof(rgba); i++) rgba[i] = i*37 + i/7;
+
+  framebuffer fb;
+  if (wrap_framebuffer(&fb, Size, Size, pixels, sizeof(pixels)/Size) < 0)
+    return 1;
+
+  memcpy(pixels, rgba, sizeof(rgba));
+
+  framebuffer_read(&fb, 0, 0, Size, Size, ColorRGBA, ColorTypeByte, out);
+  if (memcmp(out, rgba, sizeof(rgba)) != 0) {
+    fprintf(stderr, "RGBA bytes changed\n");
+    failures++;
+  }
+
+  framebuffer_read(&fb, 0, 0, Size, Size, ColorRGB, ColorTypeByte, out);
+  for (size_t i = 0; i < Size*Size; i++) {
+    if (memcmp(&out[i*3], &rgba[i*4], 3) != 0) {
+      fprintf(stderr, "RGB bytes changed at %zu\n", i);
+      failures++;
+      break;
+    }
+  }
+
+  /* Gray pixels are read back unchanged. */
+  for (size_t i = 0; i < Size*Size; i++) {
+    uint8_t v = rgba[i*4];
+    pixels[i] = (color){v, v, v, 255};
+  }
+
+  framebuffer_read(&fb, 0, 0, Size, Size, ColorGray, ColorTypeByte, out);
+  for (size_t i = 0; i < Size*Size; i++) {
+    if (out[i] != rgba[i*4]) {
+      fprintf(stderr, "gray byte %d read as %d\n", rgba[i*4], out[i]);
+      failures++;
+      break;
+    }
+  }
+
+  /*
+   * Every byte value is read as the float that dividing it by 255 in single
+   * precision gives, whichever kernels convert it, and that float is written
+   * back as the same byte.
+   */
+  for (size_t i = 0; i < Size*Size; i++)
+    pixels[i] = (color){i, 255 - i, i ^ 0x5a, i};
+
+  float floats[Size*Size*4];
+  framebuffer_read(&fb, 0, 0, Size, Size, ColorRGBA, ColorTypeFloat, floats);
+
+  for (size_t i = 0; i < Size*Size*4; i++) {
+    uint8_t v = ((uint8_t*)pixels)[i];
+
+    if (floats[i] != v / 255.0f) {
+      fprintf(stderr, "byte %d read as %.9g\n", v, floats[i]);
+      failures++;
+      break;
+    }
+  }
+
+  texture tex;
+  if (load_texture(&tex, Size, Size, ColorRGBA, ColorTypeFloat, floats) < 0)
+    failures++;
+  else {
+    texture_read(&tex, 0, 0, Size, Size, ColorRGBA, ColorTypeByte, out);
+    release_texture(&tex);
+
+    if (memcmp(out, pixels, sizeof(pixels)) != 0) {
+      fprintf(stderr, "floats written back as other bytes\n");
+      failures++;
+    }
+  }
+
+  framebuffer_release(&fb);
+  return failures;
+}
+
+/* Reads every width at a few offsets, in every format. */
+static int check_rows(void) {
+  static const size_t widths[] = {255, 256, 257, RowWidth - 5};
+  static color pixels[RowWidth*RowCount];
+  int failures = 0;
+
+  for (size_t i = 0; i < RowWidth*RowCount; i++)
+    pixels[i] = (color){i*7, i*13 + 5, i ^ 0xa5, 255 - i*3};
+
+  framebuffer fb;
+  if (wrap_framebuffer(&fb, RowWidth, RowCount, pixels,
+                       RowWidth*sizeof(color)) < 0)
+    return 1;
+
+  for (size_t x = 0; x < 6; x += 5) {
+    for (size_t w = 1; w <= 40; w++) failures += check_row(&fb, pixels, x, w);
+
+    for (size_t i = 0; i < sizeof(widths)/sizeof(*widths); i++)
+      failures += check_row(&fb, pixels, x, widths[i]);
+  }
+
+  framebuffer_release(&fb);
+  return failures;
+}
+
+static int check_row(const framebuffer *fb, const color *pixels,
+                     size_t x, size_t w) {
+  static uint8_t bytes[RowWidth*RowCount*4];
+  static float floats[RowWidth*RowCount*4];
+
+  const uint8_t *in = (const uint8_t*)pixels;
+
+  framebuffer_read(fb, x, 0, w, RowCount, ColorRGB, ColorTypeByte, bytes);
+  framebuffer_read(fb, x, 0, w, RowCount, ColorRGBA, ColorTypeFloat, floats);
+
+  for (size_t y = 0; y < RowCount; y++) {
+    for (size_t i = 0; i < w; i++) {
+      const uint8_t *p = &in[(x + i + y*RowWidth)*4];
+      size_t j = i + y*w;
+
+      if (memcmp(&bytes[j*3], p, 3) != 0) {
+        fprintf(stderr, "RGB row of %zu from %zu: pixel %zu differs\n",
+                w, x, i);
+        return 1;
+      }
+
+      for (size_t c = 0; c < 4; c++) {
+        if (floats[j*4 + c] != p[c] / 255.0f) {
+          fprintf(stderr, "float row of %zu from %zu: pixel %zu differs\n",
+                  w, x, i);
+          return 1;
+        }
+      }
+    }
+  }
+
+  /* Rows of a texture are written from RGB and gray pixels alike. */
+  texture tex;
+  if (load_texture(&tex, w, RowCount, ColorRGB, ColorTypeByte, bytes) < 0)
+    return 1;
+
+  texture_read(&tex, 0, 0, w, RowCount, ColorRGBA, ColorTypeByte, bytes);
+
+  int failures = 0;
+
+  for (size_t y = 0; y < RowCount && !failures; y++) {
+    for (size_t i = 0; i < w; i++) {
+      const uint8_t *p = &in[(x + i + y*RowWidth)*4];
+      const uint8_t *t = &bytes[(i + y*w)*4];
+
+      if (memcmp(t, p, 3) != 0 || t[3] != 255) {
+        fprintf(stderr, "RGB texture of %zu: texel %zu differs\n", w, i);
+        failures++;
+        break;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < w*RowCount; i++) bytes[i] = i*11;
+
+  if (texture_write(&tex, 0, 0, w, RowCount, ColorGray, ColorTypeByte,
+                    bytes) < 0) {
+    release_texture(&tex);
+    return failures + 1;
+  }
+
+  texture_read(&tex, 0, 0, w, RowCount, ColorRGBA, ColorTypeByte, floats);
+
+  const uint8_t *texels = (const uint8_t*)floats;
+  for (size_t i = 0; i < w*RowCount; i++) {
+    uint8_t v = i*11;
+    const uint8_t *t = &texels[i*4];
+
+    if (t[0] != v || t[1] != v || t[2] != v || t[3] != 255) {
+      fprintf(stderr, "gray texture of %zu: texel %zu differs\n", w, i);
+      failures++;
+      break;
+    }
+  }
+
+  release_texture(&tex);
+  return failures;
+}
@@ -0,0 +1,211 @@
+#include "scene.h"
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Resolving deferred draws must give the image drawing them forward does,
+ * including when the target is cleared before they are resolved.
+ */
+
+#define Size 64
+
+static const render_path paths[] = {
+  {"deferred",         1, false, true, false, false},
+  {"deferred threads", 4, false, true, false, false},
+};
+
+static const color red = {255, 0, 0, 255}, green = {0, 255, 0, 255};
+static const color blue = {0, 0, 255, 255};
+
+static int check_clears(size_t thread_count, bool fast_clear);
+static int check_targets(size_t thread_count, size_t w);
+static int draw_rect(renderer *state, float x0, float y0, float x1, float y1,
+                     float z, color c);
+static int check_pixels(const char *name, framebuffer *fb,
+                        color inside, color outside);
+
+int main(void) {
+  int failures = 0;
+
+  scene s;
+  if (make_scene(&s) < 0) {
+    fprintf(stderr, "could not make the scene\n");
+    return 1;
+  }
+
+  for (size_t i = 0; i < sizeof(paths)/sizeof(*paths); i++)
+    failures += check_path(&s, &paths[i]);
+
+  release_scene(&s);
+
+  for (size_t threads = 1; threads <= 4; threads += 3) {
+    failures += check_clears(threads, false);
+    failures += check_clears(threads, true);
+
+    failures += check_targets(threads, Size);
+    failures += check_targets(threads, Size/2);
+  }
+
+  if (failures == 0) printf("all checks passed\n");
+  return failures == 0 ? 0 : 1;
+}
+
+/*
+ * Draws that a clear of the color covers are not shaded by the next resolve,
+ * but those that only had their depth cleared are.
+ */
+static int check_clears(size_t thread_count, bool fast_clear) {
+  framebuffer fb;
+  if (make_framebuffer(&fb, Size, Size) < 0) return 1;
+
+  renderer state;
+  make_renderer(&state, &fb);
+
+  int failures = 0;
+
+  if (set_fast_clear(&fb, fast_clear) < 0 ||
+      set_thread_count(&state, thread_count) < 0 ||
+      set_deferred_shading(&state, true) < 0) {
+    failures++;
+    goto done;
+  }
+
+  set_depth_test(&state, true);
+  set_mvp(&state, Mat4Identity, Mat4Identity, Mat4Identity);
+
+  clear_target_color(&state, blue);
+  clear_target_depth(&state, 1);
+
+  if (draw_rect(&state, -1, -1, 1, 1, 0, red) < 0) failures++;
+  clear_target_color(&state, green);
+  if (resolve_deferred(&state) < 0) failures++;
+
+  failures += check_pixels("color clear", &fb, green, green);
+
+  /* The color clear must not drop draws made after it either. */
+  if (draw_rect(&state, -1, -1, 1, 1, 0, red) < 0) failures++;
+  clear_target_color(&state, green);
+  if (draw_rect(&state, -0.5, -0.5, 0.5, 0.5, -0.5, blue) < 0) failures++;
+  if (resolve_deferred(&state) < 0) failures++;
+
+  failures += check_pixels("draw after clear", &fb, blue, green);
+
+  clear_target_depth(&state, 1);
+  if (draw_rect(&state, -1, -1, 1, 1, 0, red) < 0) failures++;
+  clear_target_depth(&state, 1);
+  if (resolve_deferred(&state) < 0) failures++;
+
+  failures += check_pixels("depth clear", &fb, red, red);
+
+done:
+  if (failures)
+    fprintf(stderr, "failed with %zu threads, fast clears %s\n",
+            thread_count, fast_clear ? "on" : "off");
+
+  release_renderer(&state);
+  framebuffer_release(&fb);
+
+  return failures;
+}
+
+/*
+ * Draws that were not resolved when the target changes go to the target they
+ * were drawn to, whether or not the next one has the same size.
+ */
+static int check_targets(size_t thread_count, size_t w) {
+  framebuffer a, b;
+  if (make_framebuffer(&a, Size, Size) < 0) return 1;
+  if (make_framebuffer(&b, w, Size) < 0) {
+    framebuffer_release(&a);
+    return 1;
+  }
+
+  renderer state;
+  make_renderer(&state, &a);
+
+  int failures = 0;
+
+  if (set_thread_count(&state, thread_count) < 0 ||
+      set_deferred_shading(&state, true) < 0) {
+    failures++;
+    goto done;
+  }
+
+  set_mvp(&state, Mat4Identity, Mat4Identity, Mat4Identity);
+
+  clear_target_color(&state, green);
+  if (draw_rect(&state, -0.5, -0.5, 0.5, 0.5, 0, red) < 0) failures++;
+
+  if (set_target(&state, &b) < 0) failures++;
+  clear_target_color(&state, blue);
+  if (resolve_deferred(&state) < 0) failures++;
+
+  failures += check_pixels("previous target", &a, red, green);
+
+  static color pixels[Size*Size];
+  framebuffer_read(&b, 0, 0, w, Size, ColorRGBA, ColorTypeByte, pixels);
+
+  for (size_t i = 0; i < w*Size; i++) {
+    if (memcmp(&pixels[i], &blue, sizeof(blue)) != 0) {
+      fprintf(stderr, "next target: (%zu, %zu) is not blue\n", i % w, i / w);
+      failures++;
+      break;
+    }
+  }
+
+done:
+  if (failures)
+    fprintf(stderr, "failed with %zu threads, next target %zu wide\n",
+            thread_count, w);
+
+  release_renderer(&state);
+  framebuffer_release(&a);
+  framebuffer_release(&b);
+
+  return failures;
+}
+
+/* A rectangle of one color, in normalized device coordinates. */
+static int draw_rect(renderer *state, float x0, float y0, float x1, float y1,
+                     float z, color c) {
+  vertex rect[4] = {
+    {{x0, y0, z}, {0, 0, 1}, c, {0, 0}},
+    {{x1, y0, z}, {0, 0, 1}, c, {0, 0}},
+    {{x0, y1, z}, {0, 0, 1}, c, {0, 0}},
+    {{x1, y1, z}, {0, 0, 1}, c, {0, 0}},
+  };
+
+  vertex_array array;
+  if (make_vertex_array(&array, 4, rect) < 0) return -1;
+
+  int result = draw_array(state, DrawTriangleStrip, &array, 0, 4);
+
+  vertex_array_release(&array);
+  return result;
+}
+
+/*
+ * Checks that the middle half of the target has one color, and its edges
+ * another.
+ */
+static int check_pixels(const char *name, framebuffer *fb,
+                        color inside, color outside) {
+  static color pixels[Size*Size];
+  framebuffer_read(fb, 0, 0, Size, Size, ColorRGBA, ColorTypeByte, pixels);
+
+  for (size_t y = 0; y < Size; y++) {
+    for (size_t x = 0; x < Size; x++) {
+      bool in = x >= Size/4 && x < Size*3/4 && y >= Size/4 && y < Size*3/4;
+      color expected = in ? inside : outside;
+
+      if (memcmp(&pixels[x + y*Size], &expected, sizeof(expected)) != 0) {
+        color c = pixels[x + y*Size];
+        fprintf(stderr, "%s: (%zu, %zu) is %d %d %d %d\n", name, x, y,
+                c.r, c.g, c.b, c.a);
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,247 @@
+#include "scene.h"
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Reading back only the dirty rectangles of a framebuffer after every frame
+ * must keep a copy of it up to date, along every rendering path.
+ */
+
+#define Width  SceneWidth
+#define Height SceneHeight
+
+/* Tiles of the framebuffer, the last ones cut by its edges. */
+#define TilesX ((Width + TileSize - 1) / TileSize)
+#define TilesY ((Height + TileSize - 1) / TileSize)
+
+static const render_path paths[] = {
+  {"scalar",     1, false, false, false, false},
+  {"fast clear", 1, false, false, false, true},
+  {"threads",    4, false, false, false, true},
+  {"deferred",   4, false, true,  false, true},
+};
+
+static int check_rects(void);
+static int check_clears(void);
+static int check_frames(scene *s, const render_path *path);
+
+static int update_copy(framebuffer *fb, uint8_t *copy);
+static int check_copy(const char *name, const framebuffer *fb,
+                      const uint8_t *copy);
+
+int main(void) {
+  int failures = 0;
+
+  failures += check_rects();
+  failures += check_clears();
+
+  scene s;
+  if (make_scene(&s) < 0) {
+    fprintf(stderr, "could not make the scene\n");
+    return 1;
+  }
+
+  for (size_t i = 0; i < sizeof(paths)/sizeof(*paths); i++)
+    failures += check_frames(&s, &paths[i]);
+
+  release_scene(&s);
+
+  if (failures == 0) printf("all checks passed\n");
+  return failures == 0 ? 0 : 1;
+}
+
+/*
+ * Every tile of a new framebuffer is dirty, as one run per row of tiles, and
+ * none is once acknowledged. A draw makes only the tiles it covers dirty.
+ */
+static int check_rects(void) {
+  framebuffer fb;
+  if (make_framebuffer(&fb, Width, Height) < 0) return 1;
+
+  pixel_rect rects[TilesX*TilesY];
+  int failures = 0;
+
+  size_t n = framebuffer_dirty_rects(&fb, rects, 1);
+  if (n != TilesY || rects[0].x != 0 || rects[0].y != 0 ||
+      rects[0].w != Width || rects[0].h != TileSize) {
+    fprintf(stderr, "new framebuffer: %zu dirty rectangles\n", n);
+    failures++;
+  }
+
+  n = framebuffer_dirty_rects(&fb, rects, TilesX*TilesY);
+  if (n != TilesY || rects[n-1].y != (TilesY-1)*TileSize ||
+      rects[n-1].h != Height - (TilesY-1)*TileSize) {
+    fprintf(stderr, "new framebuffer: last row not cut\n");
+    failures++;
+  }
+
+  framebuffer_acknowledge(&fb);
+  if (framebuffer_dirty_rects(&fb, rects, TilesX*TilesY) != 0) {
+    fprintf(stderr, "acknowledged framebuffer still dirty\n");
+    failures++;
+  }
+
+  vertex quad[4] = {
+    {{-0.2, -0.1, 0}, {0, 0, 1}, {255, 0, 0, 255}, {0, 0}},
+    {{ 0.0, -0.1, 0}, {0, 0, 1}, {255, 0, 0, 255}, {0, 0}},
+    {{-0.2,  0.1, 0}, {0, 0, 1}, {255, 0, 0, 255}, {0, 0}},
+    {{ 0.0,  0.1, 0}, {0, 0, 1}, {255, 0, 0, 255}, {0, 0}},
+  };
+
+  vertex_array array;
+  if (make_vertex_array(&array, 4, quad) < 0) {
+    framebuffer_release(&fb);
+    return failures + 1;
+  }
+
+  renderer state;
+  make_renderer(&state, &fb);
+  set_mvp(&state, Mat4Identity, Mat4Identity, Mat4Identity);
+
+  /* Pixels 80 to 100 across and 67 to 83 down: all in the second tile. */
+  if (draw_array(&state, DrawTriangleStrip, &array, 0, 4) < 0) failures++;
+
+  n = framebuffer_dirty_rects(&fb, rects, TilesX*TilesY);
+  if (n != 1 || rects[0].x != TileSize || rects[0].y != TileSize ||
+      rects[0].w != TileSize || rects[0].h != TileSize) {
+    fprintf(stderr, "draw: %zu dirty rectangles\n", n);
+    failures++;
+  }
+
+  release_renderer(&state);
+  vertex_array_release(&array);
+  framebuffer_release(&fb);
+
+  return failures;
+}
+
+/*
+ * With fast clears, clearing tiles to the color they were last cleared to,
+ * without drawing to them since, leaves them clean.
+ */
+static int check_clears(void) {
+  framebuffer fb;
+  if (make_framebuffer(&fb, Width, Height) < 0) return 1;
+
+  pixel_rect rects[TilesX*TilesY];
+  int failures = 0;
+
+  clear_color_buffer(&fb, (color){1, 2, 3, 4});
+  framebuffer_acknowledge(&fb);
+
+  clear_color_buffer(&fb, (color){1, 2, 3, 4});
+  if (framebuffer_dirty_rects(&fb, rects, TilesX*TilesY) != 0) {
+    fprintf(stderr, "same clear made tiles dirty\n");
+    failures++;
+  }
+
+  clear_color_buffer(&fb, (color){4, 3, 2, 1});
+  if (framebuffer_dirty_rects(&fb, rects, TilesX*TilesY) != TilesY) {
+    fprintf(stderr, "other clear left tiles clean\n");
+    failures++;
+  }
+
+  framebuffer_acknowledge(&fb);
+  set_fast_clear(&fb, false);
+
+  clear_color_buffer(&fb, (color){4, 3, 2, 1});
+  if (framebuffer_dirty_rects(&fb, rects, TilesX*TilesY) != TilesY) {
+    fprintf(stderr, "full clear left tiles clean\n");
+    failures++;
+  }
+
+  framebuffer_release(&fb);
+  return failures;
+}
+
+/*
+ * Draws every view in turn, and the same view twice, updating a copy of the
+ * framebuffer from its dirty rectangles after each frame.
+ */
+static int check_frames(scene *s, const render_path *path) {
+  static const int views[] = {0, 1, 1, 2, 0};
+  static uint8_t copy[Width*Height*4];
+
+  framebuffer fb;
+  if (make_framebuffer(&fb, Width, Height) < 0) return 1;
+
+  renderer state;
+  make_renderer(&state, &fb);
+
+  int failures = 0;
+
+  if (set_fast_clear(&fb, path->fast_clear) < 0 ||
+      set_thread_count(&state, path->thread_count) < 0 ||
+      set_deferred_shading(&state, path->deferred) < 0) {
+    failures++;
+    goto done;
+  }
+
+  memset(copy, 0, sizeof(copy));
+
+  for (size_t i = 0; i < sizeof(views)/sizeof(*views); i++) {
+    draw_scene(&state, s, views[i]);
+    if (path->deferred && resolve_deferred(&state) < 0) failures++;
+
+    if (update_copy(&fb, copy) < 0) {
+      fprintf(stderr, "%s: rectangles read as other floats\n", path->name);
+      failures++;
+    }
+
+    failures += check_copy(path->name, &fb, copy);
+  }
+
+done:
+  release_renderer(&state);
+  framebuffer_release(&fb);
+
+  return failures;
+}
+
+/* Copies the dirty rectangles of the framebuffer into copy. */
+static int update_copy(framebuffer *fb, uint8_t *copy) {
+  static uint8_t pixels[Width*Height*4];
+  static float floats[Width*Height*3];
+  pixel_rect rects[TilesX*TilesY];
+
+  size_t n = framebuffer_dirty_rects(fb, rects, TilesX*TilesY);
+  framebuffer_read_rects(fb, n, rects, ColorRGBA, ColorTypeByte, pixels);
+  framebuffer_read_rects(fb, n, rects, ColorRGB, ColorTypeFloat, floats);
+
+  uint8_t *in = pixels;
+  float *in_floats = floats;
+  int result = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    for (size_t y = 0; y < rects[i].h; y++) {
+      size_t start = rects[i].x + (rects[i].y + y)*Width;
+      memcpy(&copy[start*4], in, rects[i].w*4);
+
+      /* Rectangles are read in other formats the same way. */
+      for (size_t x = 0; x < rects[i].w*4; x++) {
+        if (x % 4 != 3 && *in_floats++ != in[x] / 255.0f) result = -1;
+      }
+
+      in += rects[i].w*4;
+    }
+  }
+
+  framebuffer_acknowledge(fb);
+  return result;
+}
+
+static int check_copy(const char *name, const framebuffer *fb,
+                      const uint8_t *copy) {
+  static uint8_t pixels[Width*Height*4];
+  framebuffer_read(fb, 0, 0, Width, Height, ColorRGBA, ColorTypeByte, pixels);
+
+  for (size_t i = 0; i < Width*Height; i++) {
+    if (memcmp(&pixels[i*4], &copy[i*4], 4) != 0) {
+      fprintf(stderr, "%s: copy differs at (%zu, %zu)\n", name,
+              i % Width, i / Width);
+      return 1;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,181 @@
+#include "scene.h"
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Framebuffers with fast clears must read back, and draw, exactly like those
+ * whose clears write every pixel, whatever tiles are still pending.
+ */
+
+#define Width  200
+#define Height 150
+
+static const render_path paths[] = {
+  {"fast clear",         1, false, false, false, true},
+  {"fast clear threads", 4, false, false, false, true},
+};
+
+/* Reads are made of pending and drawn tiles, and cut some of them. */
+static const pixel_rect reads[] = {
+  {0, 0, Width, Height},
+  {30, 50, 100, 70},
+  {63, 63, 2, 2},
+  {150, 100, 50, 50},
+};
+
+/* Enough for all of the rectangles above. */
+#define ReadSize (2*Width*Height)
+
+typedef struct readback {
+  uint8_t bytes[ReadSize*4];
+  float floats[ReadSize*3];
+  float depths[ReadSize];
+} readback;
+
+static int check_clears(bool hierarchical_depth);
+static int run_clears(framebuffer *fb, bool hierarchical_depth,
+                      readback *out);
+static int draw_rect(renderer *state, float x0, float y0, float x1, float y1,
+                     float z, color c);
+static void read_all(const framebuffer *fb, readback *out, size_t n);
+
+int main(void) {
+  int failures = 0;
+
+  scene s;
+  if (make_scene(&s) < 0) {
+    fprintf(stderr, "could not make the scene\n");
+    return 1;
+  }
+
+  for (size_t i = 0; i < sizeof(paths)/sizeof(*paths); i++)
+    failures += check_path(&s, &paths[i]);
+
+  release_scene(&s);
+
+  failures += check_clears(false);
+  failures += check_clears(true);
+
+  if (failures == 0) printf("all checks passed\n");
+  return failures == 0 ? 0 : 1;
+}
+
+/*
+ * Clears tiles to different values between draws, and compares what reading
+ * them gives, then what is left once fast clears are turned off.
+ */
+static int check_clears(bool hierarchical_depth) {
+  static readback expected[2], got[2];
+  int failures = 0;
+
+  framebuffer fast, full;
+  if (make_framebuffer(&fast, Width, Height) < 0) return 1;
+  if (make_framebuffer(&full, Width, Height) < 0) {
+    framebuffer_release(&fast);
+    return 1;
+  }
+
+  if (set_fast_clear(&full, false) < 0 ||
+      run_clears(&full, hierarchical_depth, expected) < 0 ||
+      run_clears(&fast, hierarchical_depth, got) < 0) {
+    fprintf(stderr, "could not draw\n");
+    failures++;
+  }
+  else {
+    for (size_t i = 0; i < 2; i++) {
+      if (memcmp(&expected[i], &got[i], sizeof(got[i])) != 0) {
+        fprintf(stderr, "%s differs%s\n",
+                i == 0 ? "reading pending tiles" : "filling pending tiles",
+                hierarchical_depth ? " with hierarchical depth" : "");
+        failures++;
+      }
+    }
+  }
+
+  framebuffer_release(&fast);
+  framebuffer_release(&full);
+
+  return failures;
+}
+
+/*
+ * Reads the framebuffer into out[0] after clearing and drawing, and into
+ * out[1] after turning fast clears off and clearing part of it again.
+ */
+static int run_clears(framebuffer *fb, bool hierarchical_depth,
+                      readback *out) {
+  renderer state;
+  make_renderer(&state, fb);
+
+  int result = set_hierarchical_depth(fb, hierarchical_depth);
+
+  set_depth_test(&state, true);
+  set_mvp(&state, Mat4Identity, Mat4Identity, Mat4Identity);
+
+  clear_target_color(&state, (color){10, 20, 30, 40});
+  clear_target_depth(&state, 1);
+
+  if (draw_rect(&state, -0.9, -0.9, 0, 0.2, 0.5,
+                (color){255, 0, 0, 255}) < 0)
+    result = -1;
+
+  /* Only the color of the tiles drawn to is pending now. */
+  clear_target_color(&state, (color){200, 100, 50, 255});
+
+  if (draw_rect(&state, -0.3, -0.5, 0.8, 0.9, 0.7,
+                (color){0, 255, 0, 255}) < 0)
+    result = -1;
+
+  clear_target_depth(&state, 0.6f);
+
+  if (draw_rect(&state, 0.5, -1, 1, 0, 0.55,
+                (color){0, 0, 255, 128}) < 0)
+    result = -1;
+
+  read_all(fb, &out[0], sizeof(reads)/sizeof(*reads));
+
+  if (set_fast_clear(fb, false) < 0) result = -1;
+  clear_target_color(&state, (color){1, 2, 3, 4});
+
+  read_all(fb, &out[1], 1);
+
+  release_renderer(&state);
+  return result;
+}
+
+/* A rectangle of one color, in normalized device coordinates. */
+static int draw_rect(renderer *state, float x0, float y0, float x1, float y1,
+                     float z, color c) {
+  vertex rect[4] = {
+    {{x0, y0, z}, {0, 0, 1}, c, {0, 0}},
+    {{x1, y0, z}, {0, 0, 1}, c, {0, 0}},
+    {{x0, y1, z}, {0, 0, 1}, c, {0, 0}},
+    {{x1, y1, z}, {0, 0, 1}, c, {0, 0}},
+  };
+
+  vertex_array array;
+  if (make_vertex_array(&array, 4, rect) < 0) return -1;
+
+  int result = draw_array(state, DrawTriangleStrip, &array, 0, 4);
+
+  vertex_array_release(&array);
+  return result;
+}
+
+/* Reads the first n rectangles of reads, one after the other. */
+static void read_all(const framebuffer *fb, readback *out, size_t n) {
+  memset(out, 0, sizeof(*out));
+
+  size_t offset = 0;
+  for (size_t i = 0; i < n; i++) {
+    pixel_rect r = reads[i];
+
+    framebuffer_read(fb, r.x, r.y, r.w, r.h, ColorRGBA, ColorTypeByte,
+                     out->bytes + offset*4);
+    framebuffer_read(fb, r.x, r.y, r.w, r.h, ColorRGB, ColorTypeFloat,
+                     out->floats + offset*3);
+    depthbuffer_read(fb, r.x, r.y, r.w, r.h, out->depths + offset);
+
+    offset += r.w * r.h;
+  }
+}
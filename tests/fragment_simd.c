@@ -0,0 +1,107 @@
+#include "scene.h"
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * The AVX2 pipeline must shade exactly the pixels the scalar one does, with
+ * the same colors and depths, for every depth function and shading mode.
+ */
+
+static const render_path paths[] = {
+  {"simd",         1, true, false, false, false},
+  {"simd threads", 4, true, false, false, false},
+};
+
+static int render_plane(scene *s, bool simd, depth_func f, bool textured,
+                        image *out);
+
+int main(void) {
+  static const struct {
+    const char *name;
+    depth_func f;
+  } funcs[] = {
+    {"never", DepthTestNever}, {"always", DepthTestAlways},
+    {"EQ", DepthTestEQ}, {"LT", DepthTestLT}, {"LE", DepthTestLE},
+    {"GT", DepthTestGT}, {"GE", DepthTestGE},
+  };
+
+  static image reference, other;
+  int failures = 0;
+
+  if (!simd_supported()) {
+    printf("skipped, no AVX2\n");
+    return TestSkipped;
+  }
+
+  scene s;
+  if (make_scene(&s) < 0) {
+    fprintf(stderr, "could not make the scene\n");
+    return 1;
+  }
+
+  for (size_t i = 0; i < sizeof(paths)/sizeof(*paths); i++)
+    failures += check_path(&s, &paths[i]);
+
+  for (size_t i = 0; i < sizeof(funcs)/sizeof(*funcs); i++) {
+    for (int textured = 0; textured < 2; textured++) {
+      if (render_plane(&s, false, funcs[i].f, textured, &reference) < 0 ||
+          render_plane(&s, true, funcs[i].f, textured, &other) < 0 ||
+          memcmp(&reference, &other, sizeof(reference)) != 0) {
+        fprintf(stderr, "%s%s: differs\n", funcs[i].name,
+                textured ? ", textured" : "");
+        failures++;
+      }
+    }
+  }
+
+  release_scene(&s);
+
+  if (failures == 0) printf("all checks passed\n");
+  return failures == 0 ? 0 : 1;
+}
+
+/* Draws the scene, then an unlit plane that cuts through it. */
+static int render_plane(scene *s, bool simd, depth_func f, bool textured,
+                        image *out) {
+  vertex plane[4] = {
+    {{-1, -1, 0.95}, {0, 0, 1}, {255, 128, 255, 200}, {0, 0}},
+    {{ 1, -1, 0.995}, {0, 0, 1}, {128, 255, 0, 255}, {3, 0}},
+    {{-1,  1, 0.95}, {0, 0, 1}, {0, 128, 255, 255}, {0, 2}},
+    {{ 1,  1, 0.995}, {0, 0, 1}, {255, 255, 255, 100}, {3, 2}},
+  };
+
+  vertex_array array;
+  if (make_vertex_array(&array, 4, plane) < 0) return -1;
+
+  framebuffer fb;
+  if (make_framebuffer(&fb, SceneWidth, SceneHeight) < 0) {
+    vertex_array_release(&array);
+    return -1;
+  }
+
+  renderer state;
+  make_renderer(&state, &fb);
+
+  int result = set_fragment_simd(&state, simd);
+
+  if (result == 0) {
+    draw_scene(&state, s, 1);
+
+    set_lighting(&state, false);
+    use_texture(&state, textured ? &s->checker : NULL);
+    set_depth_func(&state, f);
+    set_mvp(&state, Mat4Identity, Mat4Identity, Mat4Identity);
+
+    result = draw_array(&state, DrawTriangleStrip, &array, 0, 4);
+
+    framebuffer_read(&fb, 0, 0, SceneWidth, SceneHeight,
+                     ColorRGBA, ColorTypeByte, out->pixels);
+    depthbuffer_read(&fb, 0, 0, SceneWidth, SceneHeight, out->depths);
+  }
+
+  release_renderer(&state);
+  framebuffer_release(&fb);
+  vertex_array_release(&array);
+
+  return result;
+}
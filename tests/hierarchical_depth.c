@@ -0,0 +1,139 @@
+#include "scene.h"
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Blocks skipped with the hierarchical depth buffer must be exactly the ones
+ * no fragment would have passed the depth test in, for every depth function,
+ * whether it was on from the start or turned on over a drawn image.
+ */
+
+typedef enum start {
+  StartOff,
+  StartOn,
+  StartAfterScene,
+} start;
+
+static const render_path paths[] = {
+  {"hierarchical depth",         1, false, false, true, false},
+  {"hierarchical depth threads", 4, false, false, true, false},
+};
+
+static int render_layers(scene *s, start hierarchical_depth, depth_func f,
+                         image *out, size_t *covered);
+
+int main(void) {
+  static const struct {
+    const char *name;
+    depth_func f;
+  } funcs[] = {
+    {"LT", DepthTestLT}, {"LE", DepthTestLE}, {"GT", DepthTestGT},
+    {"GE", DepthTestGE}, {"EQ", DepthTestEQ},
+  };
+
+  static image reference, other;
+  int failures = 0;
+
+  scene s;
+  if (make_scene(&s) < 0) {
+    fprintf(stderr, "could not make the scene\n");
+    return 1;
+  }
+
+  for (size_t i = 0; i < sizeof(paths)/sizeof(*paths); i++)
+    failures += check_path(&s, &paths[i]);
+
+  for (size_t i = 0; i < sizeof(funcs)/sizeof(*funcs); i++) {
+    size_t covered;
+    if (render_layers(&s, StartOff, funcs[i].f, &reference, &covered) < 0) {
+      fprintf(stderr, "%s: could not render\n", funcs[i].name);
+      failures++;
+      continue;
+    }
+
+    /* The plane must be both hidden and visible for this to check anything. */
+    if (funcs[i].f != DepthTestEQ &&
+        (covered == 0 || covered == SceneWidth*SceneHeight)) {
+      fprintf(stderr, "%s: plane covers %zu pixels\n", funcs[i].name, covered);
+      failures++;
+    }
+
+    for (start when = StartOn; when <= StartAfterScene; when++) {
+      if (render_layers(&s, when, funcs[i].f, &other, &covered) < 0 ||
+          memcmp(&reference, &other, sizeof(reference)) != 0) {
+        fprintf(stderr, "%s: differs with hierarchical depth %s\n",
+                funcs[i].name, when == StartOn ? "on" : "turned on");
+        failures++;
+      }
+    }
+  }
+
+  release_scene(&s);
+
+  if (failures == 0) printf("all checks passed\n");
+  return failures == 0 ? 0 : 1;
+}
+
+/*
+ * Draws the scene, then a plane that cuts through it with depth function f.
+ * Sets *covered to the number of pixels the plane was drawn to.
+ */
+static int render_layers(scene *s, start hierarchical_depth, depth_func f,
+                         image *out, size_t *covered) {
+  static const color plane_color = {255, 0, 255, 255};
+
+  vertex plane[4] = {
+    {{-1, -1, 0.95}, {0, 0, 1}, plane_color, {0, 0}},
+    {{ 1, -1, 0.995}, {0, 0, 1}, plane_color, {0, 0}},
+    {{-1,  1, 0.95}, {0, 0, 1}, plane_color, {0, 0}},
+    {{ 1,  1, 0.995}, {0, 0, 1}, plane_color, {0, 0}},
+  };
+
+  vertex_array array;
+  if (make_vertex_array(&array, 4, plane) < 0) return -1;
+
+  framebuffer fb;
+  if (make_framebuffer(&fb, SceneWidth, SceneHeight) < 0) {
+    vertex_array_release(&array);
+    return -1;
+  }
+
+  renderer state;
+  make_renderer(&state, &fb);
+
+  int result = 0;
+
+  if (hierarchical_depth == StartOn)
+    result = set_hierarchical_depth(&fb, true);
+
+  if (result == 0) {
+    draw_scene(&state, s, 0);
+
+    if (hierarchical_depth == StartAfterScene)
+      result = set_hierarchical_depth(&fb, true);
+  }
+
+  if (result == 0) {
+    set_lighting(&state, false);
+    use_texture(&state, NULL);
+    set_depth_func(&state, f);
+    set_mvp(&state, Mat4Identity, Mat4Identity, Mat4Identity);
+
+    result = draw_array(&state, DrawTriangleStrip, &array, 0, 4);
+
+    framebuffer_read(&fb, 0, 0, SceneWidth, SceneHeight,
+                     ColorRGBA, ColorTypeByte, out->pixels);
+    depthbuffer_read(&fb, 0, 0, SceneWidth, SceneHeight, out->depths);
+  }
+
+  *covered = 0;
+  for (size_t i = 0; i < SceneWidth*SceneHeight; i++) {
+    if (memcmp(&out->pixels[i*4], &plane_color, 4) == 0) (*covered)++;
+  }
+
+  release_renderer(&state);
+  framebuffer_release(&fb);
+  vertex_array_release(&array);
+
+  return result;
+}
@@ -0,0 +1,224 @@
+#include "scene.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Mip levels kept up to date by texture_write must be those generate_mipmaps
+ * builds from the same pixels, and minified textures must sample them.
+ */
+
+#define Size 32
+
+static const struct {
+  color_format format;
+  const char *name;
+} formats[] = {
+  {ColorRGBA, "RGBA"},
+  {ColorBC1,  "BC1"},
+  {ColorBC3,  "BC3"},
+};
+
+static const size_t sizes[][2] = {{64, 64}, {37, 23}, {5, 9}, {1, 17}};
+
+static int check_writes(color_format format, const char *name,
+                        size_t w, size_t h);
+static int check_minified(void);
+
+static int make_texture(texture *tex, color_format format, size_t w, size_t h,
+                        const uint8_t *pixels);
+static void fill_random(uint8_t *pixels, size_t n);
+static int sample(texture *tex, float scale, color *out);
+
+int main(void) {
+  int failures = 0;
+
+  srand(1);
+
+  for (size_t f = 0; f < sizeof(formats)/sizeof(*formats); f++) {
+    for (size_t i = 0; i < sizeof(sizes)/sizeof(*sizes); i++) {
+      failures += check_writes(formats[f].format, formats[f].name,
+                               sizes[i][0], sizes[i][1]);
+    }
+  }
+
+  failures += check_minified();
+
+  if (failures == 0) printf("all checks passed\n");
+  return failures == 0 ? 0 : 1;
+}
+
+/*
+ * Writes rectangles into one texture, and builds the mip chain of another one
+ * again after each of them. Both must sample alike at every level.
+ */
+static int check_writes(color_format format, const char *name,
+                        size_t w, size_t h) {
+  uint8_t *pixels = malloc(w*h*4);
+  if (!pixels) return 1;
+
+  fill_random(pixels, w*h*4);
+
+  texture written, built;
+  if (make_texture(&written, format, w, h, pixels) < 0) {
+    free(pixels);
+    return 1;
+  }
+
+  if (make_texture(&built, format, w, h, pixels) < 0) {
+    release_texture(&written);
+    free(pixels);
+    return 1;
+  }
+
+  static color a[Size*Size], b[Size*Size];
+  int failures = 0;
+
+  generate_mipmaps(&written);
+  generate_mipmaps(&built);
+
+  for (int i = 0; i < 20 && failures == 0; i++) {
+    /* Compressed textures are written in whole blocks. */
+    size_t align = format == ColorRGBA ? 1 : 4;
+    size_t x = rand() % w / align * align, y = rand() % h / align * align;
+    size_t rw = 1 + rand() % (w - x), rh = 1 + rand() % (h - y);
+
+    fill_random(pixels, rw*rh*4);
+
+    if (texture_write(&written, x, y, rw, rh, ColorRGBA, ColorTypeByte,
+                      pixels) < 0 ||
+        texture_write(&built, x, y, rw, rh, ColorRGBA, ColorTypeByte,
+                      pixels) < 0 ||
+        generate_mipmaps(&built) < 0) {
+      fprintf(stderr, "%s %zux%zu: could not write %zux%zu at %zu, %zu\n",
+              name, w, h, rw, rh, x, y);
+      failures++;
+      break;
+    }
+
+    for (float scale = 1; scale <= 64; scale *= 2) {
+      if (sample(&written, scale, a) < 0 || sample(&built, scale, b) < 0 ||
+          memcmp(a, b, sizeof(a)) != 0) {
+        fprintf(stderr, "%s %zux%zu: levels differ at scale %g after "
+                "writing %zux%zu at %zu, %zu\n",
+                name, w, h, scale, rw, rh, x, y);
+        failures++;
+        break;
+      }
+    }
+  }
+
+  release_texture(&written);
+  release_texture(&built);
+  free(pixels);
+
+  return failures;
+}
+
+/*
+ * A checker of single texels, drawn four times smaller, averages to grey
+ * once it has mipmaps.
+ */
+static int check_minified(void) {
+  enum { TexSize = Size*4 };
+  static uint8_t pixels[TexSize*TexSize*4];
+  static color out[Size*Size];
+
+  fill_checker(pixels, TexSize, TexSize, 1,
+               (color){0, 0, 0, 255}, (color){255, 255, 255, 255});
+
+  texture tex;
+  if (load_texture(&tex, TexSize, TexSize, ColorRGBA, ColorTypeByte,
+                   pixels) < 0)
+    return 1;
+
+  int failures = 0;
+
+  if (has_mipmaps(&tex) || generate_mipmaps(&tex) < 0 || !has_mipmaps(&tex)) {
+    fprintf(stderr, "minified: mipmaps not built\n");
+    failures++;
+  }
+  else if (sample(&tex, 1, out) < 0) {
+    failures++;
+  }
+  else {
+    for (size_t i = 0; i < Size*Size; i++) {
+      if (out[i].r < 120 || out[i].r > 136) {
+        fprintf(stderr, "minified: %d at %zu, %zu instead of grey\n",
+                out[i].r, i % Size, i / Size);
+        failures++;
+        break;
+      }
+    }
+  }
+
+  release_texture(&tex);
+  return failures;
+}
+
+/* Loads pixels, into a texture compressed in format unless it is RGBA. */
+static int make_texture(texture *tex, color_format format, size_t w, size_t h,
+                        const uint8_t *pixels) {
+  if (format == ColorRGBA)
+    return load_texture(tex, w, h, format, ColorTypeByte, pixels);
+
+  uint8_t *blocks = calloc((w + 3)/4 * ((h + 3)/4), 16);
+  if (!blocks) return -1;
+
+  int result = load_texture(tex, w, h, format, ColorTypeByte, blocks);
+  free(blocks);
+
+  if (result == 0 &&
+      texture_write(tex, 0, 0, w, h, ColorRGBA, ColorTypeByte, pixels) < 0) {
+    release_texture(tex);
+    return -1;
+  }
+
+  return result;
+}
+
+static void fill_random(uint8_t *pixels, size_t n) {
+  for (size_t i = 0; i < n; i++) pixels[i] = rand();
+}
+
+/*
+ * Draws tex over the whole framebuffer with trilinear filtering, repeated
+ * scale times in each direction, which picks level log2(scale*w/Size).
+ */
+static int sample(texture *tex, float scale, color *out) {
+  vertex quad[4] = {
+    {{-1, -1, 0}, {0, 0, 1}, {255, 255, 255, 255}, {0, 0}},
+    {{ 1, -1, 0}, {0, 0, 1}, {255, 255, 255, 255}, {scale, 0}},
+    {{-1,  1, 0}, {0, 0, 1}, {255, 255, 255, 255}, {0, scale}},
+    {{ 1,  1, 0}, {0, 0, 1}, {255, 255, 255, 255}, {scale, scale}},
+  };
+
+  vertex_array array;
+  if (make_vertex_array(&array, 4, quad) < 0) return -1;
+
+  framebuffer fb;
+  if (make_framebuffer(&fb, Size, Size) < 0) {
+    vertex_array_release(&array);
+    return -1;
+  }
+
+  renderer state;
+  make_renderer(&state, &fb);
+
+  set_texture_filter(tex, FilterTrilinear);
+  set_texture_wrap(tex, WrapRepeat);
+
+  use_texture(&state, tex);
+  set_mvp(&state, Mat4Identity, Mat4Identity, Mat4Identity);
+
+  clear_target_color(&state, (color){0, 0, 0, 255});
+  int result = draw_array(&state, DrawTriangleStrip, &array, 0, 4);
+
+  framebuffer_read(&fb, 0, 0, Size, Size, ColorRGBA, ColorTypeByte, out);
+
+  release_renderer(&state);
+  framebuffer_release(&fb);
+  vertex_array_release(&array);
+
+  return result;
+}
@@ -0,0 +1,36 @@
+#include "scene.h"
+#include <stdio.h>
+
+/*
+ * Draws the scene along every rendering path, and checks that each one gives
+ * exactly the image of the scalar, single-threaded path.
+ */
+
+static const render_path paths[] = {
+  {"threads",            4, false, false, false, false},
+  {"everything",         4, true,  true,  true,  true},
+};
+
+int main(void) {
+  int failures = 0;
+
+  scene s;
+  if (make_scene(&s) < 0) {
+    fprintf(stderr, "could not make the scene\n");
+    return 1;
+  }
+
+  bool simd = simd_supported();
+
+  for (size_t i = 0; i < sizeof(paths)/sizeof(*paths); i++) {
+    if (paths[i].fragment_simd && !simd)
+      printf("%s: skipped, no AVX2\n", paths[i].name);
+    else
+      failures += check_path(&s, &paths[i]);
+  }
+
+  release_scene(&s);
+
+  if (failures == 0) printf("all checks passed\n");
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,201 @@
+#include "scene.h"
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Frames submitted synchronously or through the queue must come out as if
+ * they had been drawn directly, each into its own target, and their fences
+ * must be signaled once they are drawn.
+ */
+
+static int check_sync(scene *s);
+static int check_async(scene *s, size_t thread_count, bool deferred);
+
+static int check_target(const char *name, framebuffer *fb,
+                        const image *expected);
+
+static image references[SceneViewCount];
+
+int main(void) {
+  static const render_path scalar = {"scalar", 1, false, false, false, false};
+  int failures = 0;
+
+  scene s;
+  if (make_scene(&s) < 0) {
+    fprintf(stderr, "could not make the scene\n");
+    return 1;
+  }
+
+  for (int view = 0; view < SceneViewCount; view++) {
+    if (render_scene(&scalar, &s, view, &references[view]) < 0) {
+      fprintf(stderr, "could not render view %d\n", view);
+      release_scene(&s);
+      return 1;
+    }
+  }
+
+  failures += check_sync(&s);
+
+  for (size_t threads = 1; threads <= 4; threads += 3) {
+    failures += check_async(&s, threads, false);
+    failures += check_async(&s, threads, true);
+  }
+
+  release_scene(&s);
+
+  if (failures == 0) printf("all checks passed\n");
+  return failures == 0 ? 0 : 1;
+}
+
+/* Without the queue, frames are drawn before submit_frame returns. */
+static int check_sync(scene *s) {
+  framebuffer fb;
+  if (make_framebuffer(&fb, SceneWidth, SceneHeight) < 0) return 1;
+
+  renderer state;
+  make_renderer(&state, NULL);
+
+  command_buffer commands;
+  make_command_buffer(&commands);
+
+  int failures = 0;
+
+  if (record_scene(&commands, &state, s, 0) < 0) failures++;
+
+  frame_request request = {
+    &fb, true, {0, 0, 3, 255}, true, 1, &commands, false,
+  };
+
+  fence f = submit_frame(&state, &request);
+
+  if (f != 1 || !fence_signaled(&state, f) || fence_wait(&state, f) < 0) {
+    fprintf(stderr, "sync: frame not drawn when submitted\n");
+    failures++;
+  }
+
+  if (current_target(&state) != &fb) {
+    fprintf(stderr, "sync: target not left bound\n");
+    failures++;
+  }
+
+  failures += check_target("sync", &fb, &references[0]);
+
+  command_buffer_release(&commands);
+  release_renderer(&state);
+  framebuffer_release(&fb);
+
+  return failures;
+}
+
+/*
+ * Queues a frame of every view, each into its own target, and changes the
+ * settings of the renderer while they are drawn. Once the queue is turned
+ * off, the renderer draws on as many threads as before.
+ */
+static int check_async(scene *s, size_t thread_count, bool deferred) {
+  framebuffer targets[SceneViewCount];
+  command_buffer commands[SceneViewCount];
+  fence fences[SceneViewCount];
+
+  int failures = 0;
+  size_t target_count = 0;
+
+  for (; target_count < SceneViewCount; target_count++) {
+    if (make_framebuffer(&targets[target_count], SceneWidth,
+                         SceneHeight) < 0)
+      break;
+
+    make_command_buffer(&commands[target_count]);
+  }
+
+  renderer state;
+  make_renderer(&state, &targets[0]);
+
+  char name[64];
+  snprintf(name, sizeof(name), "async, %zu threads%s", thread_count,
+           deferred ? ", deferred" : "");
+
+  if (target_count != SceneViewCount ||
+      set_thread_count(&state, thread_count) < 0 ||
+      set_deferred_shading(&state, deferred) < 0 ||
+      set_async_submission(&state, true) < 0) {
+    fprintf(stderr, "%s: could not start\n", name);
+    failures++;
+    goto done;
+  }
+
+  for (int view = 0; view < SceneViewCount; view++) {
+    if (record_scene(&commands[view], &state, s, view) < 0) failures++;
+
+    frame_request request = {
+      &targets[view], true, {0, 0, 3, 255}, true, 1, &commands[view],
+      view % 2 == 1,
+    };
+
+    fences[view] = submit_frame(&state, &request);
+    if (fences[view] != (fence)view + 1) {
+      fprintf(stderr, "%s: frame %d got fence %llu\n", name, view,
+              (unsigned long long)fences[view]);
+      failures++;
+    }
+
+    /* Frames already queued keep the settings they were submitted with. */
+    set_lights(&state, 0, NULL);
+    set_deferred_shading(&state, !deferred);
+    set_thread_count(&state, thread_count + 1);
+    set_thread_count(&state, thread_count);
+  }
+
+  if (fence_wait(&state, fences[SceneViewCount-1]) < 0) {
+    fprintf(stderr, "%s: frames could not be drawn\n", name);
+    failures++;
+  }
+
+  for (int view = 0; view < SceneViewCount; view++) {
+    if (!fence_signaled(&state, fences[view])) {
+      fprintf(stderr, "%s: fence %d not signaled\n", name, view);
+      failures++;
+    }
+
+    failures += check_target(name, &targets[view], &references[view]);
+  }
+
+  if (set_async_submission(&state, false) < 0 ||
+      get_thread_count(&state) != thread_count ||
+      (state.pool != NULL) != (thread_count > 1)) {
+    fprintf(stderr, "%s: threads not given back\n", name);
+    failures++;
+  }
+
+  set_deferred_shading(&state, false);
+  set_target(&state, &targets[0]);
+  draw_scene(&state, s, 1);
+
+  failures += check_target(name, &targets[0], &references[1]);
+
+done:
+  release_renderer(&state);
+
+  for (size_t i = 0; i < target_count; i++) {
+    command_buffer_release(&commands[i]);
+    framebuffer_release(&targets[i]);
+  }
+
+  return failures;
+}
+
+static int check_target(const char *name, framebuffer *fb,
+                        const image *expected) {
+  static image got;
+
+  framebuffer_read(fb, 0, 0, SceneWidth, SceneHeight,
+                   ColorRGBA, ColorTypeByte, got.pixels);
+  depthbuffer_read(fb, 0, 0, SceneWidth, SceneHeight, got.depths);
+
+  if (memcmp(expected, &got, sizeof(got)) != 0) {
+    fprintf(stderr, "%s: frame differs\n", name);
+    return 1;
+  }
+
+  return 0;
+}
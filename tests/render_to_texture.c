@@ -0,0 +1,207 @@
+#include "scene.h"
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Textures over memory of the caller, or over the color buffer of a
+ * framebuffer, must sample exactly like textures loaded from the same pixels,
+ * and see the pixels change without being loaded again.
+ */
+
+#define Size 96
+
+/* Texels of the caller's texture, with rows padded. */
+#define TexSize   40
+#define TexStride (TexSize + 3)
+
+static int check_wrapped(void);
+static int check_framebuffer(scene *s, bool padded);
+
+static int sample(texture *tex, texture_filter filter, color *out);
+static int check_same(const char *name, texture *tex, texture *expected);
+
+int main(void) {
+  int failures = 0;
+
+  failures += check_wrapped();
+
+  scene s;
+  if (make_scene(&s) < 0) {
+    fprintf(stderr, "could not make the scene\n");
+    return 1;
+  }
+
+  failures += check_framebuffer(&s, false);
+  failures += check_framebuffer(&s, true);
+
+  release_scene(&s);
+
+  if (failures == 0) printf("all checks passed\n");
+  return failures == 0 ? 0 : 1;
+}
+
+static int check_wrapped(void) {
+  static color pixels[TexStride*TexSize];
+  static color packed[TexSize*TexSize];
+  int failures = 0;
+
+  for (size_t y = 0; y < TexSize; y++) {
+    for (size_t x = 0; x < TexStride; x++) {
+      pixels[x + y*TexStride] = x < TexSize ?
+        (color){x*6, y*6, (x ^ y)*4, 255} : (color){255, 0, 255, 255};
+    }
+  }
+
+  texture wrapped;
+  if (wrap_texture(&wrapped, TexSize, TexSize, pixels, sizeof(color)) == 0) {
+    fprintf(stderr, "stride shorter than a row accepted\n");
+    failures++;
+  }
+
+  if (wrap_texture(&wrapped, TexSize, TexSize, pixels,
+                   TexStride*sizeof(color)) < 0)
+    return failures + 1;
+
+  for (int change = 0; change < 2; change++) {
+    /* Changes to the pixels of the caller are seen without any call. */
+    if (change) {
+      for (size_t y = 10; y < 20; y++) {
+        for (size_t x = 5; x < 30; x++)
+          pixels[x + y*TexStride] = (color){0, 200, 100, 255};
+      }
+    }
+
+    for (size_t y = 0; y < TexSize; y++)
+      memcpy(&packed[y*TexSize], &pixels[y*TexStride], TexSize*sizeof(color));
+
+    texture loaded;
+    if (load_texture(&loaded, TexSize, TexSize, ColorRGBA, ColorTypeByte,
+                     packed) < 0) {
+      failures++;
+      break;
+    }
+
+    failures += check_same(change ? "changed pixels" : "caller's pixels",
+                           &wrapped, &loaded);
+    release_texture(&loaded);
+  }
+
+  release_texture(&wrapped);
+  return failures;
+}
+
+/*
+ * Draws the scene into a framebuffer, and samples it. Drawing another view
+ * into it changes what the texture samples.
+ */
+static int check_framebuffer(scene *s, bool padded) {
+  static color memory[(SceneWidth + 5)*SceneHeight];
+  static uint8_t pixels[SceneWidth*SceneHeight*4];
+
+  framebuffer fb;
+  int result = padded ?
+    wrap_framebuffer(&fb, SceneWidth, SceneHeight, memory,
+                     (SceneWidth + 5)*sizeof(color)) :
+    make_framebuffer(&fb, SceneWidth, SceneHeight);
+  if (result < 0) return 1;
+
+  renderer state;
+  make_renderer(&state, &fb);
+
+  texture tex;
+  int failures = 0;
+
+  if (texture_from_framebuffer(&tex, &fb) < 0) {
+    failures++;
+    goto done;
+  }
+
+  if (get_fast_clear(&fb)) {
+    fprintf(stderr, "framebuffer texture left fast clears on\n");
+    failures++;
+  }
+
+  for (int view = 0; view < 2; view++) {
+    draw_scene(&state, s, view);
+
+    framebuffer_read(&fb, 0, 0, SceneWidth, SceneHeight,
+                     ColorRGBA, ColorTypeByte, pixels);
+
+    texture loaded;
+    if (load_texture(&loaded, SceneWidth, SceneHeight, ColorRGBA,
+                     ColorTypeByte, pixels) < 0) {
+      failures++;
+      break;
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "%sframebuffer, view %d",
+             padded ? "padded " : "", view);
+
+    failures += check_same(name, &tex, &loaded);
+    release_texture(&loaded);
+  }
+
+  release_texture(&tex);
+
+done:
+  release_renderer(&state);
+  framebuffer_release(&fb);
+
+  return failures;
+}
+
+/* Draws a quad textured with tex, repeated and at an angle. */
+static int sample(texture *tex, texture_filter filter, color *out) {
+  vertex quad[4] = {
+    {{-1, -1, 0}, {0, 0, 1}, {255, 255, 255, 255}, {-0.3, -0.2}},
+    {{ 1, -0.8, 0}, {0, 0, 1}, {255, 255, 255, 255}, {1.7, -0.1}},
+    {{-0.9, 1, 0}, {0, 0, 1}, {255, 255, 255, 255}, {0.1, 1.4}},
+    {{ 1,  1, 0}, {0, 0, 1}, {255, 255, 255, 255}, {1.2, 1.1}},
+  };
+
+  vertex_array array;
+  if (make_vertex_array(&array, 4, quad) < 0) return -1;
+
+  framebuffer fb;
+  if (make_framebuffer(&fb, Size, Size) < 0) {
+    vertex_array_release(&array);
+    return -1;
+  }
+
+  renderer state;
+  make_renderer(&state, &fb);
+
+  set_texture_filter(tex, filter);
+  set_texture_wrap(tex, WrapRepeat);
+
+  use_texture(&state, tex);
+  set_mvp(&state, Mat4Identity, Mat4Identity, Mat4Identity);
+
+  clear_target_color(&state, (color){0, 0, 0, 255});
+  int result = draw_array(&state, DrawTriangleStrip, &array, 0, 4);
+
+  framebuffer_read(&fb, 0, 0, Size, Size, ColorRGBA, ColorTypeByte, out);
+
+  release_renderer(&state);
+  framebuffer_release(&fb);
+  vertex_array_release(&array);
+
+  return result;
+}
+
+static int check_same(const char *name, texture *tex, texture *expected) {
+  static color a[Size*Size], b[Size*Size];
+  int failures = 0;
+
+  for (int filter = FilterNearest; filter <= FilterBilinear; filter++) {
+    if (sample(expected, filter, a) < 0 || sample(tex, filter, b) < 0 ||
+        memcmp(a, b, sizeof(a)) != 0) {
+      fprintf(stderr, "%s: sampled differently%s\n", name,
+              filter == FilterBilinear ? ", bilinear" : "");
+      failures++;
+    }
+  }
+
+  return failures;
+}
@@ -0,0 +1,260 @@
+#include "scene.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+/* Rings and segments of the sphere. */
+#define SphereRings    24
+#define SphereSegments 24
+
+static const render_path scalar = {"scalar", 1, false, false, false, false};
+
+static int scene_draws(renderer *state, scene *s, int view,
+                       command_buffer *commands);
+static int draw_indexed(renderer *state, command_buffer *commands,
+                        index_array *indices, vertex_array *array, size_t n);
+static int draw_strip(renderer *state, command_buffer *commands,
+                      vertex_array *array);
+
+int make_scene(scene *s) {
+  vertex sphere[SphereRings*SphereSegments];
+  uint32_t indices[(SphereRings-1)*(SphereSegments-1)*6];
+
+  for (size_t i = 0; i < SphereRings; i++) {
+    for (size_t j = 0; j < SphereSegments; j++) {
+      float theta = Pi*i/(SphereRings-1), phi = 2*Pi*j/(SphereSegments-1);
+      vector3 p = {cosf(phi)*sinf(theta), -cosf(theta), sinf(phi)*sinf(theta)};
+
+      sphere[j + i*SphereSegments] = (vertex){
+        p, p, {40, (uint8_t)(j*10), 128, 255},
+        {(float)j/(SphereSegments-1), (float)i/(SphereRings-1)},
+      };
+    }
+  }
+
+  size_t n = 0;
+  for (size_t i = 0; i + 1 < SphereRings; i++) {
+    for (size_t j = 0; j + 1 < SphereSegments; j++) {
+      uint32_t a = j + i*SphereSegments, b = a + 1;
+      uint32_t c = a + SphereSegments, d = c + 1;
+
+      indices[n++] = a; indices[n++] = c; indices[n++] = b;
+      indices[n++] = b; indices[n++] = c; indices[n++] = d;
+    }
+  }
+
+  s->sphere_index_count = n;
+
+  vertex floor[4] = {
+    {{-4, -1, -4}, {0, 1, 0}, {255, 255, 255, 255}, {0, 0}},
+    {{ 4, -1, -4}, {0, 1, 0}, {255, 255, 255, 255}, {6, 0}},
+    {{-4, -1,  4}, {0, 1, 0}, {255, 255, 255, 255}, {0, 6}},
+    {{ 4, -1,  4}, {0, 1, 0}, {255, 255, 255, 255}, {6, 6}},
+  };
+
+  vertex wall[4] = {
+    {{-3, -1, -2}, {0, 0, 1}, {255, 255, 255, 255}, {0, 0}},
+    {{ 3, -1, -2}, {0, 0, 1}, {255, 255, 255, 255}, {2, 0}},
+    {{-3,  2, -2}, {0, 0, 1}, {255, 255, 255, 255}, {0, 1}},
+    {{ 3,  2, -2}, {0, 0, 1}, {255, 255, 255, 255}, {2, 1}},
+  };
+
+  uint8_t pixels[64*64*4];
+  fill_checker(pixels, 64, 64, 8,
+               (color){250, 200, 40, 255}, (color){30, 60, 160, 255});
+
+  /* Texels also vary within cells, so that filtering shows. */
+  for (size_t i = 0; i < 64*64; i++)
+    pixels[i*4 + 2] += i % 64;
+
+  if (make_vertex_array(&s->sphere, SphereRings*SphereSegments, sphere) < 0 ||
+      make_index_array(&s->sphere_indices, n, indices) < 0 ||
+      make_vertex_array(&s->floor, 4, floor) < 0 ||
+      make_vertex_array(&s->wall, 4, wall) < 0)
+    return -1;
+
+  if (load_texture(&s->checker, 64, 64, ColorRGBA, ColorTypeByte, pixels) < 0)
+    return -1;
+
+  if (generate_mipmaps(&s->checker) < 0) return -1;
+  set_texture_filter(&s->checker, FilterTrilinear);
+  set_texture_wrap(&s->checker, WrapRepeat);
+
+  uint8_t blocks[16*16*8] = {0};
+  if (load_texture(&s->compressed, 64, 64, ColorBC1, ColorTypeByte,
+                   blocks) < 0)
+    return -1;
+
+  texture_write(&s->compressed, 0, 0, 64, 64, ColorRGBA, ColorTypeByte,
+                pixels);
+  set_texture_filter(&s->compressed, FilterBilinear);
+  set_texture_wrap(&s->compressed, WrapClamp);
+
+  return 0;
+}
+
+void release_scene(scene *s) {
+  vertex_array_release(&s->sphere);
+  index_array_release(&s->sphere_indices);
+  vertex_array_release(&s->floor);
+  vertex_array_release(&s->wall);
+
+  release_texture(&s->checker);
+  release_texture(&s->compressed);
+}
+
+void draw_scene(renderer *state, scene *s, int view) {
+  clear_target_color(state, (color){0, 0, 3, 255});
+  clear_target_depth(state, 1);
+
+  scene_draws(state, s, view, NULL);
+}
+
+int record_scene(command_buffer *commands, renderer *state, scene *s,
+                 int view) {
+  return scene_draws(state, s, view, commands);
+}
+
+/* Draws the scene, or records it into commands if not NULL. */
+static int scene_draws(renderer *state, scene *s, int view,
+                       command_buffer *commands) {
+  static const vector3 eyes[SceneViewCount] = {
+    {5, 5, 5}, {0.5, 0.3, 3.2}, {2.5, 0.2, 0.5},
+  };
+
+  mat4 look = mat4_look_at(eyes[view], (vector3){0, 0, 0},
+                           (vector3){0, 1, 0});
+  mat4 projection = mat4_perspective(Pi/4, (float)SceneWidth/SceneHeight,
+                                     0.1, 100);
+
+  light l = {
+    {10, 10, 10},
+    {60, 60, 60, 255}, {200, 200, 200, 255}, {0, 150, 0, 255},
+  };
+
+  use_material(state, (material){
+    {255, 255, 255, 255}, {255, 255, 255, 255}, {255, 255, 255, 255}, 30,
+  });
+  set_lighting(state, true);
+  if (set_lights(state, 1, &l) < 0) return -1;
+
+  set_depth_test(state, true);
+  set_culling(state, true);
+
+  size_t n = s->sphere_index_count;
+  int result = 0;
+
+  use_texture(state, NULL);
+  set_mvp(state, mat4_scale((vector3){1.5, 1.5, 1.5}), look, projection);
+  result |= draw_indexed(state, commands, &s->sphere_indices, &s->sphere, n);
+
+  set_mvp(state, mat4_translate((vector3){2, 0, -1}), look, projection);
+  result |= draw_indexed(state, commands, &s->sphere_indices, &s->sphere, n);
+
+  set_culling(state, false);
+  set_mvp(state, Mat4Identity, look, projection);
+
+  use_texture(state, &s->checker);
+  result |= draw_strip(state, commands, &s->floor);
+
+  use_texture(state, &s->compressed);
+  result |= draw_strip(state, commands, &s->wall);
+
+  return result;
+}
+
+static int draw_indexed(renderer *state, command_buffer *commands,
+                        index_array *indices, vertex_array *array, size_t n) {
+  if (commands) {
+    return record_draw_elements(commands, state, DrawTriangles, indices,
+                                array, 0, n);
+  }
+  else
+    return draw_elements(state, DrawTriangles, indices, array, 0, n);
+}
+
+static int draw_strip(renderer *state, command_buffer *commands,
+                      vertex_array *array) {
+  if (commands)
+    return record_draw_array(commands, state, DrawTriangleStrip, array, 0, 4);
+  else
+    return draw_array(state, DrawTriangleStrip, array, 0, 4);
+}
+
+int render_scene(const render_path *path, scene *s, int view, image *out) {
+  framebuffer fb;
+  if (make_framebuffer(&fb, SceneWidth, SceneHeight) < 0) return -1;
+
+  renderer state;
+  make_renderer(&state, &fb);
+
+  int result = 0;
+
+  if (set_fast_clear(&fb, path->fast_clear) < 0 ||
+      set_hierarchical_depth(&fb, path->hierarchical_depth) < 0 ||
+      set_thread_count(&state, path->thread_count) < 0 ||
+      set_fragment_simd(&state, path->fragment_simd) < 0 ||
+      set_deferred_shading(&state, path->deferred) < 0)
+    result = -1;
+
+  if (result == 0) {
+    draw_scene(&state, s, view);
+
+    if (path->deferred) result = resolve_deferred(&state);
+
+    framebuffer_read(&fb, 0, 0, SceneWidth, SceneHeight,
+                     ColorRGBA, ColorTypeByte, out->pixels);
+    depthbuffer_read(&fb, 0, 0, SceneWidth, SceneHeight, out->depths);
+  }
+
+  release_renderer(&state);
+  framebuffer_release(&fb);
+
+  return result;
+}
+
+int check_path(scene *s, const render_path *path) {
+  static image reference, other;
+  int failures = 0;
+
+  for (int view = 0; view < SceneViewCount; view++) {
+    if (render_scene(&scalar, s, view, &reference) < 0 ||
+        render_scene(path, s, view, &other) < 0) {
+      fprintf(stderr, "%s: could not render view %d\n", path->name, view);
+      failures++;
+      continue;
+    }
+
+    for (size_t p = 0; p < SceneWidth*SceneHeight; p++) {
+      if (memcmp(&reference.pixels[p*4], &other.pixels[p*4], 4) != 0 ||
+          reference.depths[p] != other.depths[p]) {
+        fprintf(stderr, "%s: view %d differs at (%zu, %zu)\n",
+                path->name, view, p % SceneWidth, p / SceneWidth);
+        failures++;
+        break;
+      }
+    }
+  }
+
+  return failures;
+}
+
+bool simd_supported(void) {
+  renderer state;
+  make_renderer(&state, NULL);
+
+  bool supported = set_fragment_simd(&state, true) == 0;
+
+  release_renderer(&state);
+  return supported;
+}
+
+void fill_checker(uint8_t *pixels, size_t w, size_t h, size_t cell,
+                  color a, color b) {
+  for (size_t y = 0; y < h; y++) {
+    for (size_t x = 0; x < w; x++) {
+      color c = (x/cell + y/cell) % 2 ? a : b;
+      memcpy(&pixels[(x + y*w)*4], &c, 4);
+    }
+  }
+}
@@ -0,0 +1,78 @@
+#ifndef SCENE_H_
+#define SCENE_H_
+
+#include "rasterizer.h"
+
+/*
+ * A scene the tests draw along the different rendering paths, to check that
+ * each one gives exactly the image of the scalar, single-threaded path.
+ */
+
+#define Pi 3.14159265358979323846f
+
+#define SceneWidth  200
+#define SceneHeight 150
+
+#define SceneViewCount 3
+
+/* Exit status of tests that cannot run on this machine. */
+#define TestSkipped 77
+
+typedef struct render_path {
+  const char *name;
+  size_t thread_count;
+  bool fragment_simd;
+  bool deferred;
+  bool hierarchical_depth;
+  bool fast_clear;
+} render_path;
+
+typedef struct scene {
+  vertex_array sphere;
+  index_array sphere_indices;
+  size_t sphere_index_count;
+
+  vertex_array floor;
+  vertex_array wall;
+
+  texture checker;
+  texture compressed;
+} scene;
+
+typedef struct image {
+  uint8_t pixels[SceneWidth*SceneHeight*4];
+  float depths[SceneWidth*SceneHeight];
+} image;
+
+int make_scene(scene *s);
+void release_scene(scene *s);
+
+/*
+ * Two spheres, lit and untextured, over a mipmapped floor and a compressed
+ * wall, seen from one of the views.
+ */
+void draw_scene(renderer *state, scene *s, int view);
+
+/*
+ * Records the draws of the scene, without clearing. Changes the state of the
+ * renderer like draw_scene.
+ */
+int record_scene(command_buffer *commands, renderer *state, scene *s,
+                 int view);
+
+int render_scene(const render_path *path, scene *s, int view, image *out);
+
+/*
+ * Compares every view rendered along path with the scalar path. Returns the
+ * number of views that differ.
+ */
+int check_path(scene *s, const render_path *path);
+
+/* Fragments are only shaded with AVX2 on CPUs that have it. */
+bool simd_supported(void);
+
+/* Fills RGBA bytes with squares of cell pixels, alternating a and b. */
+void fill_checker(uint8_t *pixels, size_t w, size_t h, size_t cell,
+                  color a, color b);
+
+#endif
@@ -0,0 +1,355 @@
+#include "rasterizer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+
+/*
+ * A renderer that keeps processed vertices between draws must draw exactly
+ * what a new renderer draws, whatever it drew before.
+ */
+
+#define Pi 3.14159265358979323846f
+
+#define Size 96
+
+/* Vertices per side of the mesh, enough to be processed in several chunks. */
+#define GridSize 100
+
+#define IndexCount ((GridSize-1)*(GridSize-1)*6)
+
+#define VersionThreads 4
+#define VersionsPerThread 250000
+
+typedef struct cache_test {
+  renderer state;
+  framebuffer fb;
+
+  /* The same mesh, with other colors. */
+  vertex_array grid, other_grid;
+  index_array indices;
+
+  mat4 models[3];
+  mat4 view, projection;
+
+  size_t thread_count;
+} cache_test;
+
+static int make_cache_test(cache_test *t, size_t thread_count);
+static void release_cache_test(cache_test *t);
+
+static int check_epochs(cache_test *t);
+static int check_wrap(cache_test *t);
+static int check_writes(cache_test *t);
+static int check_restore(cache_test *t);
+static int check_unique_versions(void);
+static void *touch_array(void *data);
+
+/* Lets the threads touching arrays all start at once. */
+static pthread_barrier_t touch_start;
+static int compare_versions(const void *a, const void *b);
+
+static int check_draw(cache_test *t, const char *name, vertex_array *array,
+                      int model, size_t first, size_t count);
+static int draw(renderer *state, cache_test *t, vertex_array *array,
+                int model, size_t first, size_t count, color *out);
+
+int main(void) {
+  int failures = 0;
+
+  for (size_t threads = 1; threads <= 4; threads += 3) {
+    cache_test t;
+    if (make_cache_test(&t, threads) < 0) {
+      fprintf(stderr, "could not make the mesh\n");
+      return 1;
+    }
+
+    failures += check_wrap(&t);
+    failures += check_epochs(&t);
+    failures += check_writes(&t);
+    failures += check_restore(&t);
+
+    release_cache_test(&t);
+  }
+
+  failures += check_unique_versions();
+
+  if (failures == 0) printf("all checks passed\n");
+  return failures == 0 ? 0 : 1;
+}
+
+/*
+ * Draws of parts of the mesh with other transforms must not pick up vertices
+ * processed for earlier ones, including once the epoch wraps around.
+ */
+static int check_epochs(cache_test *t) {
+  size_t half = IndexCount/2 - IndexCount/2 % 3;
+  int failures = 0;
+
+  failures += check_draw(t, "whole mesh", &t->grid, 0, 0, IndexCount);
+  failures += check_draw(t, "first half", &t->grid, 1, 0, half);
+  failures += check_draw(t, "second half", &t->grid, 1, half,
+                         IndexCount - half);
+  failures += check_draw(t, "middle", &t->grid, 0, half/2, half);
+
+  return failures;
+}
+
+/*
+ * Once the epoch wraps around, vertices stamped with the epochs that come
+ * next must be stale. The renderer is new: its first draw stamps every vertex
+ * with epoch 2, which the second draw after wrapping around uses again.
+ */
+static int check_wrap(cache_test *t) {
+  size_t half = IndexCount/2 - IndexCount/2 % 3;
+  int failures = 0;
+
+  failures += check_draw(t, "before wrapping", &t->grid, 0, 0, IndexCount);
+
+  t->state.vertices.epoch = UINT32_MAX;
+  failures += check_draw(t, "wrapping", &t->grid, 1, 0, half);
+  failures += check_draw(t, "after wrapping", &t->grid, 2, 0, IndexCount);
+
+  return failures;
+}
+
+/*
+ * Writing to the array, through vertex_array_write or directly followed by
+ * vertex_array_touch, or drawing another one, must not leave stale vertices.
+ */
+static int check_writes(cache_test *t) {
+  int failures = 0;
+
+  failures += check_draw(t, "before writing", &t->grid, 0, 0, IndexCount);
+
+  vertex row[GridSize];
+  vertex_array_read(&t->grid, GridSize*40, GridSize, row);
+  for (size_t i = 0; i < GridSize; i++) row[i].pos.z += 0.3f;
+  vertex_array_write(&t->grid, GridSize*40, GridSize, row);
+
+  failures += check_draw(t, "written", &t->grid, 0, 0, IndexCount);
+
+  for (size_t i = 0; i < GridSize*GridSize; i += 3)
+    t->grid.data[i].col = (color){255, 255, 0, 255};
+  vertex_array_touch(&t->grid);
+
+  failures += check_draw(t, "touched", &t->grid, 0, 0, IndexCount);
+  failures += check_draw(t, "other array", &t->other_grid, 0, 0, IndexCount);
+  failures += check_draw(t, "back to the array", &t->grid, 0, 0, IndexCount);
+
+  return failures;
+}
+
+/*
+ * Going back to the transforms vertices were processed with keeps them, but
+ * only those transforms.
+ */
+static int check_restore(cache_test *t) {
+  int failures = 0;
+
+  failures += check_draw(t, "before restoring", &t->grid, 0, 0, IndexCount);
+
+  set_mvp(&t->state, t->models[1], t->view, t->projection);
+  set_mvp(&t->state, t->models[0], t->view, t->projection);
+
+  if (t->state.transform_version != t->state.vertices_transform_version) {
+    fprintf(stderr, "restoring the transforms dropped processed vertices\n");
+    failures++;
+  }
+
+  failures += check_draw(t, "restored", &t->grid, 0, 0, IndexCount);
+  failures += check_draw(t, "after restoring", &t->grid, 1, 0, IndexCount);
+
+  return failures;
+}
+
+/* Arrays touched on different threads all get versions of their own. */
+static int check_unique_versions(void) {
+  static unsigned long versions[VersionThreads*VersionsPerThread];
+  pthread_t threads[VersionThreads];
+
+  pthread_barrier_init(&touch_start, NULL, VersionThreads);
+
+  for (size_t i = 0; i < VersionThreads; i++) {
+    if (pthread_create(&threads[i], NULL, touch_array,
+                       versions + i*VersionsPerThread) != 0)
+      return 1;
+  }
+
+  for (size_t i = 0; i < VersionThreads; i++)
+    pthread_join(threads[i], NULL);
+
+  pthread_barrier_destroy(&touch_start);
+
+  size_t n = VersionThreads*VersionsPerThread;
+  qsort(versions, n, sizeof(*versions), compare_versions);
+
+  for (size_t i = 0; i < n; i++) {
+    if (versions[i] == 0 || (i > 0 && versions[i] == versions[i-1])) {
+      fprintf(stderr, "version %lu given twice\n", versions[i]);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static void *touch_array(void *data) {
+  unsigned long *versions = data;
+
+  vertex_array array = {0, NULL, 0};
+
+  pthread_barrier_wait(&touch_start);
+
+  for (size_t i = 0; i < VersionsPerThread; i++) {
+    vertex_array_touch(&array);
+    versions[i] = array.version;
+  }
+
+  return NULL;
+}
+
+static int compare_versions(const void *a, const void *b) {
+  unsigned long x = *(const unsigned long*)a, y = *(const unsigned long*)b;
+  return x < y ? -1 : x > y;
+}
+
+static int make_cache_test(cache_test *t, size_t thread_count) {
+  static vertex vertices[GridSize*GridSize];
+  static uint32_t indices[IndexCount];
+
+  /* A wavy sheet, with colors that differ at every vertex. */
+  for (size_t y = 0; y < GridSize; y++) {
+    for (size_t x = 0; x < GridSize; x++) {
+      float u = (float)x/(GridSize-1), v = (float)y/(GridSize-1);
+
+      vertices[x + y*GridSize] = (vertex){
+        {2*u - 1, 2*v - 1, 0.2f*sinf(8*u)*cosf(6*v)},
+        {sinf(8*u), cosf(6*v), 1},
+        {(uint8_t)(x*7), (uint8_t)(y*11), (uint8_t)(x*y), 255},
+        {u, v},
+      };
+    }
+  }
+
+  size_t n = 0;
+  for (size_t y = 0; y + 1 < GridSize; y++) {
+    for (size_t x = 0; x + 1 < GridSize; x++) {
+      uint32_t a = x + y*GridSize, b = a + 1;
+      uint32_t c = a + GridSize, d = c + 1;
+
+      indices[n++] = a; indices[n++] = b; indices[n++] = c;
+      indices[n++] = b; indices[n++] = d; indices[n++] = c;
+    }
+  }
+
+  t->models[0] = Mat4Identity;
+  t->models[1] = mat4_mul(mat4_scale((vector3){0.8, 1.2, 1}),
+                          mat4_translate((vector3){0.3, -0.2, 0.4}));
+  t->models[2] = mat4_translate((vector3){-0.4, 0.1, -0.3});
+
+  t->view = mat4_look_at((vector3){0.5, -1, 2.5}, (vector3){0, 0, 0},
+                         (vector3){0, 1, 0});
+  t->projection = mat4_perspective(Pi/3, 1, 0.1, 10);
+
+  t->thread_count = thread_count;
+
+  if (make_vertex_array(&t->grid, GridSize*GridSize, vertices) < 0)
+    return -1;
+
+  for (size_t i = 0; i < GridSize*GridSize; i++)
+    vertices[i].col = (color){(uint8_t)(i*3), 200, (uint8_t)(i/5), 255};
+
+  if (make_vertex_array(&t->other_grid, GridSize*GridSize, vertices) < 0) {
+    vertex_array_release(&t->grid);
+    return -1;
+  }
+
+  if (make_index_array(&t->indices, IndexCount, indices) < 0) {
+    vertex_array_release(&t->grid);
+    vertex_array_release(&t->other_grid);
+    return -1;
+  }
+
+  if (make_framebuffer(&t->fb, Size, Size) < 0) {
+    vertex_array_release(&t->grid);
+    vertex_array_release(&t->other_grid);
+    index_array_release(&t->indices);
+    return -1;
+  }
+
+  make_renderer(&t->state, &t->fb);
+  if (set_thread_count(&t->state, thread_count) < 0) {
+    release_cache_test(t);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void release_cache_test(cache_test *t) {
+  release_renderer(&t->state);
+  framebuffer_release(&t->fb);
+  vertex_array_release(&t->grid);
+  vertex_array_release(&t->other_grid);
+  index_array_release(&t->indices);
+}
+
+/* Compares a draw with the renderer of the test and with a new one. */
+static int check_draw(cache_test *t, const char *name, vertex_array *array,
+                      int model, size_t first, size_t count) {
+  static color expected[Size*Size], got[Size*Size];
+
+  framebuffer fb;
+  if (make_framebuffer(&fb, Size, Size) < 0) return 1;
+
+  renderer state;
+  make_renderer(&state, &fb);
+
+  int result = set_thread_count(&state, t->thread_count);
+  if (result == 0)
+    result = draw(&state, t, array, model, first, count, expected);
+  if (result == 0)
+    result = draw(&t->state, t, array, model, first, count, got);
+
+  release_renderer(&state);
+  framebuffer_release(&fb);
+
+  if (result < 0 || memcmp(expected, got, sizeof(got)) != 0) {
+    fprintf(stderr, "%s: differs with %zu threads\n", name, t->thread_count);
+    return 1;
+  }
+
+  return 0;
+}
+
+static int draw(renderer *state, cache_test *t, vertex_array *array,
+                int model, size_t first, size_t count, color *out) {
+  light l = {
+    {3, 3, 3},
+    {60, 60, 60, 255}, {200, 200, 200, 255}, {0, 150, 0, 255},
+  };
+
+  use_material(state, (material){
+    {255, 255, 255, 255}, {255, 255, 255, 255}, {255, 255, 255, 255}, 20,
+  });
+  set_lighting(state, true);
+  if (set_lights(state, 1, &l) < 0) return -1;
+
+  set_depth_test(state, true);
+
+  clear_target_color(state, (color){0, 0, 0, 255});
+  clear_target_depth(state, 1);
+
+  set_mvp(state, t->models[model], t->view, t->projection);
+
+  if (draw_elements(state, DrawTriangles, &t->indices, array,
+                    first, count) < 0)
+    return -1;
+
+  framebuffer_read(state->target, 0, 0, Size, Size, ColorRGBA, ColorTypeByte,
+                   out);
+  return 0;
+}
@@ -0,0 +1,141 @@
+#include "scene.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Framebuffers over memory of the caller, with rows further apart than their
+ * width, must hold the image every rendering path draws, and leave the
+ * padding between rows alone.
+ */
+
+/* Texels between the end of a row and the start of the next. */
+#define Padding 7
+
+#define Stride (SceneWidth + Padding)
+
+static const color padding = {0xde, 0xad, 0xbe, 0xef};
+
+static const render_path paths[] = {
+  {"scalar",             1, false, false, false, false},
+  {"threads",            4, false, false, false, false},
+  {"simd",               4, true,  false, false, false},
+  {"deferred",           4, false, true,  false, false},
+  {"hierarchical depth", 4, false, false, true,  false},
+};
+
+static int check_strides(void);
+static int check_wrapped(scene *s, const render_path *path);
+
+int main(void) {
+  int failures = 0;
+
+  failures += check_strides();
+
+  scene s;
+  if (make_scene(&s) < 0) {
+    fprintf(stderr, "could not make the scene\n");
+    return 1;
+  }
+
+  bool simd = simd_supported();
+
+  for (size_t i = 0; i < sizeof(paths)/sizeof(*paths); i++) {
+    if (paths[i].fragment_simd && !simd)
+      printf("%s: skipped, no AVX2\n", paths[i].name);
+    else
+      failures += check_wrapped(&s, &paths[i]);
+  }
+
+  release_scene(&s);
+
+  if (failures == 0) printf("all checks passed\n");
+  return failures == 0 ? 0 : 1;
+}
+
+/* Rows must hold whole colors, and at least as many as the width. */
+static int check_strides(void) {
+  static color pixels[4*8];
+  int failures = 0;
+
+  framebuffer fb;
+  if (wrap_framebuffer(&fb, 4, 4, pixels, 4*sizeof(color) + 2) == 0 ||
+      wrap_framebuffer(&fb, 4, 4, pixels, 3*sizeof(color)) == 0) {
+    fprintf(stderr, "invalid stride accepted\n");
+    failures++;
+  }
+
+  if (wrap_framebuffer(&fb, 4, 4, pixels, 8*sizeof(color)) < 0) {
+    fprintf(stderr, "valid stride rejected\n");
+    return failures + 1;
+  }
+
+  if (get_fast_clear(&fb)) {
+    fprintf(stderr, "wrapped framebuffer has fast clears\n");
+    failures++;
+  }
+
+  framebuffer_release(&fb);
+  return failures;
+}
+
+static int check_wrapped(scene *s, const render_path *path) {
+  static image reference;
+  static color pixels[Stride*SceneHeight];
+  static uint8_t read[SceneWidth*SceneHeight*4];
+
+  if (render_scene(&paths[0], s, 0, &reference) < 0) return 1;
+
+  for (size_t i = 0; i < Stride*SceneHeight; i++) pixels[i] = padding;
+
+  framebuffer fb;
+  if (wrap_framebuffer(&fb, SceneWidth, SceneHeight, pixels,
+                       Stride*sizeof(color)) < 0)
+    return 1;
+
+  renderer state;
+  make_renderer(&state, &fb);
+
+  int failures = 0;
+
+  if (set_hierarchical_depth(&fb, path->hierarchical_depth) < 0 ||
+      set_thread_count(&state, path->thread_count) < 0 ||
+      set_fragment_simd(&state, path->fragment_simd) < 0 ||
+      set_deferred_shading(&state, path->deferred) < 0) {
+    failures++;
+    goto done;
+  }
+
+  draw_scene(&state, s, 0);
+  if (path->deferred && resolve_deferred(&state) < 0) failures++;
+
+  for (size_t y = 0; y < SceneHeight && !failures; y++) {
+    const color *row = pixels + y*Stride;
+
+    if (memcmp(row, &reference.pixels[y*SceneWidth*4],
+               SceneWidth*sizeof(color)) != 0) {
+      fprintf(stderr, "%s: row %zu differs in memory\n", path->name, y);
+      failures++;
+    }
+
+    for (size_t x = SceneWidth; x < Stride && !failures; x++) {
+      if (memcmp(&row[x], &padding, sizeof(padding)) != 0) {
+        fprintf(stderr, "%s: padding of row %zu written\n", path->name, y);
+        failures++;
+      }
+    }
+  }
+
+  framebuffer_read(&fb, 0, 0, SceneWidth, SceneHeight,
+                   ColorRGBA, ColorTypeByte, read);
+  if (memcmp(read, reference.pixels, sizeof(read)) != 0) {
+    fprintf(stderr, "%s: read back differs\n", path->name);
+    failures++;
+  }
+
+done:
+  release_renderer(&state);
+  framebuffer_release(&fb);
+
+  return failures;
+}